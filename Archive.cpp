@@ -8,17 +8,312 @@
 #include "Archive.hpp"
 #include <filesystem>
 #include <cstring>
+#include <cstddef>
+#include <algorithm>
+#include <future>
+#include <tuple>
+#include <thread>
+#include <atomic>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <climits>
+#endif
 
 namespace fs = std::filesystem;
 
 namespace ECE141 {
+    namespace {
+        //index of the lowest set bit of aWord (aWord != 0)
+        size_t lowestSetBit(uint64_t aWord) {
+#if defined(_MSC_VER)
+            unsigned long theIndex = 0;
+            _BitScanForward64(&theIndex, aWord);
+            return theIndex;
+#else
+            return static_cast<size_t>(__builtin_ctzll(aWord));
+#endif
+        }
+
+        //FNV-1a checksum (used to validate superblock and directory)
+        uint32_t checksum(const void *aData, size_t aLength, uint32_t aSeed = 2166136261u) {
+            const uint8_t *theBytes = static_cast<const uint8_t*>(aData);
+            uint32_t theHash = aSeed;
+            for (size_t i = 0; i < aLength; i++) {
+                theHash = (theHash ^ theBytes[i]) * 16777619u;
+            }
+            return theHash;
+        }
+
+        //helpers to (de)serialize directory records into a flat byte buffer
+        struct ByteWriter {
+            std::vector<uint8_t> &buffer;
+
+            template<typename T>
+            ByteWriter& put(const T &aValue) {
+                const uint8_t *theBytes = reinterpret_cast<const uint8_t*>(&aValue);
+                buffer.insert(buffer.end(), theBytes, theBytes + sizeof(T));
+                return *this;
+            }
+
+            ByteWriter& putString(const std::string &aString) {
+                put(static_cast<uint16_t>(aString.size()));
+                buffer.insert(buffer.end(), aString.begin(), aString.end());
+                return *this;
+            }
+
+            ByteWriter& putBytes(const std::vector<uint8_t> &aBytes) {
+                put(static_cast<uint16_t>(aBytes.size()));
+                buffer.insert(buffer.end(), aBytes.begin(), aBytes.end());
+                return *this;
+            }
+        };
+
+        struct ByteReader {
+            const uint8_t *pos;
+            const uint8_t *end;
+
+            template<typename T>
+            bool take(T &aValue) {
+                if (size_t(end - pos) < sizeof(T)) return false;
+                memcpy(&aValue, pos, sizeof(T));
+                pos += sizeof(T);
+                return true;
+            }
+
+            bool takeString(std::string &aString) {
+                uint16_t theLength = 0;
+                if (!take(theLength) || size_t(end - pos) < theLength) return false;
+                aString.assign(reinterpret_cast<const char*>(pos), theLength);
+                pos += theLength;
+                return true;
+            }
+
+            bool takeBytes(std::vector<uint8_t> &aBytes) {
+                uint16_t theLength = 0;
+                if (!take(theLength) || size_t(end - pos) < theLength) return false;
+                aBytes.assign(pos, pos + theLength);
+                pos += theLength;
+                return true;
+            }
+        };
+
+        //covers the fields before headerChecksum, plus the extension in v4+ archives
+        uint32_t superBlockChecksum(const SuperBlock &aSuper) {
+            uint32_t theHash = checksum(&aSuper, offsetof(SuperBlock, headerChecksum));
+            if (aSuper.version >= kExtendedSuperVersion) {
+                size_t theEnd = aSuper.version >= kVolumeVersion ? sizeof(SuperBlock) : offsetof(SuperBlock, volumeCount);
+                theHash = checksum(&aSuper.metaSize, theEnd - offsetof(SuperBlock, metaSize), theHash);
+            }
+            return theHash;
+        }
+
+        //directory record (v2): [u16 nameLength][name][u64 fileSize][i64 timeStamp][u64 extentCount]{[u64 start][u64 length]}...
+        //v5 adds [u64 tailBlock][u32 tailOffset][u32 tailLength], v6 adds [u16 inlineLength][inline bytes],
+        //v8 adds [u64 sequence][u64 reads]
+        void encodeEntry(ByteWriter &aWriter, const std::string &aName, const FileEntry &anEntry, uint32_t aVersion) {
+            aWriter.putString(aName)
+                   .put(static_cast<uint64_t>(anEntry.fileSize))
+                   .put(static_cast<int64_t>(anEntry.timeStamp))
+                   .put(static_cast<uint64_t>(anEntry.extents.size()));
+            for (const auto &theExtent : anEntry.extents) {
+                aWriter.put(static_cast<uint64_t>(theExtent.start))
+                       .put(static_cast<uint64_t>(theExtent.length));
+            }
+            if (aVersion >= kTailVersion) {
+                aWriter.put(static_cast<uint64_t>(anEntry.tail.block))
+                       .put(static_cast<uint32_t>(anEntry.tail.offset))
+                       .put(static_cast<uint32_t>(anEntry.tail.length));
+            }
+            if (aVersion >= kInlineVersion) {
+                aWriter.putBytes(anEntry.inlineData);
+            }
+            if (aVersion >= kLocalityVersion) {
+                aWriter.put(static_cast<uint64_t>(anEntry.sequence))
+                       .put(static_cast<uint64_t>(anEntry.reads));
+            }
+        }
+
+        //v1 records hold one u64 per block instead of extents; both decode to extents
+        bool decodeEntry(ByteReader &aReader, uint32_t aVersion, size_t aBlockCount,
+                         std::string &aName, FileEntry &anEntry) {
+            uint64_t theSize = 0, theCount = 0;
+            int64_t theTime = 0;
+            if (!aReader.takeString(aName) || !aReader.take(theSize) ||
+                !aReader.take(theTime) || !aReader.take(theCount)) {
+                return false;
+            }
+            anEntry.fileSize = theSize;
+            anEntry.timeStamp = static_cast<time_t>(theTime);
+            for (uint64_t i = 0; i < theCount; i++) {
+                uint64_t theStart = 0, theLength = 1;
+                if (!aReader.take(theStart) || (aVersion >= 2 && !aReader.take(theLength))) {
+                    return false;
+                }
+                if (theStart <= kSuperBlockIndex || theStart + theLength > aBlockCount) {
+                    return false;
+                }
+                appendExtent(anEntry.extents, theStart, theLength);
+            }
+            if (aVersion >= kTailVersion) {
+                uint64_t theBlock = 0;
+                uint32_t theOffset = 0, theLength = 0;
+                if (!aReader.take(theBlock) || !aReader.take(theOffset) || !aReader.take(theLength)) {
+                    return false;
+                }
+                if (theLength && (theBlock <= kSuperBlockIndex || theBlock >= aBlockCount)) {
+                    return false;
+                }
+                anEntry.tail = {theLength ? theBlock : 0, theOffset, theLength};
+            }
+            if (aVersion >= kInlineVersion && !aReader.takeBytes(anEntry.inlineData)) {
+                return false;
+            }
+            if (aVersion >= kLocalityVersion && (!aReader.take(anEntry.sequence) || !aReader.take(anEntry.reads))) {
+                return false;
+            }
+            return true;
+        }
+
+        //every block a file uses (its runs, plus its tail block)
+        std::vector<Extent> entryBlocks(const FileEntry &anEntry) {
+            std::vector<Extent> theBlocks = anEntry.extents;
+            if (anEntry.tail.length) theBlocks.push_back({anEntry.tail.block, 1});
+            return theBlocks;
+        }
+
+        //split extents into runs of at most kMaxRunBlocks (bounds the I/O buffer)
+        //visitor gets (first block, block count, position of first block within the file)
+        const size_t kMaxRunBlocks = 1024;
+
+        template<typename Visitor>
+        bool eachRun(const std::vector<Extent> &anExtents, Visitor aVisitor) {
+            size_t thePos = 0;
+            for (const auto &theExtent : anExtents) {
+                for (size_t theOffset = 0; theOffset < theExtent.length; theOffset += kMaxRunBlocks) {
+                    size_t theCount = std::min(kMaxRunBlocks, theExtent.length - theOffset);
+                    if (!aVisitor(theExtent.start + theOffset, theCount, thePos)) return false;
+                    thePos += theCount;
+                }
+            }
+            return true;
+        }
+
+        //a relocation's copy is still good: same add (a re-add gets a new sequence, maybe the same run) and same blocks
+        bool isUnchanged(const FileEntry &anEntry, const std::vector<Extent> &anExtents, uint64_t aSequence) {
+            return anEntry.sequence == aSequence &&
+                   std::equal(anExtents.begin(), anExtents.end(), anEntry.extents.begin(), anEntry.extents.end(),
+                              [](const Extent &a, const Extent &b) { return a.start == b.start && a.length == b.length; });
+        }
+
+        //set on background compactor threads, whose passes don't notify observers
+        thread_local bool isCompactorThread = false;
+
+        //block header as written by format v1/v2 archives (8-bit block numbers, 32-bit file size)
+        struct LegacyHeader {
+            BlockMode mode;
+            BlockType type;
+            uint8_t blockNumber;
+            uint8_t blockCount;
+            char filename[80];
+            uint32_t fileSize;
+            int64_t timeStamp;
+        };
+        static_assert(sizeof(LegacyHeader) == 96, "LegacyHeader must match the v1/v2 on-disk header");
+
+        bool usesLegacyHeaders(uint32_t aVersion) {
+            return aVersion <= kLegacyHeaderVersion;
+        }
+
+        //policy bits of SuperBlock::flags (unknown values fall back to first fit)
+        AllocationPolicy allocationPolicy(uint32_t aFlags) {
+            uint32_t thePolicy = (aFlags & kAllocationMask) >> kAllocationShift;
+            return thePolicy <= uint32_t(AllocationPolicy::logStructured) ? AllocationPolicy(thePolicy)
+                                                                           : AllocationPolicy::firstFit;
+        }
+
+        //header of a shared tail block (no single owner, so no name/size)
+        BlockHeader tailHeader() {
+            BlockHeader theHeader;
+            theHeader.mode = BlockMode::inUse;
+            theHeader.type = BlockType::tail;
+            return theHeader;
+        }
+
+        //recovery reads about this many bytes per call, whatever the block size
+        size_t scanChunkBlocks(const BlockGeometry &aGeometry) {
+            return std::max<size_t>(1, (256 * 1024) / aGeometry.blockSize);
+        }
+
+        //one file generation found by a recovery scan (name + timestamp tell re-adds apart)
+        struct ScannedFile {
+            size_t fileSize{0};
+            size_t blockCount{0};
+            std::map<size_t, size_t> blocks; //blockNumber -> block index
+        };
+        using ScanKey = std::pair<std::string, time_t>;
+        using ScanResult = std::map<ScanKey, ScannedFile>;
+
+        //scan headers of blocks [aFirst, aLast) with positional reads (scans share the device, not a cursor)
+        ScanResult scanHeaders(const BlockDevice &aDevice, BlockGeometry aGeometry, size_t aFirst, size_t aLast) {
+            ScanResult theResult;
+            size_t theChunkBlocks = scanChunkBlocks(aGeometry);
+            std::vector<uint8_t> theChunk(theChunkBlocks * aGeometry.blockSize);
+            BlockHeader theBlock;
+            aLast = std::min(aLast, aDevice.size() / aGeometry.blockSize); //a torn last block isn't read
+
+            for (size_t theStart = aFirst; theStart < aLast; theStart += theChunkBlocks) {
+                size_t theCount = std::min(theChunkBlocks, aLast - theStart);
+                if (!aDevice.readAt(theChunk.data(), theStart * aGeometry.blockSize, theCount * aGeometry.blockSize)) break;
+
+                for (size_t i = 0; i < theCount; i++) {
+                    if (!aGeometry.decodeHeader(theChunk.data() + i * aGeometry.blockSize, theBlock)) continue;
+                    if (theBlock.mode != BlockMode::inUse || theBlock.type != BlockType::data) continue;
+                    if (theBlock.filename.empty() || theBlock.blockNumber >= theBlock.blockCount) continue;
+
+                    auto &theFile = theResult[{theBlock.filename, theBlock.timeStamp}];
+                    theFile.fileSize = theBlock.fileSize;
+                    theFile.blockCount = theBlock.blockCount;
+                    theFile.blocks[theBlock.blockNumber] = theStart + i;
+                }
+            }
+            return theResult;
+        }
+
+        //sidecar listing a multi-volume archive's other files, one path per line
+        constexpr const char *kVolumeListSuffix = ".volumes";
+
+        std::vector<std::string> readVolumeList(const std::string &aPath) {
+            std::vector<std::string> thePaths;
+            std::ifstream theList(aPath);
+            for (std::string theLine; std::getline(theList, theLine);) {
+                if (!theLine.empty()) thePaths.push_back(theLine);
+            }
+            return thePaths;
+        }
+
+        bool writeVolumeList(const std::string &aPath, const std::vector<std::string> &aPaths) {
+            std::ofstream theList(aPath, std::ios::trunc);
+            for (const auto &thePath : aPaths) theList << thePath << '\n';
+            theList.flush();
+            return theList.good() && Journal::syncPath(aPath);
+        }
+    }
+
     // Default implementation for ArchiveObserver
     void ArchiveObserver::operator()(ActionType anAction, const std::string &aName, bool status) {
         // Default implementation does nothing, subclasses will override
     }
 
     // Archive constructor
-    Archive::Archive(const std::string &aFullPath, AccessMode aMode) 
+    template<size_t BlockSize, size_t MetaSize>
+    BasicArchive<BlockSize, MetaSize>::BasicArchive(const std::string &aFullPath, AccessMode aMode) 
     : aPath(aFullPath), mode(aMode) {
         // Ensure path ends with .arc extension
         if (aPath.substr(aPath.length() - 4) != ".arc") {
@@ -27,454 +322,3444 @@ namespace ECE141 {
     }
 
     // Archive destructor
-    Archive::~Archive() {
-        if (stream.is_open()) {
-            stream.close();
+    template<size_t BlockSize, size_t MetaSize>
+    BasicArchive<BlockSize, MetaSize>::~BasicArchive() {
+        stopCompactor();
+        stopFlusher();
+        if (journal.isOpen()) {
+            journal.close(checkpoint().isOK()); //clean shutdown: everything is in the directory
         }
+        device.close();
+        unmapLocked();
     }
 
     //--------------------------------------------------------------------------------
     //OPENING/CLOSING ARCHIVES
     //--------------------------------------------------------------------------------
     // Static factory method to create a new archive
-    ArchiveStatus<std::shared_ptr<Archive>> Archive::createArchive(const std::string &anArchiveName) {
-        std::string theFullPath = anArchiveName + ".arc";
+    template<size_t BlockSize, size_t MetaSize>
+    ArchiveStatus<std::shared_ptr<BasicArchive<BlockSize, MetaSize>>> BasicArchive<BlockSize, MetaSize>::createArchive(const std::string &anArchiveName,
+                                                                   const ArchiveOptions &anOptions) {
+        std::string theFullPath = makeArchivePath(anArchiveName);
         
-        // Create a new archive file (truncate/erase if exists)
-        std::fstream theStream(theFullPath, std::ios::binary | std::ios::out | std::ios::trunc);
-        if (!theStream.is_open()) {
-            return ArchiveStatus<std::shared_ptr<Archive>>(ArchiveErrors::fileOpenError);
+        //fixed-geometry instantiations ignore the size/layout options
+        BlockGeometry theGeometry = defaultGeometry();
+        if constexpr (!kFixedGeometry) {
+            theGeometry.blockSize = anOptions.blockSize;
+            theGeometry.metaSize = anOptions.layout == BlockLayout::headerless ? 0 : kMetaSize;
         }
-        theStream.close();
-        
-        // Create and return a new Archive object
-        auto theArchive = std::make_shared<Archive>(anArchiveName, AccessMode::AsNew);
-        theArchive->stream.open(theFullPath, std::ios::binary | std::ios::in | std::ios::out);
-        
-        if (!theArchive->stream.is_open()) {
-            return ArchiveStatus<std::shared_ptr<Archive>>(ArchiveErrors::fileOpenError);
+        if (!theGeometry.isValid()) {
+            return ArchiveStatus<std::shared_ptr<BasicArchive<BlockSize, MetaSize>>>(ArchiveErrors::badBlockLength);
+        }
+
+        // Create and return a new Archive object (truncate/erase the file if it exists)
+        auto theArchive = std::make_shared<BasicArchive>(anArchiveName, AccessMode::AsNew);
+        if (!theArchive->device.open(theFullPath, true)) {
+            return ArchiveStatus<std::shared_ptr<BasicArchive<BlockSize, MetaSize>>>(ArchiveErrors::fileOpenError);
+        }
+
+        //extra volumes: <directory>/<name>.arc.<n>, listed next to the .arc so openArchive finds them
+        std::error_code theError;
+        fs::remove(theFullPath + kVolumeListSuffix, theError); //left by an older archive of this name
+        if (!anOptions.volumes.empty()) {
+            std::vector<std::string> thePaths;
+            for (size_t i = 0; i < anOptions.volumes.size(); i++) {
+                std::string theName = fs::path(theFullPath).filename().string() + "." + std::to_string(i + 1);
+                thePaths.push_back((fs::path(anOptions.volumes[i]) / theName).string());
+            }
+            theArchive->stripeBlocks = std::max<size_t>(64, anOptions.stripeBlocks / 64 * 64);
+            if (!theArchive->openVolumes(thePaths, true) || !writeVolumeList(theFullPath + kVolumeListSuffix, thePaths)) {
+                return ArchiveStatus<std::shared_ptr<BasicArchive<BlockSize, MetaSize>>>(ArchiveErrors::fileOpenError);
+            }
+        }
+
+        // Write superblock + empty directory so the archive can be reopened
+        theArchive->geometry = theGeometry;
+        theArchive->flags = (anOptions.tailPacking ? kTailPackingFlag : 0) |
+                            (anOptions.inlineFiles ? kInlineFilesFlag : 0) |
+                            (anOptions.punchHoles ? kHolePunchFlag : 0) |
+                            (anOptions.journal ? kJournalFlag : 0) |
+                            (static_cast<uint32_t>(anOptions.allocation) << kAllocationShift);
+        theArchive->blockManager.reset(1, anOptions.segmentBlocks);
+        theArchive->blockManager.setPolicy(anOptions.allocation);
+        if (!theArchive->saveDirectory().isOK()) {
+            return ArchiveStatus<std::shared_ptr<BasicArchive<BlockSize, MetaSize>>>(ArchiveErrors::fileWriteError);
+        }
+        theArchive->reservedEnd = theGeometry.blockSize;
+        theArchive->growth = anOptions.growth;
+        theArchive->reserveSpace(anOptions.initialCapacity, false);
+        theArchive->setDurability(anOptions.durability);
+        theArchive->setMemoryMapped(anOptions.memoryMapped);
+        if (!theArchive->openJournal(true)) {
+            return ArchiveStatus<std::shared_ptr<BasicArchive<BlockSize, MetaSize>>>(ArchiveErrors::fileWriteError);
         }
+        theArchive->setCompactor(anOptions.compactor);
         
-        return ArchiveStatus<std::shared_ptr<Archive>>(theArchive);
+        return ArchiveStatus<std::shared_ptr<BasicArchive<BlockSize, MetaSize>>>(theArchive);
     }
 
     // Static factory method to open an existing archive
-    ArchiveStatus<std::shared_ptr<Archive>> Archive::openArchive(const std::string &anArchiveName) {
-        std::string theFullPath = anArchiveName + ".arc";
+    template<size_t BlockSize, size_t MetaSize>
+    ArchiveStatus<std::shared_ptr<BasicArchive<BlockSize, MetaSize>>> BasicArchive<BlockSize, MetaSize>::openArchive(const std::string &anArchiveName) {
+        std::string theFullPath = makeArchivePath(anArchiveName);
         
         // Check if file exists
         if (!fs::exists(theFullPath)) {
-            return ArchiveStatus<std::shared_ptr<Archive>>(ArchiveErrors::fileNotFound);
+            return ArchiveStatus<std::shared_ptr<BasicArchive<BlockSize, MetaSize>>>(ArchiveErrors::fileNotFound);
         }
         
         // Open the existing archive
-        auto theArchive = std::make_shared<Archive>(anArchiveName, AccessMode::AsExisting);
-        theArchive->stream.open(theFullPath, std::ios::binary | std::ios::in | std::ios::out);
-        
-        if (!theArchive->stream.is_open()) {
-            return ArchiveStatus<std::shared_ptr<Archive>>(ArchiveErrors::fileOpenError);
+        auto theArchive = std::make_shared<BasicArchive>(anArchiveName, AccessMode::AsExisting);
+        if (!theArchive->device.open(theFullPath)) {
+            return ArchiveStatus<std::shared_ptr<BasicArchive<BlockSize, MetaSize>>>(ArchiveErrors::fileOpenError);
+        }
+
+        // Load superblock + directory (one read each, no block scan)
+        //(badData = ours but damaged: left alone, recoverArchive is the caller's call since the
+        //header scan can't bring back inline/tail-packed files or unreplayed journal records)
+        auto theLoad = theArchive->loadDirectory();
+        if (theLoad.getError() == ArchiveErrors::badArchive) {
+            theLoad = theArchive->adoptBaseline(); //no magic: maybe an archive from before the superblock
+        }
+        if (!theLoad.isOK()) {
+            return ArchiveStatus<std::shared_ptr<BasicArchive<BlockSize, MetaSize>>>(theLoad.getError());
         }
+        //a journal left by a crash holds changes the directory doesn't have yet
+        if (!theArchive->openJournal(false)) {
+            return ArchiveStatus<std::shared_ptr<BasicArchive<BlockSize, MetaSize>>>(ArchiveErrors::badData);
+        }
+        theArchive->reservedEnd = theArchive->storedBytes(); //anything reserved past EOF is a bonus
         
-        return ArchiveStatus<std::shared_ptr<Archive>>(theArchive);
+        return ArchiveStatus<std::shared_ptr<BasicArchive<BlockSize, MetaSize>>>(theArchive);
+    }
+
+    // Static factory method to open an archive by rebuilding its directory from block headers
+    template<size_t BlockSize, size_t MetaSize>
+    ArchiveStatus<std::shared_ptr<BasicArchive<BlockSize, MetaSize>>> BasicArchive<BlockSize, MetaSize>::recoverArchive(const std::string &anArchiveName,
+                                                                    size_t aThreadCount) {
+        std::string theFullPath = makeArchivePath(anArchiveName);
+        std::error_code theError;
+        size_t theFileSize = fs::file_size(theFullPath, theError);
+        if (theError) {
+            return ArchiveStatus<std::shared_ptr<BasicArchive<BlockSize, MetaSize>>>(ArchiveErrors::fileNotFound);
+        }
+
+        auto theArchive = std::make_shared<BasicArchive>(anArchiveName, AccessMode::AsRecovered);
+        if (!theArchive->device.open(theFullPath)) {
+            return ArchiveStatus<std::shared_ptr<BasicArchive<BlockSize, MetaSize>>>(ArchiveErrors::fileOpenError);
+        }
+
+        //trust the superblock's geometry/version if its header is intact, else assume defaults + file size
+        SuperBlock theSuper{};
+        bool isIntact = theArchive->device.readAt(reinterpret_cast<uint8_t*>(&theSuper), 0, sizeof(theSuper)) &&
+                        theSuper.headerChecksum == superBlockChecksum(theSuper) &&
+                        theSuper.version && theSuper.version <= kFormatVersion;
+        if (isIntact && theSuper.version >= kVolumeVersion && theSuper.volumeCount > 1) {
+            return ArchiveStatus<std::shared_ptr<BasicArchive<BlockSize, MetaSize>>>(ArchiveErrors::badMode); //see rebuildDirectory
+        }
+        if (isIntact) {
+            theArchive->formatVersion = std::max(theSuper.version, kLegacyHeaderVersion);
+            theArchive->geometry.blockSize = theSuper.blockSize;
+            theArchive->geometry.metaSize = theSuper.version >= kExtendedSuperVersion ? theSuper.metaSize : kMetaSize;
+            theArchive->geometry.legacyHeaders = usesLegacyHeaders(theArchive->formatVersion);
+            theArchive->flags = theSuper.version >= kExtendedSuperVersion ? theSuper.flags : 0;
+            if (!theArchive->hasUsableGeometry()) {
+                return ArchiveStatus<std::shared_ptr<BasicArchive<BlockSize, MetaSize>>>(ArchiveErrors::badArchive);
+            }
+        }
+        size_t theBlockCount = theFileSize / theArchive->blockSize();
+        if (isIntact && theSuper.blockCount && theSuper.blockCount <= theBlockCount) {
+            theBlockCount = theSuper.blockCount;
+        }
+
+        auto theRebuild = theArchive->rebuildDirectory(theBlockCount, aThreadCount);
+        if (!theRebuild.isOK()) {
+            return ArchiveStatus<std::shared_ptr<BasicArchive<BlockSize, MetaSize>>>(theRebuild.getError());
+        }
+        if (!theArchive->saveDirectory().isOK() || !theArchive->openJournal(true)) {
+            return ArchiveStatus<std::shared_ptr<BasicArchive<BlockSize, MetaSize>>>(ArchiveErrors::fileWriteError);
+        }
+        return ArchiveStatus<std::shared_ptr<BasicArchive<BlockSize, MetaSize>>>(theArchive);
+    }
+
+    //--------------------------------------------------------------------------------
+    //SUPERBLOCK + DIRECTORY
+    //--------------------------------------------------------------------------------
+    template<size_t BlockSize, size_t MetaSize>
+    ArchiveStatus<bool> BasicArchive<BlockSize, MetaSize>::saveDirectory(size_t aTrimTo) {
+        //snapshot + write under ioLock (and every other volume's lock): blocks written before this were
+        //allocated before the snapshot, so the resize below never cuts another writer's data
+        auto theLocks = lockVolumes();
+
+        std::vector<uint8_t> theDirectory;
+        ByteWriter theWriter{theDirectory};
+        size_t theEntryCount = 0;
+        blockManager.eachFileEntry([&](const std::string &aName, const FileEntry &anEntry) {
+            encodeEntry(theWriter, aName, anEntry, formatVersion);
+            theEntryCount++;
+        });
+        //entries first: the block count taken after covers every block they use
+        size_t theEntryBytes = theDirectory.size();
+        //v9: snapshots follow the bitmap ([u64 count]{[name][u64 entryCount][entries]}...)
+        std::vector<uint8_t> theSnapshots;
+        if (formatVersion >= kSnapshotVersion) {
+            ByteWriter theSnapshotWriter{theSnapshots};
+            std::shared_lock<std::shared_mutex> theLock(snapshotLock);
+            theSnapshotWriter.put(static_cast<uint64_t>(snapshots.size()));
+            for (const auto &theSnapshot : snapshots) {
+                theSnapshotWriter.putString(theSnapshot.first).put(static_cast<uint64_t>(theSnapshot.second.size()));
+                for (const auto &theFile : theSnapshot.second) {
+                    encodeEntry(theSnapshotWriter, theFile.first, theFile.second, formatVersion);
+                }
+            }
+        }
+        auto addBitmap = [&]() {
+            theDirectory.resize(theEntryBytes);
+            if (formatVersion < kBitmapVersion) return blockManager.getTotalBlocks();
+            std::vector<uint64_t> theBits;
+            size_t theCount = blockManager.getBitmap(theBits);
+            theWriter.put(static_cast<uint64_t>(theBits.size()));
+            for (uint64_t theWord : theBits) theWriter.put(theWord);
+            theDirectory.insert(theDirectory.end(), theSnapshots.begin(), theSnapshots.end());
+            return theCount;
+        };
+
+        //journaling: adds no longer save the directory, so a trailing one gets blocks of its own
+        //(marked used, so new data can't land on it); the previous one's blocks are free again
+        //- nobody can write them before we return (ioLock), and the new superblock is synced by then
+        bool isJournaled = journal.isOpen();
+        if (isJournaled && directoryBlocks.length) {
+            blockManager.markBlocksAsFree({directoryBlocks});
+            directoryBlocks = Extent();
+        }
+        //trimming: the new directory lands at the new end, so stop short of the live one if they'd overlap
+        //(it's free after this save, so the next save can trim the rest)
+        if (aTrimTo) {
+            size_t theEstimate = (theEntryBytes + 8 * (blockManager.getTotalBlocks() / 64 + 2)) / blockSize() + 1;
+            if (savedDirectory.length && aTrimTo + theEstimate > savedDirectory.start) {
+                aTrimTo = std::max(aTrimTo, savedDirectory.end());
+            }
+            blockManager.truncateBlocks(aTrimTo); //no-op if something past it is in use
+        }
+        size_t theBlockCount = addBitmap();
+
+        //small directories fit in the rest of block 0, otherwise they go after the last block
+        bool isInline = theDirectory.size() <= blockSize() - kSuperHeaderSize;
+        size_t theOffset = isInline ? kSuperHeaderSize : theBlockCount * blockSize();
+        if (isJournaled && !isInline) {
+            size_t theSlack = 8 * 64; //room for the bitmap to cover blocks other writers take meanwhile
+            for (;;) {
+                size_t theCount = (theDirectory.size() + theSlack + blockSize() - 1) / blockSize();
+                directoryBlocks = {blockManager.appendUsedBlocks(theCount), theCount};
+                theBlockCount = addBitmap();
+                if (theDirectory.size() <= theCount * blockSize()) break;
+                blockManager.markBlocksAsFree({directoryBlocks}); //outgrown by concurrent growth, try again
+                theSlack *= 2;
+            }
+            theOffset = directoryBlocks.start * blockSize();
+        }
+
+        SuperBlock theSuper{};
+        memcpy(theSuper.magic, kArchiveMagic, sizeof(theSuper.magic));
+        theSuper.version = formatVersion;
+        theSuper.blockSize = static_cast<uint32_t>(blockSize());
+        theSuper.blockCount = theBlockCount;
+        theSuper.entryCount = theEntryCount;
+        theSuper.directoryLength = theDirectory.size();
+        theSuper.directoryChecksum = checksum(theDirectory.data(), theDirectory.size());
+        if (formatVersion >= kExtendedSuperVersion) {
+            theSuper.metaSize = static_cast<uint32_t>(metaSize());
+            theSuper.flags = flags;
+        }
+        if (formatVersion >= kVolumeVersion) {
+            theSuper.volumeCount = static_cast<uint32_t>(volumeCount());
+            theSuper.stripeBlocks = static_cast<uint32_t>(stripeBlocks);
+        }
+        theSuper.directoryOffset = theOffset;
+        theSuper.headerChecksum = superBlockChecksum(theSuper);
+
+        //block 0 = superblock header + (inline) directory; only the used part is written
+        std::vector<uint8_t> theHeader(kSuperHeaderSize, 0);
+        memcpy(theHeader.data(), &theSuper, sizeof(theSuper));
+        if (isInline) {
+            theHeader.insert(theHeader.end(), theDirectory.begin(), theDirectory.end());
+        }
+
+        if (!isInline) {
+            if (!writeAt(theDirectory.data(), theSuper.directoryOffset, theDirectory.size(), true)) {
+                return ArchiveStatus<bool>(ArchiveErrors::fileWriteError);
+            }
+            //journaling: the directory must be on disk before the superblock that points at it
+            if (isJournaled && isSyncOn() && !syncVolumes()) {
+                return ArchiveStatus<bool>(ArchiveErrors::fileWriteError);
+            }
+        }
+        if (!device.writeAt(theHeader.data(), kSuperBlockIndex * blockSize(), theHeader.size()) ||
+            (isJournaled && isSyncOn() && !device.sync())) {
+            return ArchiveStatus<bool>(ArchiveErrors::fileWriteError);
+        }
+
+        //file always spans whole blocks: drop anything past the end (e.g. an older, longer directory),
+        //or extend a fresh block 0 that was only partly written (each volume to its share of the end)
+        size_t theEnd = isInline ? theSuper.blockCount * blockSize()
+                                 : theSuper.directoryOffset + theSuper.directoryLength;
+        std::unique_lock<std::shared_mutex> theMap(mapLock, std::defer_lock); //taken only to shrink
+        for (size_t i = 0; i < volumeCount(); i++) {
+            size_t theSize = volumeBytes(i, theEnd);
+            size_t theOldSize = volumeDevice(i).size();
+            if (theOldSize != theSize) {
+                if (theSize < theOldSize && isMemoryMapped && !theMap.owns_lock()) {
+                    theMap.lock();
+                    unmapLocked();
+                }
+                volumeDevice(i).resize(theSize);
+                reservedEnd = std::min(reservedEnd, theEnd); //shrinking drops what was reserved past the end
+            }
+        }
+        savedDirectory = isInline ? Extent() : Extent{theSuper.directoryOffset / blockSize(),
+                                                      (theSuper.directoryLength + blockSize() - 1) / blockSize()};
+        return ArchiveStatus<bool>(true);
+    }
+
+    template<size_t BlockSize, size_t MetaSize>
+    ArchiveStatus<bool> BasicArchive<BlockSize, MetaSize>::loadDirectory() {
+        SuperBlock theSuper{};
+        //superblock header sits at offset 0 whatever the block size
+        if (!device.readAt(reinterpret_cast<uint8_t*>(&theSuper), 0, sizeof(theSuper))) {
+            return ArchiveStatus<bool>(ArchiveErrors::badArchive);
+        }
+
+        if (memcmp(theSuper.magic, kArchiveMagic, sizeof(theSuper.magic)) != 0) {
+            return ArchiveStatus<bool>(ArchiveErrors::badArchive);
+        }
+        if (theSuper.headerChecksum != superBlockChecksum(theSuper)) {
+            return ArchiveStatus<bool>(ArchiveErrors::badData); //ours, but damaged
+        }
+        if (!theSuper.version || theSuper.version > kFormatVersion || !theSuper.blockCount) {
+            return ArchiveStatus<bool>(ArchiveErrors::badArchive);
+        }
+
+        //v1 directories are rewritten as v2 (same block headers); before v4 every block had a header
+        formatVersion = std::max(theSuper.version, kLegacyHeaderVersion);
+        geometry.blockSize = theSuper.blockSize;
+        geometry.metaSize = theSuper.version >= kExtendedSuperVersion ? theSuper.metaSize : kMetaSize;
+        geometry.legacyHeaders = usesLegacyHeaders(formatVersion);
+        flags = theSuper.version >= kExtendedSuperVersion ? theSuper.flags : 0;
+        if (!hasUsableGeometry()) {
+            return ArchiveStatus<bool>(ArchiveErrors::badArchive);
+        }
+        //the directory may be striped, so the other volumes open first
+        if (theSuper.version >= kVolumeVersion && theSuper.volumeCount > 1) {
+            stripeBlocks = theSuper.stripeBlocks;
+            std::vector<std::string> thePaths = readVolumeList(aPath + kVolumeListSuffix);
+            if (!stripeBlocks || thePaths.size() + 1 != theSuper.volumeCount || !openVolumes(thePaths, false)) {
+                return ArchiveStatus<bool>(ArchiveErrors::fileOpenError);
+            }
+        }
+
+        //whole directory in one sequential read
+        std::vector<uint8_t> theDirectory(theSuper.directoryLength);
+        if (!readAt(theDirectory.data(), theSuper.directoryOffset, theDirectory.size()) ||
+            checksum(theDirectory.data(), theDirectory.size()) != theSuper.directoryChecksum) {
+            return ArchiveStatus<bool>(ArchiveErrors::badData);
+        }
+        blockManager.reset(theSuper.blockCount);
+        blockManager.setPolicy(allocationPolicy(flags));
+        ByteReader theReader{theDirectory.data(), theDirectory.data() + theDirectory.size()};
+        for (uint64_t i = 0; i < theSuper.entryCount; i++) {
+            std::string theName;
+            FileEntry theEntry;
+            if (!decodeEntry(theReader, theSuper.version, theSuper.blockCount, theName, theEntry)) {
+                return ArchiveStatus<bool>(ArchiveErrors::badData);
+            }
+            blockManager.addFileEntry(theName, theEntry);
+        }
+        if (theSuper.version >= kBitmapVersion) {
+            uint64_t theWordCount = 0;
+            std::vector<uint64_t> theBits;
+            if (!theReader.take(theWordCount) || theWordCount != (theSuper.blockCount + 63) / 64) {
+                return ArchiveStatus<bool>(ArchiveErrors::badData);
+            }
+            theBits.resize(theWordCount);
+            for (auto &theWord : theBits) {
+                if (!theReader.take(theWord)) return ArchiveStatus<bool>(ArchiveErrors::badData);
+            }
+            blockManager.restoreBitmap(theBits);
+        }
+        snapshots.clear();
+        if (theSuper.version >= kSnapshotVersion) {
+            uint64_t theCount = 0;
+            if (!theReader.take(theCount)) return ArchiveStatus<bool>(ArchiveErrors::badData);
+            for (uint64_t i = 0; i < theCount; i++) {
+                std::string theName;
+                uint64_t theEntryCount = 0;
+                if (!theReader.takeString(theName) || !theReader.take(theEntryCount)) {
+                    return ArchiveStatus<bool>(ArchiveErrors::badData);
+                }
+                auto &theFrozen = snapshots[theName];
+                for (uint64_t j = 0; j < theEntryCount; j++) {
+                    std::string theFile;
+                    FileEntry theEntry;
+                    if (!decodeEntry(theReader, theSuper.version, theSuper.blockCount, theFile, theEntry)) {
+                        return ArchiveStatus<bool>(ArchiveErrors::badData);
+                    }
+                    theFrozen[theFile] = theEntry;
+                }
+            }
+        }
+        rebuildSnapshotRefs();
+
+        //journaling: keep new data off a trailing directory until the next checkpoint moves it
+        directoryBlocks = savedDirectory = Extent();
+        if (theSuper.directoryOffset >= blockSize()) {
+            savedDirectory = {theSuper.directoryOffset / blockSize(),
+                              (theSuper.directoryLength + blockSize() - 1) / blockSize()};
+        }
+        if ((flags & kJournalFlag) && savedDirectory.length) {
+            size_t theStart = savedDirectory.start;
+            size_t theEnd = savedDirectory.end();
+            if (theEnd > blockManager.getTotalBlocks()) {
+                blockManager.growBlocks(theEnd - blockManager.getTotalBlocks());
+            }
+            directoryBlocks = {theStart, theEnd - theStart};
+            blockManager.markBlocksAsUsed({directoryBlocks});
+        }
+        return ArchiveStatus<bool>(true);
+    }
+
+    //BASELINE archives (from before the superblock) are bare v1-style blocks starting at offset 0
+    //- block 0 is copied to the end so the superblock can take its place, then the directory is rebuilt
+    //  from the block headers and saved as v2 (same blocks, same headers)
+    //- removes didn't clear headers back then, so removed files come back; empty files had no blocks
+    //  and are gone. A crash before the superblock lands just copies block 0 again next open
+    template<size_t BlockSize, size_t MetaSize>
+    ArchiveStatus<bool> BasicArchive<BlockSize, MetaSize>::adoptBaseline() {
+        formatVersion = kLegacyHeaderVersion;
+        geometry.blockSize = kBlockSize;
+        geometry.metaSize = kMetaSize;
+        geometry.legacyHeaders = true;
+        flags = 0;
+        size_t theFileSize = device.size();
+        if (!hasUsableGeometry() || theFileSize % kBlockSize) {
+            return ArchiveStatus<bool>(ArchiveErrors::badArchive);
+        }
+
+        //every baseline block was written in use, so block 0 must look like one of a file's blocks
+        size_t theBlockCount = theFileSize / kBlockSize;
+        if (theBlockCount) {
+            std::vector<uint8_t> theFirst(kBlockSize);
+            BlockHeader theHeader;
+            if (!device.readAt(theFirst.data(), 0, theFirst.size()) || !geometry.decodeHeader(theFirst.data(), theHeader) ||
+                theHeader.mode != BlockMode::inUse || theHeader.type != BlockType::data || theHeader.filename.empty() ||
+                theHeader.blockNumber >= theHeader.blockCount ||
+                calculateRequiredBlocks(theHeader.fileSize) != theHeader.blockCount) {
+                return ArchiveStatus<bool>(ArchiveErrors::badArchive);
+            }
+            if (!device.writeAt(theFirst.data(), theFileSize, theFirst.size()) || !device.sync()) {
+                return ArchiveStatus<bool>(ArchiveErrors::fileWriteError);
+            }
+        }
+
+        auto theRebuild = rebuildDirectory(theBlockCount + 1, 0);
+        if (!theRebuild.isOK()) {
+            return ArchiveStatus<bool>(theRebuild.getError());
+        }
+        return saveDirectory();
+    }
+
+    template<size_t BlockSize, size_t MetaSize>
+    ArchiveStatus<size_t> BasicArchive<BlockSize, MetaSize>::rebuildDirectory(size_t aBlockCount, size_t aThreadCount) {
+        if (!metaSize() || !volumes.empty()) {
+            return ArchiveStatus<size_t>(ArchiveErrors::badMode); //header-less blocks have nothing to scan
+        }
+        if (!aThreadCount) {
+            aThreadCount = std::max(1u, std::thread::hardware_concurrency());
+        }
+        size_t theFirst = kSuperBlockIndex + 1;
+        size_t theBlocks = aBlockCount > theFirst ? aBlockCount - theFirst : 0;
+        //ranges are whole scan chunks, so no worker reads a partial chunk
+        size_t theChunkBlocks = scanChunkBlocks(geometry);
+        size_t theChunks = (theBlocks + theChunkBlocks - 1) / theChunkBlocks;
+        size_t theWorkers = std::max<size_t>(1, std::min(aThreadCount, theChunks));
+        size_t theRange = ((theChunks + theWorkers - 1) / theWorkers) * theChunkBlocks;
+
+        std::vector<std::future<ScanResult>> theScans;
+        for (size_t theStart = theFirst; theStart < aBlockCount; theStart += theRange) {
+            size_t theEnd = std::min(aBlockCount, theStart + theRange);
+            theScans.push_back(std::async(std::launch::async, scanHeaders, std::cref(device), geometry, theStart, theEnd));
+        }
+
+        //merge per-range results (same file may span ranges)
+        ScanResult theFiles;
+        for (auto &theScan : theScans) {
+            for (auto &theFound : theScan.get()) {
+                auto &theFile = theFiles[theFound.first];
+                theFile.fileSize = theFound.second.fileSize;
+                theFile.blockCount = theFound.second.blockCount;
+                theFile.blocks.insert(theFound.second.blocks.begin(), theFound.second.blocks.end());
+            }
+        }
+
+        //keep the newest complete generation of each name
+        std::map<std::string, FileEntry> theEntries;
+        for (const auto &theFound : theFiles) {
+            const ScannedFile &theFile = theFound.second;
+            if (theFile.blocks.size() != theFile.blockCount ||
+                calculateRequiredBlocks(theFile.fileSize) != theFile.blockCount) {
+                continue; //partially overwritten, skip
+            }
+            FileEntry theEntry;
+            theEntry.fileSize = theFile.fileSize;
+            theEntry.timeStamp = theFound.first.second;
+            for (const auto &theBlock : theFile.blocks) {
+                appendExtent(theEntry.extents, theBlock.second);
+            }
+            //keys are (name, time) ordered, so later generations overwrite earlier ones
+            theEntries[theFound.first.first] = theEntry;
+        }
+
+        blockManager.reset(aBlockCount);
+        blockManager.setPolicy(allocationPolicy(flags));
+        for (const auto &theEntry : theEntries) {
+            blockManager.addFileEntry(theEntry.first, theEntry.second);
+        }
+        return ArchiveStatus<size_t>(theEntries.size());
+    }
+
+    //SET ALLOCATION POLICY for later adds (existing files stay where they are)
+    template<size_t BlockSize, size_t MetaSize>
+    ArchiveStatus<bool> BasicArchive<BlockSize, MetaSize>::setAllocationPolicy(AllocationPolicy aPolicy) {
+        if (formatVersion < kExtendedSuperVersion) {
+            return ArchiveStatus<bool>(ArchiveErrors::badMode); //no flags field to keep it in
+        }
+        flags = (flags & ~kAllocationMask) | (static_cast<uint32_t>(aPolicy) << kAllocationShift);
+        blockManager.setPolicy(aPolicy);
+        return saveDirectory();
+    }
+
+    // Add an observer to the archive
+    template<size_t BlockSize, size_t MetaSize>
+    BasicArchive<BlockSize, MetaSize>& BasicArchive<BlockSize, MetaSize>::addObserver(std::shared_ptr<ArchiveObserver> anObserver) {
+        observers.push_back(anObserver);
+        return *this;
+    }
+
+    //GET FULL PATH of Archive
+    template<size_t BlockSize, size_t MetaSize>
+    ArchiveStatus<std::string> BasicArchive<BlockSize, MetaSize>::getFullPath() const {
+        return ArchiveStatus<std::string>(aPath);
+    }
+
+    //ARCHIVE PATH from an archive name (adds .arc unless caller already did)
+    template<size_t BlockSize, size_t MetaSize>
+    std::string BasicArchive<BlockSize, MetaSize>::makeArchivePath(const std::string &anArchiveName) {
+        if (fs::path(anArchiveName).extension() == ".arc") {
+            return anArchiveName;
+        }
+        return anArchiveName + ".arc";
+    }
+
+    //EXTRACT filename from a full path
+    template<size_t BlockSize, size_t MetaSize>
+    std::string BasicArchive<BlockSize, MetaSize>::extractFilename(const std::string &aFullPath) const {
+        fs::path thePath(aFullPath);
+        return thePath.filename().string();
+    }
+
+    // Calculate number of blocks needed for a file
+    template<size_t BlockSize, size_t MetaSize>
+    size_t BasicArchive<BlockSize, MetaSize>::calculateRequiredBlocks(size_t fileSize) const {
+        return (fileSize + payloadSize() - 1) / payloadSize(); // Ceiling division
+    }
+
+    // Notify all observers about an action
+    template<size_t BlockSize, size_t MetaSize>
+    void BasicArchive<BlockSize, MetaSize>::notifyObservers(ActionType anAction, const std::string &aName, bool status) {
+        if (isCompactorThread) return; //observers expect the caller's thread (see CompactorPolicy)
+        for (auto& observer : observers) {
+            (*observer)(anAction, aName, status);
+        }
+    }
+
+    //--------------------------------------------------------------------------------
+    //JOURNAL (see Journal): adds/removes log a record and wait for its batch,
+    //the directory itself is only saved at checkpoints
+    //--------------------------------------------------------------------------------
+    template<size_t BlockSize, size_t MetaSize>
+    bool BasicArchive<BlockSize, MetaSize>::openJournal(bool isFresh) {
+        if (!(flags & kJournalFlag) || !journal.open(aPath + ".journal")) {
+            return true; //no journal here: every change saves the directory instead
+        }
+        if (isFresh) {
+            //leftovers belong to an archive that's gone; the save moves a trailing directory out of harm's way
+            return journal.reset() && checkpoint().isOK();
+        }
+        bool hasRecords = journal.size() > 0;
+        return replayJournal() && (!hasRecords || checkpoint().isOK());
+    }
+
+    template<size_t BlockSize, size_t MetaSize>
+    uint64_t BasicArchive<BlockSize, MetaSize>::logChange(JournalRecord aType, const std::string &aName,
+                                                          const FileEntry *anEntry) {
+        std::vector<uint8_t> thePayload;
+        ByteWriter theWriter{thePayload};
+        theWriter.put(static_cast<uint8_t>(aType));
+        if (anEntry) encodeEntry(theWriter, aName, *anEntry, formatVersion);
+        else theWriter.putString(aName);
+        return journal.append(thePayload);
+    }
+
+    template<size_t BlockSize, size_t MetaSize>
+    ArchiveStatus<bool> BasicArchive<BlockSize, MetaSize>::commitChange(uint64_t aSequence, bool isSyncing) {
+        bool theResult = journal.commit(aSequence, [this]() {
+            return syncVolumes();
+        }, isSyncing);
+        return theResult ? ArchiveStatus<bool>(true) : ArchiveStatus<bool>(ArchiveErrors::fileWriteError);
+    }
+
+    template<size_t BlockSize, size_t MetaSize>
+    ArchiveStatus<bool> BasicArchive<BlockSize, MetaSize>::settleChange(uint64_t aSequence) {
+        switch (durability.mode) {
+            case Durability::none:
+                return aSequence ? commitChange(aSequence, false) : ArchiveStatus<bool>(true);
+            case Durability::everyChange:
+                if (aSequence) return commitChange(aSequence, true);
+                //directory was just saved, only the sync is left
+                return syncVolumes() ? ArchiveStatus<bool>(true) : ArchiveStatus<bool>(ArchiveErrors::fileWriteError);
+            case Durability::periodic:
+                hasChanges = true;
+                if (aSequence && journal.pendingBytes() >= durability.flushBytes) flushWake.notify_one();
+                return ArchiveStatus<bool>(true);
+        }
+        return ArchiveStatus<bool>(true);
+    }
+
+    template<size_t BlockSize, size_t MetaSize>
+    ArchiveStatus<bool> BasicArchive<BlockSize, MetaSize>::flush() {
+        if (!syncVolumes()) {
+            return ArchiveStatus<bool>(ArchiveErrors::fileWriteError);
+        }
+        //archive data is on disk, so the records can follow
+        if (journal.isOpen() && (!commitChange(journal.lastSequence(), false).isOK() || !journal.sync())) {
+            return ArchiveStatus<bool>(ArchiveErrors::fileWriteError);
+        }
+        return ArchiveStatus<bool>(true);
+    }
+
+    template<size_t BlockSize, size_t MetaSize>
+    void BasicArchive<BlockSize, MetaSize>::setMemoryMapped(bool isOn) {
+        isMemoryMapped = isOn; //(writes go straight to the file, so the pages already see them)
+        if (!isOn) {
+            std::unique_lock<std::shared_mutex> theMap(mapLock);
+            unmapLocked();
+        }
+    }
+
+    template<size_t BlockSize, size_t MetaSize>
+    void BasicArchive<BlockSize, MetaSize>::setDurability(const DurabilityPolicy &aPolicy) {
+        stopFlusher();
+        durability = aPolicy;
+        if (durability.mode == Durability::periodic) startFlusher();
+    }
+
+    //FLUSHER: wakes every flushMillis (or when settleChange says enough is queued) and flushes
+    template<size_t BlockSize, size_t MetaSize>
+    void BasicArchive<BlockSize, MetaSize>::startFlusher() {
+        isStopping = false;
+        flusher = std::thread([this]() {
+            std::unique_lock<std::mutex> theLock(flushLock);
+            while (!isStopping) {
+                flushWake.wait_for(theLock, std::chrono::milliseconds(durability.flushMillis));
+                if (!hasChanges.exchange(false)) continue;
+                theLock.unlock();
+                flush();
+                theLock.lock();
+            }
+        });
+    }
+
+    template<size_t BlockSize, size_t MetaSize>
+    void BasicArchive<BlockSize, MetaSize>::stopFlusher() {
+        if (!flusher.joinable()) return;
+        {
+            std::lock_guard<std::mutex> theLock(flushLock);
+            isStopping = true;
+        }
+        flushWake.notify_all();
+        flusher.join();
+        if (hasChanges.exchange(false)) flush(); //whatever the last interval left behind
+    }
+
+    template<size_t BlockSize, size_t MetaSize>
+    ArchiveStatus<bool> BasicArchive<BlockSize, MetaSize>::checkpoint(size_t aMinBytes, size_t aTrimTo) {
+        if (!journal.isOpen()) {
+            return aMinBytes ? ArchiveStatus<bool>(true) : saveDirectory(aTrimTo); //changes saved as they happen
+        }
+        std::lock_guard<std::mutex> theJournal(journalLock); //no change can slip between save and reset
+        if (journal.size() < aMinBytes) {
+            return ArchiveStatus<bool>(true);
+        }
+        auto theSave = saveDirectory(aTrimTo); //synced, along with every block written before it
+        if (!theSave.isOK()) return theSave;
+        if (!journal.reset(isSyncOn())) {
+            return ArchiveStatus<bool>(ArchiveErrors::fileWriteError);
+        }
+        return ArchiveStatus<bool>(true);
+    }
+
+    template<size_t BlockSize, size_t MetaSize>
+    ArchiveStatus<bool> BasicArchive<BlockSize, MetaSize>::storeEntry(const std::string &aName, const FileEntry &anEntry) {
+        uint64_t theSequence = 0;
+        {
+            std::lock_guard<std::mutex> theJournal(journalLock);
+            auto theAdd = blockManager.addFileEntry(aName, anEntry);
+            if (!theAdd.isOK()) return theAdd;
+            if (journal.isOpen()) theSequence = logChange(JournalRecord::added, aName, &anEntry);
+        }
+        if (!theSequence) {
+            auto theSave = saveDirectory();
+            if (!theSave.isOK()) return theSave;
+        }
+        return settleChange(theSequence);
+    }
+
+    //REPLAY: apply leftover records (in order) on top of the loaded directory, then rebuild the free map
+    //- records are "set entry"/"drop entry", so replaying ones the directory already has is harmless
+    //  (a crash between a checkpoint's save and its reset)
+    template<size_t BlockSize, size_t MetaSize>
+    bool BasicArchive<BlockSize, MetaSize>::replayJournal() {
+        std::vector<std::vector<uint8_t>> theRecords;
+        if (!journal.readRecords(theRecords)) return false;
+        if (theRecords.empty()) return true;
+
+        std::map<std::string, FileEntry> theEntries = blockManager.getAllFileEntries();
+        size_t theFileBlocks = storedBytes() / blockSize() + 1; //synced data is all on disk
+        for (const auto &theRecord : theRecords) {
+            ByteReader theReader{theRecord.data(), theRecord.data() + theRecord.size()};
+            uint8_t theType = 0;
+            std::string theName;
+            FileEntry theEntry;
+            if (!theReader.take(theType)) return false;
+            if (theType == static_cast<uint8_t>(JournalRecord::added) &&
+                decodeEntry(theReader, formatVersion, theFileBlocks, theName, theEntry)) {
+                theEntries[theName] = theEntry;
+            }
+            else if (theType == static_cast<uint8_t>(JournalRecord::removed) && theReader.takeString(theName)) {
+                theEntries.erase(theName);
+            }
+            else {
+                return false;
+            }
+        }
+
+        //blocks are in use exactly when a surviving entry (or the live directory) holds them
+        size_t theBlockCount = std::max(blockManager.getTotalBlocks(), directoryBlocks.end());
+        for (const auto &theFile : theEntries) {
+            for (const auto &theExtent : theFile.second.extents) theBlockCount = std::max(theBlockCount, theExtent.end());
+            if (theFile.second.tail.length) theBlockCount = std::max(theBlockCount, theFile.second.tail.block + 1);
+        }
+        blockManager.reset(theBlockCount);
+        for (const auto &theFile : theEntries) {
+            blockManager.addFileEntry(theFile.first, theFile.second);
+        }
+        if (directoryBlocks.length) blockManager.markBlocksAsUsed({directoryBlocks});
+        rebuildSnapshotRefs(); //files removed since the save may have left blocks only a snapshot holds
+        return true;
+    }
+
+    //--------------------------------------------------------------------------------
+    //BLOCK GEOMETRY
+    //--------------------------------------------------------------------------------
+    size_t BlockGeometry::payloadOffset() const {
+        return legacyHeaders ? sizeof(LegacyHeader) : metaSize;
+    }
+
+    bool BlockGeometry::isValid() const {
+        bool isPowerOfTwo = blockSize && !(blockSize & (blockSize - 1));
+        bool isHeaderOK = !metaSize || (metaSize >= kMinMetaSize && metaSize < blockSize);
+        return isPowerOfTwo && blockSize >= kSmallestBlockSize && blockSize <= kLargestBlockSize &&
+               isHeaderOK && (!legacyHeaders || (blockSize == kBlockSize && metaSize == kMetaSize));
+    }
+
+    void BlockGeometry::encodeHeader(const BlockHeader &aHeader, uint8_t *aBlock) const {
+        if (legacyHeaders) {
+            //caller has checked the block fits the legacy limits
+            LegacyHeader theOld{};
+            theOld.mode = aHeader.mode;
+            theOld.type = aHeader.type;
+            theOld.blockNumber = static_cast<uint8_t>(aHeader.blockNumber);
+            theOld.blockCount = static_cast<uint8_t>(aHeader.blockCount);
+            theOld.fileSize = static_cast<uint32_t>(aHeader.fileSize);
+            theOld.timeStamp = aHeader.timeStamp;
+            strncpy(theOld.filename, aHeader.filename.c_str(), sizeof(theOld.filename) - 1);
+            memcpy(aBlock, &theOld, sizeof(theOld));
+            return;
+        }
+        memset(aBlock, 0, metaSize);
+        aBlock[0] = static_cast<uint8_t>(aHeader.mode);
+        aBlock[1] = static_cast<uint8_t>(aHeader.type);
+        memcpy(aBlock + 8, &aHeader.blockNumber, sizeof(uint64_t));
+        memcpy(aBlock + 16, &aHeader.blockCount, sizeof(uint64_t));
+        memcpy(aBlock + 24, &aHeader.fileSize, sizeof(uint64_t));
+        memcpy(aBlock + 32, &aHeader.timeStamp, sizeof(int64_t));
+        size_t theNameSize = std::min(aHeader.filename.size(), metaSize - kHeaderFixedSize - 1); //keep a nullterm
+        memcpy(aBlock + kHeaderFixedSize, aHeader.filename.data(), theNameSize);
+    }
+
+    bool BlockGeometry::decodeHeader(const uint8_t *aBlock, BlockHeader &aHeader) const {
+        if (!metaSize) return false;
+        const char *theName = nullptr;
+        size_t theNameSize = 0;
+        if (legacyHeaders) {
+            LegacyHeader theOld;
+            memcpy(&theOld, aBlock, sizeof(theOld));
+            aHeader.mode = theOld.mode;
+            aHeader.type = theOld.type;
+            aHeader.blockNumber = theOld.blockNumber;
+            aHeader.blockCount = theOld.blockCount;
+            aHeader.fileSize = theOld.fileSize;
+            aHeader.timeStamp = theOld.timeStamp;
+            theName = reinterpret_cast<const char*>(aBlock + offsetof(LegacyHeader, filename));
+            theNameSize = sizeof(theOld.filename);
+        }
+        else {
+            aHeader.mode = static_cast<BlockMode>(aBlock[0]);
+            aHeader.type = static_cast<BlockType>(aBlock[1]);
+            memcpy(&aHeader.blockNumber, aBlock + 8, sizeof(uint64_t));
+            memcpy(&aHeader.blockCount, aBlock + 16, sizeof(uint64_t));
+            memcpy(&aHeader.fileSize, aBlock + 24, sizeof(uint64_t));
+            memcpy(&aHeader.timeStamp, aBlock + 32, sizeof(int64_t));
+            theName = reinterpret_cast<const char*>(aBlock + kHeaderFixedSize);
+            theNameSize = metaSize - kHeaderFixedSize;
+        }
+        //name must be null-terminated inside its field
+        const void *theEnd = memchr(theName, 0, theNameSize);
+        if (!theEnd) return false;
+        aHeader.filename.assign(theName, static_cast<const char*>(theEnd));
+        return true;
+    }
+
+//--------------------------------------------------------------------------------
+//BLOCK METHODS
+//--------------------------------------------------------------------------------
+    //READ BLOCK from the archive (decodes header, copies payload into aBlock)
+    template<size_t BlockSize, size_t MetaSize>
+    bool BasicArchive<BlockSize, MetaSize>::readBlock(Block &aBlock, size_t anIndex) {
+        RawBlock theRaw{};
+        if constexpr (!kFixedGeometry) {
+            theRaw.resize(blockSize());
+            aBlock.data.resize(payloadSize());
+        }
+        if (!readRaw(theRaw.data(), anIndex, 1)) return false;
+        if (metaSize()) geometry.decodeHeader(theRaw.data(), aBlock);
+        memcpy(aBlock.data.data(), theRaw.data() + payloadOffset(), payloadSize());
+        return true;
+    }
+
+    //WRITE BLOCK to the archive (encodes header + payload of aBlock)
+    template<size_t BlockSize, size_t MetaSize>
+    bool BasicArchive<BlockSize, MetaSize>::writeBlock(Block &aBlock, size_t anIndex) {
+        RawBlock theRaw{};
+        if constexpr (!kFixedGeometry) theRaw.resize(blockSize());
+        if (metaSize()) geometry.encodeHeader(aBlock, theRaw.data());
+        memcpy(theRaw.data() + payloadOffset(), aBlock.data.data(), std::min(aBlock.data.size(), payloadSize()));
+        return writeRaw(theRaw.data(), anIndex, 1);
+    }
+
+    //--------------------------------------------------------------------------------
+    //VOLUMES: byte offsets in the archive -> (volume file, offset in it), a stripe at a time
+    //--------------------------------------------------------------------------------
+    template<size_t BlockSize, size_t MetaSize>
+    template<typename Step>
+    bool BasicArchive<BlockSize, MetaSize>::eachStripe(size_t anOffset, size_t aLength, Step aStep) const {
+        if (volumes.empty()) return aStep(size_t(0), anOffset, aLength, size_t(0));
+        size_t theStripe = stripeBlocks * blockSize();
+        size_t theCount = volumeCount();
+        for (size_t thePos = 0; thePos < aLength;) {
+            size_t theIndex = (anOffset + thePos) / theStripe;
+            size_t theInside = (anOffset + thePos) % theStripe;
+            size_t theLength = std::min(aLength - thePos, theStripe - theInside);
+            if (!aStep(theIndex % theCount, theIndex / theCount * theStripe + theInside, theLength, thePos)) {
+                return false;
+            }
+            thePos += theLength;
+        }
+        return true;
+    }
+
+    template<size_t BlockSize, size_t MetaSize>
+    size_t BasicArchive<BlockSize, MetaSize>::volumeBytes(size_t aVolume, size_t anEnd) const {
+        if (volumes.empty()) return anEnd;
+        size_t theStripe = stripeBlocks * blockSize();
+        size_t theCount = volumeCount();
+        size_t theFull = anEnd / theStripe; //whole stripes, dealt round robin
+        size_t theBytes = (theFull / theCount + (theFull % theCount > aVolume ? 1 : 0)) * theStripe;
+        return theBytes + (theFull % theCount == aVolume ? anEnd % theStripe : 0);
+    }
+
+    template<size_t BlockSize, size_t MetaSize>
+    bool BasicArchive<BlockSize, MetaSize>::readAt(uint8_t *aBuffer, size_t anOffset, size_t aLength, bool isLocked) {
+        return eachStripe(anOffset, aLength, [&](size_t aVolume, size_t anAt, size_t aCount, size_t aPos) {
+            std::shared_lock<std::shared_mutex> theIO(volumeLock(aVolume), std::defer_lock);
+            if (!isLocked) theIO.lock();
+            return volumeDevice(aVolume).readAt(aBuffer + aPos, anAt, aCount);
+        });
+    }
+
+    template<size_t BlockSize, size_t MetaSize>
+    bool BasicArchive<BlockSize, MetaSize>::writeAt(const uint8_t *aBuffer, size_t anOffset, size_t aLength,
+                                                    bool isLocked) {
+        return eachStripe(anOffset, aLength, [&](size_t aVolume, size_t anAt, size_t aCount, size_t aPos) {
+            std::shared_lock<std::shared_mutex> theIO(volumeLock(aVolume), std::defer_lock);
+            if (!isLocked) theIO.lock();
+            return volumeDevice(aVolume).writeAt(aBuffer + aPos, anAt, aCount);
+        });
+    }
+
+    //headers (and the unused end of legacy blocks) are scattered into one scratch slot, payloads land
+    //back to back (blocks never straddle stripes)
+    template<size_t BlockSize, size_t MetaSize>
+    bool BasicArchive<BlockSize, MetaSize>::readPayloads(uint8_t *aBuffer, size_t aStart, size_t aCount) {
+        size_t theGap = blockSize() - payloadOffset() - payloadSize();
+        std::vector<uint8_t> theScratch(std::max(payloadOffset(), theGap));
+        std::vector<IOPiece> thePieces;
+        return eachStripe(aStart * blockSize(), aCount * blockSize(),
+                          [&](size_t aVolume, size_t anAt, size_t aLength, size_t aPos) {
+            thePieces.clear();
+            for (size_t i = aPos / blockSize(); i < (aPos + aLength) / blockSize(); i++) {
+                thePieces.push_back({theScratch.data(), payloadOffset()});
+                thePieces.push_back({aBuffer + i * payloadSize(), payloadSize()});
+                thePieces.push_back({theScratch.data(), theGap}); //(empty pieces are dropped)
+            }
+            std::shared_lock<std::shared_mutex> theIO(volumeLock(aVolume));
+            return volumeDevice(aVolume).readPieces(thePieces, anAt);
+        });
+    }
+
+    template<size_t BlockSize, size_t MetaSize>
+    std::vector<std::unique_lock<std::shared_mutex>> BasicArchive<BlockSize, MetaSize>::lockVolumes() {
+        std::vector<std::unique_lock<std::shared_mutex>> theLocks;
+        for (size_t i = 0; i < volumeCount(); i++) theLocks.emplace_back(volumeLock(i));
+        return theLocks;
+    }
+
+    //volumes 1.. from aPaths (isNew: create them empty)
+    template<size_t BlockSize, size_t MetaSize>
+    bool BasicArchive<BlockSize, MetaSize>::openVolumes(const std::vector<std::string> &aPaths, bool isNew) {
+        for (const auto &thePath : aPaths) {
+            Volume &theVolume = volumes.emplace_back();
+            theVolume.path = thePath;
+            if (!theVolume.device.open(thePath, isNew)) return false;
+        }
+        return true;
+    }
+
+    template<size_t BlockSize, size_t MetaSize>
+    bool BasicArchive<BlockSize, MetaSize>::syncVolumes() {
+        bool theResult = true;
+        for (size_t i = 0; i < volumeCount(); i++) theResult = volumeDevice(i).sync() && theResult;
+        return theResult;
+    }
+
+    template<size_t BlockSize, size_t MetaSize>
+    size_t BasicArchive<BlockSize, MetaSize>::storedBytes() const {
+        size_t theBytes = 0;
+        for (size_t i = 0; i < volumeCount(); i++) {
+            std::error_code theError;
+            size_t theSize = fs::file_size(volumePath(i), theError);
+            if (!theError) theBytes += theSize;
+        }
+        return theBytes;
+    }
+
+    //--------------------------------------------------------------------------------
+    //MAPPED READS: read-only mmap of every volume file, remapped as the archive grows
+    //--------------------------------------------------------------------------------
+    template<size_t BlockSize, size_t MetaSize>
+    std::shared_lock<std::shared_mutex> BasicArchive<BlockSize, MetaSize>::lockMapping(size_t anEnd) {
+        if (!isMemoryMapped) return {};
+        auto isCovered = [&]() {
+            if (mappings.size() != volumeCount()) return false;
+            for (size_t i = 0; i < volumeCount(); i++) {
+                if (mappings[i].length < volumeBytes(i, anEnd)) return false;
+            }
+            return true;
+        };
+        std::shared_lock<std::shared_mutex> theLock(mapLock);
+        if (isCovered()) return theLock;
+        theLock.unlock();
+        {
+            std::unique_lock<std::shared_mutex> theRemap(mapLock);
+            if (!isCovered()) remapLocked(); //(another reader may have beaten us to it)
+        }
+        theLock.lock();
+        if (isCovered()) return theLock;
+        return {}; //mapping failed or was dropped again meanwhile
+    }
+
+    //map each volume at its current size (files only grow while mapped; see saveDirectory/compact)
+    template<size_t BlockSize, size_t MetaSize>
+    void BasicArchive<BlockSize, MetaSize>::remapLocked() {
+        unmapLocked();
+#if defined(__unix__) || defined(__APPLE__)
+        mappings.resize(volumeCount());
+        for (size_t i = 0; i < volumeCount(); i++) {
+            int theFile = ::open(volumePath(i).c_str(), O_RDONLY);
+            if (theFile < 0) continue;
+            struct stat theStat{};
+            if (!::fstat(theFile, &theStat) && theStat.st_size > 0) {
+                size_t theLength = static_cast<size_t>(theStat.st_size);
+                void *theData = ::mmap(nullptr, theLength, PROT_READ, MAP_SHARED, theFile, 0);
+                if (theData != MAP_FAILED) mappings[i] = {static_cast<const uint8_t*>(theData), theLength};
+            }
+            ::close(theFile); //the mapping keeps its own reference
+        }
+#endif
+    }
+
+    template<size_t BlockSize, size_t MetaSize>
+    void BasicArchive<BlockSize, MetaSize>::unmapLocked() {
+#if defined(__unix__) || defined(__APPLE__)
+        for (const auto &theMapping : mappings) {
+            if (theMapping.data) ::munmap(const_cast<uint8_t*>(theMapping.data), theMapping.length);
+        }
+#endif
+        mappings.clear();
+    }
+
+    //READ RAW block bytes [aStart, aStart+aCount) straight into aBuffer
+    template<size_t BlockSize, size_t MetaSize>
+    bool BasicArchive<BlockSize, MetaSize>::readRaw(uint8_t *aBuffer, size_t aStart, size_t aCount) {
+        return readAt(aBuffer, aStart * blockSize(), aCount * blockSize());
+    }
+
+    //WRITE RAW block bytes [aStart, aStart+aCount) from aBuffer
+    template<size_t BlockSize, size_t MetaSize>
+    bool BasicArchive<BlockSize, MetaSize>::writeRaw(const uint8_t *aBuffer, size_t aStart, size_t aCount) {
+        return writeAt(aBuffer, aStart * blockSize(), aCount * blockSize());
+    }
+
+    //READ BYTES at any offset (tail fragments)
+    template<size_t BlockSize, size_t MetaSize>
+    bool BasicArchive<BlockSize, MetaSize>::readBytes(uint8_t *aBuffer, size_t anOffset, size_t aLength) {
+        return readAt(aBuffer, anOffset, aLength);
+    }
+
+    //WRITE BYTES at any offset (tail fragments)
+    template<size_t BlockSize, size_t MetaSize>
+    bool BasicArchive<BlockSize, MetaSize>::writeBytes(const uint8_t *aBuffer, size_t anOffset, size_t aLength) {
+        return writeAt(aBuffer, anOffset, aLength);
+    }
+
+    //WRITE TAIL: copy the rest of aSource into its slot (a fresh tail block gets its header first)
+    template<size_t BlockSize, size_t MetaSize>
+    bool BasicArchive<BlockSize, MetaSize>::writeTail(std::istream &aSource, const Tail &aTail) {
+        std::vector<uint8_t> theBytes(aTail.length);
+        aSource.read(reinterpret_cast<char*>(theBytes.data()), theBytes.size());
+        if (metaSize() && !aTail.offset) {
+            std::vector<uint8_t> theHeader(payloadOffset(), 0);
+            geometry.encodeHeader(tailHeader(), theHeader.data());
+            if (!writeBytes(theHeader.data(), aTail.block * blockSize(), theHeader.size())) return false;
+        }
+        return writeBytes(theBytes.data(), tailOffset(aTail), theBytes.size());
+    }
+
+    //MARK BLOCK FREE on disk (so a recovery scan doesn't resurrect removed files)
+    template<size_t BlockSize, size_t MetaSize>
+    bool BasicArchive<BlockSize, MetaSize>::markBlockFree(size_t anIndex) {
+        BlockMode theMode = BlockMode::free; //mode is the first header byte in every layout
+        return writeAt(reinterpret_cast<const uint8_t*>(&theMode), anIndex * blockSize(), sizeof(theMode));
+    }
+
+    //RELEASE BLOCKS: mark blocks free on disk, then for new adds (header-less blocks have no mode to clear)
+    template<size_t BlockSize, size_t MetaSize>
+    void BasicArchive<BlockSize, MetaSize>::releaseBlocks(std::vector<Extent> anExtents) {
+        {
+            std::unique_lock<std::shared_mutex> theSnapshots(snapshotLock); //blocks a snapshot uses are held instead
+            if (snapshotRefs.runCount()) anExtents = snapshotRefs.release(anExtents);
+        }
+        if (anExtents.empty()) return;
+        std::sort(anExtents.begin(), anExtents.end(),
+                  [](const Extent &a, const Extent &b) { return a.start < b.start; });
+        if (flags & kHolePunchFlag) {
+            //punched blocks read back as zeros, which is a free header (fall back to marking if punching fails)
+            blockManager.markBlocksAsFree(anExtents);
+            if (!punchHoles(anExtents) && metaSize()) {
+                for (const auto &theExtent : anExtents) {
+                    for (size_t block = theExtent.start; block < theExtent.end(); block++) {
+                        if (blockManager.isFree(block)) markBlockFree(block);
+                    }
+                }
+            }
+            return;
+        }
+        if (metaSize()) {
+            for (const auto &theExtent : anExtents) {
+                for (size_t block = theExtent.start; block < theExtent.end(); block++) {
+                    markBlockFree(block);
+                }
+            }
+        }
+        blockManager.markBlocksAsFree(anExtents);
+    }
+
+    //PUNCH HOLES: deallocate the free runs around anExtents (file size and block indices unchanged)
+    //- run is looked up and punched under ioLock: a block taken meanwhile can't be written until after
+    //- writing a punched block later just allocates it again
+    template<size_t BlockSize, size_t MetaSize>
+    bool BasicArchive<BlockSize, MetaSize>::punchHoles(const std::vector<Extent> &anExtents) {
+        auto theLocks = lockVolumes();
+        bool theResult = true;
+        size_t theDone = 0; //runs can cover several extents, punch each once
+        for (const auto &theExtent : anExtents) {
+            if (!theExtent.length || theExtent.end() <= theDone) continue;
+            Extent theRun = blockManager.freeRunAround(theExtent.start);
+            if (!theRun.length) continue; //already reused
+            theResult = eachStripe(theRun.start * blockSize(), theRun.length * blockSize(),
+                                   [&](size_t aVolume, size_t anAt, size_t aLength, size_t) {
+                return volumeDevice(aVolume).punch(anAt, aLength); //(false where it can't punch)
+            }) && theResult;
+            theDone = theRun.end();
+        }
+        return theResult;
+    }
+
+    //RESERVE SPACE: one fallocate per growth step instead of the filesystem extending block by block
+    //- Linux reserves past EOF (KEEP_SIZE); other POSIX systems can only reserve what's about to be written
+    template<size_t BlockSize, size_t MetaSize>
+    void BasicArchive<BlockSize, MetaSize>::reserveSpace(size_t anEnd, bool isAhead) {
+        std::lock_guard<std::shared_mutex> theIO(ioLock); //(fallocate doesn't touch data, so other volumes go on)
+        if (anEnd <= reservedEnd) return;
+#if defined(__unix__) && !defined(__APPLE__)
+#if defined(__linux__)
+        size_t theTarget = isAhead ? growth.reserveEnd(reservedEnd, anEnd) : anEnd;
+#else
+        size_t theTarget = anEnd;
+#endif
+        //each volume reserves its share of [reservedEnd, theTarget)
+        bool theResult = true;
+        for (size_t i = 0; i < volumeCount() && theResult; i++) {
+            size_t theFrom = volumeBytes(i, reservedEnd), theTo = volumeBytes(i, theTarget);
+            if (theTo > theFrom) theResult = volumeDevice(i).reserve(theFrom, theTo - theFrom);
+        }
+        if (theResult) reservedEnd = theTarget;
+#endif
+    }
+
+    template<size_t BlockSize, size_t MetaSize>
+    void BasicArchive<BlockSize, MetaSize>::setGrowthPolicy(const GrowthPolicy &aPolicy) {
+        std::lock_guard<std::shared_mutex> theIO(ioLock);
+        growth = aPolicy;
+    }
+
+    //WRITE FILE BLOCKS: copy aFileSize bytes from aSource into anExtents, one write per run
+    //- source bytes are read straight into each block's payload slot of the run buffer
+    template<size_t BlockSize, size_t MetaSize>
+    bool BasicArchive<BlockSize, MetaSize>::writeFileBlocks(std::istream &aSource, const std::string &aName,
+                                  const std::vector<Extent> &anExtents, size_t aFileSize, time_t aTime) {
+        size_t remainingSize = aFileSize;
+        size_t blocksNeeded = 0; //full blocks only, a packed tail isn't counted
+        for (const auto &theExtent : anExtents) blocksNeeded += theExtent.length;
+        size_t theBlockSize = blockSize();
+        size_t theOffset = payloadOffset();
+        std::vector<uint8_t> theRun;
+
+        return eachRun(anExtents, [&](size_t aStart, size_t aCount, size_t aPos) {
+            theRun.assign(aCount * theBlockSize, 0);
+
+            //header-less: the run is one contiguous slice of the file
+            if (!metaSize()) {
+                size_t bytesToRead = std::min(remainingSize, theRun.size());
+                aSource.read(reinterpret_cast<char*>(theRun.data()), bytesToRead);
+                remainingSize -= bytesToRead;
+                return writeRaw(theRun.data(), aStart, aCount);
+            }
+
+            BlockHeader theHeader;
+            theHeader.mode = BlockMode::inUse;
+            theHeader.blockCount = blocksNeeded;
+            theHeader.fileSize = aFileSize;
+            theHeader.timeStamp = aTime;
+            theHeader.filename = aName;
+            for (size_t i = 0; i < aCount; i++) {
+                uint8_t *theBlock = theRun.data() + i * theBlockSize;
+                theHeader.blockNumber = aPos + i;
+                geometry.encodeHeader(theHeader, theBlock);
+
+                //read data from source file
+                size_t bytesToRead = std::min(remainingSize, payloadSize());
+                aSource.read(reinterpret_cast<char*>(theBlock + theOffset), bytesToRead);
+                remainingSize -= bytesToRead;
+            }
+            return writeRaw(theRun.data(), aStart, aCount);
+        });
+    }
+
+    //READ FILE BLOCKS: copy anEntry's bytes to anOutput, one read and one write per run
+    template<size_t BlockSize, size_t MetaSize>
+    bool BasicArchive<BlockSize, MetaSize>::readFileBlocks(const FileEntry &anEntry, std::ostream &anOutput) {
+        //inline files are served from the directory, no block reads
+        if (!anEntry.inlineData.empty()) {
+            anOutput.write(reinterpret_cast<const char*>(anEntry.inlineData.data()), anEntry.inlineData.size());
+            return anOutput.good();
+        }
+
+        size_t remainingSize = anEntry.fileSize;
+        size_t theBlockSize = blockSize();
+        size_t theOffset = payloadOffset();
+
+        //mapped: payloads go from the mapped pages to anOutput, nothing read into a buffer first
+        size_t theEnd = anEntry.tail.length ? tailOffset(anEntry.tail) + anEntry.tail.length : 0;
+        for (const auto &theExtent : anEntry.extents) theEnd = std::max(theEnd, theExtent.end() * theBlockSize);
+        if (auto theMap = lockMapping(theEnd); theMap.owns_lock()) {
+            auto writeMapped = [&](size_t anAt, size_t aLength) {
+                remainingSize -= aLength;
+                return eachStripe(anAt, aLength, [&](size_t aVolume, size_t aVolumeAt, size_t aCount, size_t) {
+                    anOutput.write(reinterpret_cast<const char*>(mappedAt(aVolume, aVolumeAt)), aCount);
+                    return anOutput.good();
+                });
+            };
+            bool theResult = eachRun(anEntry.extents, [&](size_t aStart, size_t aCount, size_t) {
+                if (!metaSize()) return writeMapped(aStart * theBlockSize, std::min(remainingSize, aCount * theBlockSize));
+                for (size_t i = 0; i < aCount; i++) {
+                    if (!writeMapped((aStart + i) * theBlockSize + theOffset, std::min(remainingSize, payloadSize()))) {
+                        return false;
+                    }
+                }
+                return true;
+            });
+            return theResult && (!anEntry.tail.length || writeMapped(tailOffset(anEntry.tail), anEntry.tail.length));
+        }
+
+        std::vector<uint8_t> theRun;
+
+        bool theResult = eachRun(anEntry.extents, [&](size_t aStart, size_t aCount, size_t) {
+            //header-less: runs are the file bytes; headered: the read scatters payloads back to back
+            //around the headers, so either way the run goes out with one write
+            if (!metaSize()) {
+                theRun.resize(aCount * theBlockSize);
+                if (!readRaw(theRun.data(), aStart, aCount)) return false;
+            }
+            else {
+                theRun.resize(aCount * payloadSize());
+                if (!readPayloads(theRun.data(), aStart, aCount)) return false;
+            }
+            size_t bytesToWrite = std::min(remainingSize, theRun.size());
+            anOutput.write(reinterpret_cast<const char*>(theRun.data()), bytesToWrite);
+            remainingSize -= bytesToWrite;
+            return anOutput.good();
+        });
+        if (theResult && anEntry.tail.length) {
+            theRun.resize(anEntry.tail.length);
+            theResult = readBytes(theRun.data(), tailOffset(anEntry.tail), theRun.size()) &&
+                        anOutput.write(reinterpret_cast<const char*>(theRun.data()), theRun.size()).good();
+        }
+        return theResult;
+    }
+
+    //--------------------------------------------------------------------------------
+    //ADD FILE TO ARCHIVE
+    //--------------------------------------------------------------------------------
+    template<size_t BlockSize, size_t MetaSize>
+    ArchiveStatus<bool> BasicArchive<BlockSize, MetaSize>::add(const std::string &aFilename) {
+        ForegroundCall theCall(foregroundCalls);
+
+        // Extract just the filename part from the full path
+        std::string theName = extractFilename(aFilename);
+        
+        //check if file already exists in the archive
+        if (blockManager.findFileEntry(theName).isOK()) {
+            notifyObservers(ActionType::added, theName, false);
+            return ArchiveStatus<bool>(ArchiveErrors::fileExists);
+        }
+        
+        //open the source file
+        std::fstream sourceFile(aFilename, std::ios::in | std::ios::binary);
+        if (!sourceFile) {
+            notifyObservers(ActionType::added, theName, false);
+            return ArchiveStatus<bool>(ArchiveErrors::fileOpenError);
+        }
+        
+        //get file size and calculate blocks needed
+        sourceFile.seekg(0, std::ios::end);
+        size_t fileSize = sourceFile.tellg();
+        sourceFile.seekg(0, std::ios::beg);
+
+        //tiny files live in their directory record (written by saveDirectory, no data blocks)
+        if ((flags & kInlineFilesFlag) && fileSize && fileSize <= kInlineLimit) {
+            FileEntry theEntry;
+            theEntry.inlineData.resize(fileSize);
+            sourceFile.read(reinterpret_cast<char*>(theEntry.inlineData.data()), fileSize);
+            theEntry.fileSize = fileSize;
+            theEntry.timeStamp = time(nullptr);
+            theEntry.sequence = blockManager.nextSequence();
+            auto theStore = sourceFile.good() ? storeEntry(theName, theEntry)
+                                              : ArchiveStatus<bool>(ArchiveErrors::fileWriteError);
+            if (theStore.getError() == ArchiveErrors::fileExists) { //another thread added it meanwhile
+                notifyObservers(ActionType::added, theName, false);
+                return theStore;
+            }
+            bool theResult = theStore.isOK() && checkpoint(kJournalCheckpointBytes).isOK();
+            notifyObservers(ActionType::added, theName, theResult);
+            if (!theResult) {
+                return ArchiveStatus<bool>(ArchiveErrors::fileWriteError);
+            }
+            return ArchiveStatus<bool>(true);
+        }
+
+        //tail packing: a short last fragment goes to a shared tail block instead of its own block
+        size_t theTailLength = 0;
+        if (flags & kTailPackingFlag) {
+            theTailLength = fileSize % payloadSize();
+            if (theTailLength > payloadSize() / 2) theTailLength = 0;
+        }
+        size_t blocksNeeded = calculateRequiredBlocks(fileSize - theTailLength);
+
+        //older archives keep their 8-bit block numbers / 32-bit sizes
+        if (geometry.legacyHeaders && (blocksNeeded > UINT8_MAX || fileSize > UINT32_MAX)) {
+            notifyObservers(ActionType::added, theName, false);
+            return ArchiveStatus<bool>(ArchiveErrors::badBlockCount);
+        }
+        
+        //Find free blocks and mark them used (grows the archive when there aren't enough)
+        std::vector<Extent> freeBlocks = blockManager.takeBlocks(blocksNeeded);
+        Tail theTail;
+        std::shared_lock<std::shared_mutex> theTailBlock(relocationLock, std::defer_lock);
+        if (theTailLength) {
+            theTailBlock.lock(); //the tail block can't move until the entry pointing at it is stored
+            theTail = blockManager.placeTail(theTailLength, payloadSize());
+        }
+        //reserve the file's space (and some growth) in one go before writing it
+        size_t theLastBlock = theTail.length ? theTail.block + 1 : 0;
+        for (const auto &theExtent : freeBlocks) theLastBlock = std::max(theLastBlock, theExtent.end());
+        reserveSpace(theLastBlock * blockSize());
+        
+        //prepare and write blocks, one write per run
+        time_t currentTime = time(nullptr);
+        if (!writeFileBlocks(sourceFile, theName, freeBlocks, fileSize, currentTime) ||
+            (theTail.length && !writeTail(sourceFile, theTail))) {
+            releaseBlocks(freeBlocks);
+            if (theTail.length && blockManager.settleTail(theTail)) releaseBlocks({{theTail.block, 1}});
+            notifyObservers(ActionType::added, theName, false);
+            return ArchiveStatus<bool>(ArchiveErrors::fileWriteError);
+        }
+        
+        //store the file entry (and persist directory so a reopen sees it)
+        FileEntry theEntry;
+        theEntry.extents = freeBlocks;
+        theEntry.tail = theTail;
+        theEntry.fileSize = fileSize;
+        theEntry.timeStamp = currentTime;
+        theEntry.sequence = blockManager.nextSequence();
+        auto theStore = storeEntry(theName, theEntry);
+        if (theTail.length) {
+            if (blockManager.settleTail(theTail)) releaseBlocks({{theTail.block, 1}});
+            theTailBlock.unlock();
+        }
+        if (theStore.getError() == ArchiveErrors::fileExists) { //another thread added it meanwhile
+            releaseBlocks(freeBlocks); //our headers name the file too: clear them, or recovery brings a copy back
+            notifyObservers(ActionType::added, theName, false);
+            return theStore;
+        }
+        bool theResult = theStore.isOK() && checkpoint(kJournalCheckpointBytes).isOK();
+        notifyObservers(ActionType::added, theName, theResult);
+        if (!theResult) {
+            return ArchiveStatus<bool>(ArchiveErrors::fileWriteError);
+        }
+        return ArchiveStatus<bool>(true);
+    }
+
+    //--------------------------------------------------------------------------------
+    //EXTRACT FILE FROM ARCHIVE
+    //--------------------------------------------------------------------------------
+    template<size_t BlockSize, size_t MetaSize>
+    ArchiveStatus<bool> BasicArchive<BlockSize, MetaSize>::extract(const std::string &aFilename, const std::string &aFullPath) {
+        ForegroundCall theCall(foregroundCalls);
+        std::shared_lock<std::shared_mutex> theRead(relocationLock); //blocks can't move while we read them
+
+        // find file in archive (a copy: a concurrent remove drops the entry, its blocks wait for us)
+        auto fileBlocks = blockManager.copyFileEntry(aFilename);
+        if (!fileBlocks.isOK()) {
+            notifyObservers(ActionType::extracted, aFilename, false);
+            return ArchiveStatus<bool>(ArchiveErrors::fileNotFound);
+        }
+        
+        //get file extents (check if empty)
+        FileEntry theEntry = fileBlocks.getValue();
+        if (theEntry.extents.empty() && theEntry.fileSize > theEntry.tail.length + theEntry.inlineData.size()) {
+            notifyObservers(ActionType::extracted, aFilename, false);
+            return ArchiveStatus<bool>(ArchiveErrors::badBlock);
+        }
+
+        //open output file
+        std::fstream outputFile(aFullPath, std::ios::out | std::ios::binary | std::ios::trunc);
+        if (!outputFile) {
+            notifyObservers(ActionType::extracted, aFilename, false);
+            return ArchiveStatus<bool>(ArchiveErrors::fileOpenError);
+        }
+
+        //read each run with one read and write its payloads to output file
+        if (!readFileBlocks(theEntry, outputFile)) {
+            notifyObservers(ActionType::extracted, aFilename, false);
+            return ArchiveStatus<bool>(ArchiveErrors::badBlock);
+        }
+        outputFile.close();
+        blockManager.noteRead(aFilename);
+        notifyObservers(ActionType::extracted, aFilename, true);
+        return ArchiveStatus<bool>(true);
+    }
+
+    //--------------------------------------------------------------------------------
+    //REMOVE FILE FROM ARCHIVE
+    //--------------------------------------------------------------------------------
+    template<size_t BlockSize, size_t MetaSize>
+    ArchiveStatus<bool> BasicArchive<BlockSize, MetaSize>::remove(const std::string &aFilename) {
+        //drop the entry; its blocks stay in use until the removal is durable (journaled)
+        //and their headers are cleared, so no other add can take them too early
+        std::vector<Extent> theFreed;
+        uint64_t theSequence = 0;
+        {
+            std::lock_guard<std::mutex> theJournal(journalLock);
+            if (!blockManager.removeFileEntry(aFilename, &theFreed).isOK()) {
+                notifyObservers(ActionType::removed, aFilename, false);
+                return ArchiveStatus<bool>(ArchiveErrors::fileNotFound);
+            }
+            if (journal.isOpen()) theSequence = logChange(JournalRecord::removed, aFilename, nullptr);
+        }
+        //(even with periodic durability: its blocks mustn't be reused while a crash could bring it back)
+        if (theSequence && !commitChange(theSequence, isSyncOn()).isOK()) {
+            notifyObservers(ActionType::removed, aFilename, false);
+            return ArchiveStatus<bool>(ArchiveErrors::fileWriteError);
+        }
+
+        {
+            //extracts that found the entry before it went may still be reading these blocks
+            std::unique_lock<std::shared_mutex> theReaders(relocationLock);
+            releaseBlocks(theFreed);
+        }
+
+        bool theResult = theSequence ? checkpoint(kJournalCheckpointBytes).isOK()
+                                     : saveDirectory().isOK() && settleChange(0).isOK();
+        if (compaction.enabled && needsCompaction()) compactWake.notify_one(); //don't wait for the next check
+        notifyObservers(ActionType::removed, aFilename, theResult);
+        if (!theResult) {
+            return ArchiveStatus<bool>(ArchiveErrors::fileWriteError);
+        }
+        return ArchiveStatus<bool>(true);
+    }
+
+    //--------------------------------------------------------------------------------
+    //LIST ALL FILES IN ARCHIVE
+    //--------------------------------------------------------------------------------
+    template<size_t BlockSize, size_t MetaSize>
+    ArchiveStatus<size_t> BasicArchive<BlockSize, MetaSize>::list(std::ostream &aStream) {
+        std::map<std::string, FileEntry> theFiles; //copied under the entry lock: adds/removes may be running
+        blockManager.eachFileEntry([&](const std::string &aName, const FileEntry &anEntry) {
+            theFiles[aName] = anEntry;
+        });
+        size_t theCount = writeListing(theFiles, aStream);
+        notifyObservers(ActionType::listed, "", true);
+        return ArchiveStatus<size_t>(theCount);
+    }
+
+    template<size_t BlockSize, size_t MetaSize>
+    size_t BasicArchive<BlockSize, MetaSize>::writeListing(const std::map<std::string, FileEntry> &fileEntries,
+                                                           std::ostream &aStream) {
+        //output header with NAME/SIZE/TIMESTAMP
+        aStream << "###  name         size       date added\n";
+        aStream << "------------------------------------------------\n";
+        
+        // Output file information
+        size_t fileNumber = 1;
+        for (const auto &file : fileEntries) {
+            //size/timestamp come from the directory, no block reads needed
+            char timeBuffer[32];
+            struct tm *timeinfo = localtime(&file.second.timeStamp);
+            strftime(timeBuffer, sizeof(timeBuffer), "%Y-%m-%d %H:%M:%S", timeinfo);
+            
+            aStream << fileNumber << ".   "
+                    << file.first << "    "
+                    << file.second.fileSize << "    "
+                    << timeBuffer << "\n";
+            
+            fileNumber++;
+        }
+        return fileEntries.size();
+    }
+
+    //--------------------------------------------------------------------------------
+    //DUMP Block organization for DEBUGGING
+    //--------------------------------------------------------------------------------
+    template<size_t BlockSize, size_t MetaSize>
+    ArchiveStatus<size_t> BasicArchive<BlockSize, MetaSize>::debugDump(std::ostream &aStream) {
+        std::shared_lock<std::shared_mutex> theRead(relocationLock); //no compactor move mid-dump
+        size_t blockCount = blockManager.getTotalBlocks();
+        
+        //map block -> owning file once (instead of searching every file per block)
+        //(names are copied: entries can go once the entry lock is dropped; blocks past blockCount came later)
+        std::vector<std::string> theNames;
+        std::vector<size_t> owners(blockCount, kNoBlock);
+        std::map<size_t, size_t> theTailCounts; //tail block -> number of fragments
+        blockManager.eachFileEntry([&](const std::string &aName, const FileEntry &anEntry) {
+            for (const auto &theExtent : anEntry.extents) {
+                size_t theEnd = std::min(theExtent.end(), blockCount);
+                if (theExtent.start < theEnd) {
+                    std::fill(owners.begin() + theExtent.start, owners.begin() + theEnd, theNames.size());
+                }
+            }
+            if (anEntry.tail.length) theTailCounts[anEntry.tail.block]++;
+            theNames.push_back(aName);
+        });
+
+        // Output header
+        aStream << "###  status   name\n";
+        aStream << "-----------------------\n";
+        
+        // Examine all data blocks (block 0 is the superblock)
+        for (size_t i = kSuperBlockIndex + 1; i < blockCount; i++) {
+            aStream << i << ".   ";
+            if (owners[i] != kNoBlock) {
+                aStream << "used     " << theNames[owners[i]] << "\n";
+            }
+            else if (theTailCounts.count(i)) {
+                aStream << "used     (tails of " << theTailCounts[i] << " files)\n";
+            }
+            else if (isSnapshotBlock(i)) {
+                aStream << "used     (snapshot)\n";
+            }
+            else {
+                aStream << "empty\n";
+            }
+        }
+        
+        notifyObservers(ActionType::dumped, "", true);
+        return ArchiveStatus<size_t>(blockCount - (kSuperBlockIndex + 1));
+    }
+
+    //--------------------------------------------------------------------------------
+    //BLOCK MANAGER FUNCTIONS
+    //--------------------------------------------------------------------------------
+
+    void appendExtent(std::vector<Extent> &anExtents, size_t aStart, size_t aLength) {
+        if (!anExtents.empty() && anExtents.back().end() == aStart) {
+            anExtents.back().length += aLength;
+        }
+        else {
+            anExtents.push_back({aStart, aLength});
+        }
+    }
+
+    void BlockManager::reset(size_t aBlockCount, size_t aGroupBlocks) {
+        std::lock_guard<std::mutex> theEntries(entryLock);
+        std::lock_guard<std::mutex> theLog(logLock);
+        std::unique_lock<std::shared_mutex> theBlocks(growLock);
+        if (aGroupBlocks) groupBlocks = std::max<size_t>(64, aGroupBlocks / 64 * 64);
+        logHead = kNoBlock;
+        fileEntries.clear();
+        tailBlocks.clear();
+        openTail = 0;
+        lastSequence = 0;
+        blockTotal = 0;
+        usedBits.clear();
+        groups.clear();
+        growLocked(std::max(aBlockCount, kSuperBlockIndex + 1));
+        markRange(kSuperBlockIndex, 1, true, true);
+    }
+
+    size_t BlockManager::growBlocks(size_t aCount) {
+        std::unique_lock<std::shared_mutex> theBlocks(growLock);
+        return growLocked(aCount);
+    }
+
+    size_t BlockManager::growLocked(size_t aCount) {
+        size_t theFirst = blockTotal;
+        blockTotal += aCount;
+        usedBits.resize((blockTotal + 63) / 64, ~uint64_t(0));
+        while (groups.size() * groupBlocks < blockTotal) groups.emplace_back();
+        markRange(theFirst, aCount, false, true);
+        return theFirst;
+    }
+
+    size_t BlockManager::appendUsedBlocks(size_t aCount) {
+        std::unique_lock<std::shared_mutex> theBlocks(growLock);
+        size_t theFirst = growLocked(aCount);
+        markRange(theFirst, aCount, true, true);
+        return theFirst;
+    }
+
+    size_t BlockManager::getTotalBlocks() const {
+        std::shared_lock<std::shared_mutex> theBlocks(growLock);
+        return blockTotal;
+    }
+
+    Extent BlockManager::freeRunAround(size_t anIndex) const {
+        std::shared_lock<std::shared_mutex> theBlocks(growLock);
+        //the free run holding aBlock within its group (runs stop at group edges)
+        auto runInGroup = [&](size_t aBlock) {
+            const AllocationGroup &theGroup = groups[groupIndex(aBlock)];
+            std::lock_guard<std::mutex> theLock(theGroup.lock);
+            auto theRun = theGroup.runsByStart.upper_bound(aBlock);
+            if (theRun == theGroup.runsByStart.begin()) return Extent{aBlock, 0};
+            --theRun;
+            return aBlock < theRun->first + theRun->second ? Extent{theRun->first, theRun->second} : Extent{aBlock, 0};
+        };
+        if (anIndex >= blockTotal) return Extent{anIndex, 0};
+        Extent theResult = runInGroup(anIndex);
+        if (!theResult.length) return theResult;
+        //stitch on neighbouring groups' runs while the run touches a group edge
+        while (theResult.start && theResult.start % groupBlocks == 0) {
+            Extent thePrev = runInGroup(theResult.start - 1);
+            if (!thePrev.length) break;
+            theResult = Extent{thePrev.start, thePrev.length + theResult.length};
+        }
+        while (theResult.end() < blockTotal && theResult.end() % groupBlocks == 0) {
+            Extent theNext = runInGroup(theResult.end());
+            if (!theNext.length) break;
+            theResult.length += theNext.length;
+        }
+        return theResult;
+    }
+
+    size_t BlockManager::getGroupCount() const {
+        std::shared_lock<std::shared_mutex> theBlocks(growLock);
+        return groups.size();
+    }
+
+    std::vector<size_t> BlockManager::groupFreeCounts() const {
+        std::shared_lock<std::shared_mutex> theBlocks(growLock);
+        std::vector<size_t> theCounts;
+        for (const auto &theGroup : groups) {
+            std::lock_guard<std::mutex> theLock(theGroup.lock);
+            theCounts.push_back(theGroup.freeCount);
+        }
+        return theCounts;
+    }
+
+    size_t BlockManager::logSegment() const {
+        std::lock_guard<std::mutex> theLog(logLock);
+        std::shared_lock<std::shared_mutex> theBlocks(growLock);
+        return logHead < blockTotal ? groupIndex(logHead) : kNoBlock;
+    }
+
+    size_t BlockManager::homeGroup() const {
+        //threads get consecutive slots, so N writers start in N different groups
+        static std::atomic<size_t> theNextSlot{0};
+        thread_local size_t theSlot = theNextSlot++;
+        return groups.empty() ? 0 : theSlot % groups.size();
+    }
+
+    //split [aStart, aStart+aCount) at group boundaries, locking each group unless growLock is held exclusively
+    void BlockManager::markRange(size_t aStart, size_t aCount, bool isUsed, bool isExclusive) {
+        size_t theEnd = aStart + aCount;
+        while (aStart < theEnd) {
+            size_t theIndex = groupIndex(aStart);
+            size_t theCount = std::min(theEnd, groupEnd(theIndex)) - aStart;
+            AllocationGroup &theGroup = groups[theIndex];
+            if (isExclusive) {
+                setGroupRange(theGroup, aStart, theCount, isUsed);
+            }
+            else {
+                std::lock_guard<std::mutex> theLock(theGroup.lock);
+                setGroupRange(theGroup, aStart, theCount, isUsed);
+            }
+            aStart += theCount;
+        }
+    }
+
+    void BlockManager::setGroupRange(AllocationGroup &aGroup, size_t aStart, size_t aCount, bool isUsed) {
+        size_t theEnd = aStart + aCount;
+        if (!aCount) return;
+
+        //free run index: used ranges cut runs, freed ranges merge with their neighbours
+        auto &theRuns = aGroup.runsByStart;
+        auto theRun = theRuns.upper_bound(aStart);
+        if (theRun != theRuns.begin()) --theRun;
+        size_t theFreeStart = aStart, theFreeEnd = theEnd;
+        while (theRun != theRuns.end() && theRun->first <= theEnd) {
+            size_t theRunStart = theRun->first, theRunEnd = theRun->first + theRun->second;
+            auto theNext = std::next(theRun);
+            if (theRunEnd >= aStart && (!isUsed || (theRunEnd > aStart && theRunStart < theEnd))) {
+                removeFreeRun(aGroup, theRun);
+                if (isUsed) {
+                    if (theRunStart < aStart) addFreeRun(aGroup, theRunStart, aStart - theRunStart);
+                    if (theRunEnd > theEnd) addFreeRun(aGroup, theEnd, theRunEnd - theEnd);
+                }
+                else {
+                    theFreeStart = std::min(theFreeStart, theRunStart);
+                    theFreeEnd = std::max(theFreeEnd, theRunEnd);
+                }
+            }
+            theRun = theNext;
+        }
+        if (!isUsed) addFreeRun(aGroup, theFreeStart, theFreeEnd - theFreeStart);
+
+        while (aStart < theEnd) {
+            size_t theWord = aStart / 64, theBit = aStart % 64;
+            size_t theBits = std::min<size_t>(64 - theBit, theEnd - aStart);
+            uint64_t theMask = theBits == 64 ? ~uint64_t(0) : ((uint64_t(1) << theBits) - 1) << theBit;
+            if (isUsed) usedBits[theWord] |= theMask;
+            else usedBits[theWord] &= ~theMask;
+            aStart += theBits;
+        }
+    }
+
+    void BlockManager::addFreeRun(AllocationGroup &aGroup, size_t aStart, size_t aLength) {
+        aGroup.runsByStart[aStart] = aLength;
+        aGroup.runsBySize.insert({aLength, aStart});
+        aGroup.freeCount += aLength;
+    }
+
+    void BlockManager::removeFreeRun(AllocationGroup &aGroup, std::map<size_t, size_t>::iterator aRun) {
+        aGroup.freeCount -= aRun->second;
+        aGroup.runsBySize.erase({aRun->second, aRun->first});
+        aGroup.runsByStart.erase(aRun);
+    }
+
+    void BlockManager::rebuildFreeRuns(size_t anIndex) {
+        AllocationGroup &theGroup = groups[anIndex];
+        theGroup.runsByStart.clear();
+        theGroup.runsBySize.clear();
+        theGroup.freeCount = 0;
+        size_t theStart = 0, theLength = 0;
+        size_t theEnd = groupEnd(anIndex);
+        for (size_t i = anIndex * groupBlocks; i <= theEnd; i++) {
+            if (i < theEnd && isFreeBit(i)) {
+                if (!theLength++) theStart = i;
+            }
+            else if (theLength) {
+                addFreeRun(theGroup, theStart, theLength);
+                theLength = 0;
+            }
+        }
+    }
+
+    size_t BlockManager::skipUsedWords(size_t aWord, size_t anEnd) const {
+        while (aWord < anEnd && usedBits[aWord] == ~uint64_t(0)) aWord++;
+        return aWord;
+    }
+
+    std::vector<Extent> BlockManager::findFreeBlocks(size_t blockCount) {
+        if (policy == AllocationPolicy::logStructured) {
+            std::lock_guard<std::mutex> theLog(logLock);
+            std::shared_lock<std::shared_mutex> theBlocks(growLock);
+            return logBlocks(blockCount, false);
+        }
+        std::shared_lock<std::shared_mutex> theBlocks(growLock);
+        return searchBlocks(blockCount, false);
+    }
+
+    std::vector<Extent> BlockManager::takeBlocks(size_t aCount) {
+        std::vector<Extent> theBlocks;
+        //log writers take turns at the head (held through the grow, so appends stay in order)
+        std::unique_lock<std::mutex> theLog(logLock, std::defer_lock);
+        if (policy == AllocationPolicy::logStructured) theLog.lock();
+        {
+            std::shared_lock<std::shared_mutex> theShared(growLock);
+            theBlocks = theLog.owns_lock() ? logBlocks(aCount, true) : searchBlocks(aCount, true);
+        }
+        size_t theFound = 0;
+        for (const auto &theExtent : theBlocks) theFound += theExtent.length;
+        if (theFound < aCount) {
+            //grow + mark together, so no other writer sees the new blocks as free
+            std::unique_lock<std::shared_mutex> theGrow(growLock);
+            size_t theFirst = growLocked(aCount - theFound);
+            markRange(theFirst, aCount - theFound, true, true);
+            appendExtent(theBlocks, theFirst, aCount - theFound);
+            if (theLog.owns_lock()) logHead = kNoBlock; //still at the end
+        }
+        return theBlocks;
+    }
+
+    //sequential blocks from the log head; a used block at the head (or the segment end) sends the
+    //head to the next clean segment, so holes in partly used segments are never written
+    std::vector<Extent> BlockManager::logBlocks(size_t aCount, bool isTaking) {
+        std::vector<Extent> theResult;
+        std::vector<bool> theSeen(groups.size()); //a look (not taking) leaves clean groups clean
+        size_t theHead = logHead < blockTotal ? logHead : nextCleanGroup(0), theFound = 0; //clean space before growing
+        while (theFound < aCount && theHead < blockTotal && !theSeen[groupIndex(theHead)]) {
+            size_t theIndex = groupIndex(theHead);
+            size_t theEnd = groupEnd(theIndex), theRun = 0;
+            theSeen[theIndex] = !isTaking;
+            {
+                AllocationGroup &theGroup = groups[theIndex];
+                std::lock_guard<std::mutex> theLock(theGroup.lock);
+                while (theHead + theRun < theEnd && theFound + theRun < aCount && isFreeBit(theHead + theRun)) theRun++;
+                if (isTaking) setGroupRange(theGroup, theHead, theRun, true);
+            }
+            if (theRun) appendExtent(theResult, theHead, theRun);
+            theFound += theRun;
+            theHead += theRun;
+            if (theFound < aCount) theHead = nextCleanGroup(theIndex + 1);
+        }
+        if (isTaking) logHead = theHead < blockTotal ? theHead : kNoBlock;
+        return theResult;
+    }
+
+    //first all-free group after anIndex (wrapping round to the front), or blockTotal
+    size_t BlockManager::nextCleanGroup(size_t anIndex) const {
+        for (size_t i = 0; i < groups.size(); i++) {
+            size_t theIndex = (anIndex + i) % groups.size();
+            const AllocationGroup &theGroup = groups[theIndex];
+            std::lock_guard<std::mutex> theLock(theGroup.lock);
+            if (theGroup.freeCount && theGroup.freeCount == groupEnd(theIndex) - theIndex * groupBlocks) {
+                return theIndex * groupBlocks;
+            }
+        }
+        return blockTotal;
+    }
+
+    //policy search over groups, this thread's group first; isTaking marks blocks under the group lock
+    std::vector<Extent> BlockManager::searchBlocks(size_t aCount, bool isTaking) {
+        std::vector<Extent> theResult;
+        if (!aCount || groups.empty()) return theResult;
+        size_t theHome = homeGroup();
+
+        if (policy != AllocationPolicy::firstFit) {
+            //one span that holds the whole file (free runs of neighbouring groups join up)
+            for (int theTry = 0; theTry < 4; theTry++) { //another thread may take it between search and take
+                size_t theStart = findSpan(aCount);
+                if (theStart == kNoBlock) break;
+                if (!isTaking || takeSpan(theStart, aCount)) return {{theStart, aCount}};
+            }
+        }
+
+        //first fit, or nothing fits: fill from each group in turn
+        size_t theFound = 0;
+        for (size_t i = 0; i < groups.size() && theFound < aCount; i++) {
+            size_t theIndex = (theHome + i) % groups.size();
+            AllocationGroup &theGroup = groups[theIndex];
+            std::lock_guard<std::mutex> theLock(theGroup.lock);
+            std::vector<Extent> thePicked;
+            if (policy == AllocationPolicy::firstFit) firstFit(theIndex, aCount - theFound, thePicked);
+            else largestRuns(theGroup, aCount - theFound, thePicked);
+            for (const auto &theExtent : thePicked) {
+                if (isTaking) setGroupRange(theGroup, theExtent.start, theExtent.length, true);
+                theResult.push_back(theExtent);
+                theFound += theExtent.length;
+            }
+        }
+
+        //block order = fewest seeks on extract
+        std::sort(theResult.begin(), theResult.end(),
+                  [](const Extent &a, const Extent &b) { return a.start < b.start; });
+        std::vector<Extent> theMerged;
+        for (const auto &theExtent : theResult) appendExtent(theMerged, theExtent.start, theExtent.length);
+        return theMerged;
+    }
+
+    size_t BlockManager::findSpan(size_t aCount) const {
+        bool isBest = policy == AllocationPolicy::bestFit;
+        size_t theBest = kNoBlock, theBestLength = kNoBlock;
+        size_t theSpanStart = 0, theSpanLength = 0; //open span: free up to the end of the last group seen
+        auto closeSpan = [&]() { //true = done (contiguousFirst sees spans lowest first)
+            if (theSpanLength >= aCount && theSpanLength < theBestLength) {
+                theBest = theSpanStart;
+                theBestLength = theSpanLength;
+            }
+            theSpanLength = 0;
+            return theBest != kNoBlock && !isBest;
+        };
+        for (size_t i = 0; i < groups.size(); i++) {
+            const AllocationGroup &theGroup = groups[i];
+            std::lock_guard<std::mutex> theLock(theGroup.lock);
+            size_t theEnd = groupEnd(i);
+            const auto &theRuns = theGroup.runsByStart;
+            if (isBest) {
+                //smallest fitting run inside the group; only its edge runs can join a span
+                auto theFit = theGroup.runsBySize.lower_bound({aCount, 0});
+                if (theFit != theGroup.runsBySize.end() && theFit->first < theBestLength) {
+                    theBest = theFit->second;
+                    theBestLength = theFit->first;
+                }
+                if (theRuns.empty()) {
+                    closeSpan();
+                    continue;
+                }
+                auto theFirst = theRuns.begin();
+                if (theSpanLength && theFirst->first == theSpanStart + theSpanLength) {
+                    theSpanLength += theFirst->second;
+                    if (theFirst->first + theFirst->second == theEnd) continue; //whole group free
+                }
+                closeSpan();
+                auto theLast = std::prev(theRuns.end());
+                if (theLast->first + theLast->second == theEnd) {
+                    theSpanStart = theLast->first;
+                    theSpanLength = theLast->second;
+                }
+                continue;
+            }
+            for (const auto &theRun : theRuns) {
+                if (!theSpanLength || theRun.first != theSpanStart + theSpanLength) {
+                    if (closeSpan()) return theBest;
+                    theSpanStart = theRun.first;
+                }
+                theSpanLength += theRun.second;
+                if (theRun.first + theRun.second < theEnd && closeSpan()) return theBest;
+            }
+            if (theSpanStart + theSpanLength < theEnd && closeSpan()) return theBest;
+        }
+        closeSpan();
+        return theBest;
+    }
+
+    bool BlockManager::takeSpan(size_t aStart, size_t aCount) {
+        std::vector<std::unique_lock<std::mutex>> theLocks;
+        for (size_t i = groupIndex(aStart); i <= groupIndex(aStart + aCount - 1); i++) {
+            const AllocationGroup &theGroup = groups[i];
+            theLocks.emplace_back(theGroup.lock);
+            size_t theFrom = std::max(aStart, i * groupBlocks), theTo = std::min(aStart + aCount, groupEnd(i));
+            auto theRun = theGroup.runsByStart.upper_bound(theFrom);
+            if (theRun == theGroup.runsByStart.begin()) return false;
+            --theRun;
+            if (theRun->first + theRun->second < theTo) return false; //taken meanwhile
+        }
+        for (size_t i = groupIndex(aStart); i <= groupIndex(aStart + aCount - 1); i++) {
+            size_t theFrom = std::max(aStart, i * groupBlocks), theTo = std::min(aStart + aCount, groupEnd(i));
+            setGroupRange(groups[i], theFrom, theTo - theFrom, true);
+        }
+        return true;
+    }
+
+    //largest runs first (fewest fragments)
+    void BlockManager::largestRuns(const AllocationGroup &aGroup, size_t aCount, std::vector<Extent> &aResult) const {
+        size_t theFound = 0;
+        for (auto theRun = aGroup.runsBySize.rbegin(); theRun != aGroup.runsBySize.rend() && theFound < aCount; ++theRun) {
+            size_t theLength = std::min(theRun->first, aCount - theFound);
+            aResult.push_back({theRun->second, theLength});
+            theFound += theLength;
+        }
+    }
+
+    void BlockManager::firstFit(size_t anIndex, size_t aCount, std::vector<Extent> &aResult) const {
+        //walk free bits a word at a time (ctz finds each free run inside a word)
+        size_t theFound = 0;
+        size_t theEndWord = (groupEnd(anIndex) + 63) / 64;
+        size_t theWord = skipUsedWords(anIndex * groupBlocks / 64, theEndWord);
+        for (; theWord < theEndWord && theFound < aCount; theWord = skipUsedWords(theWord + 1, theEndWord)) {
+            uint64_t theFree = ~usedBits[theWord];
+            while (theFree && theFound < aCount) {
+                size_t theBit = lowestSetBit(theFree);
+                uint64_t theRest = ~(theFree >> theBit); //zero bits = free run starting at theBit
+                size_t theRun = theRest ? lowestSetBit(theRest) : 64 - theBit;
+                theRun = std::min(theRun, aCount - theFound);
+                appendExtent(aResult, theWord * 64 + theBit, theRun);
+                theFound += theRun;
+                theFree &= theRun + theBit >= 64 ? 0 : ~uint64_t(0) << (theBit + theRun);
+            }
+        }
+    }
+
+    size_t BlockManager::findFreeRun(size_t aCount) const {
+        //runs are split at group boundaries, so join touching runs across groups
+        std::shared_lock<std::shared_mutex> theBlocks(growLock);
+        size_t theStart = 0, theLength = 0;
+        for (const auto &theGroup : groups) {
+            std::lock_guard<std::mutex> theLock(theGroup.lock);
+            for (const auto &theRun : theGroup.runsByStart) {
+                if (!theLength || theStart + theLength != theRun.first) {
+                    theStart = theRun.first;
+                    theLength = 0;
+                }
+                theLength += theRun.second;
+                if (theLength >= aCount) return theStart;
+            }
+        }
+        return kNoBlock;
+    }
+
+    size_t BlockManager::nextFreeBlock(size_t aFrom) const {
+        std::shared_lock<std::shared_mutex> theBlocks(growLock);
+        for (size_t theIndex = aFrom / groupBlocks; theIndex < groups.size(); theIndex++) {
+            const AllocationGroup &theGroup = groups[theIndex];
+            std::lock_guard<std::mutex> theLock(theGroup.lock);
+            auto theRun = theGroup.runsByStart.upper_bound(aFrom);
+            if (theRun != theGroup.runsByStart.begin()) {
+                auto thePrev = std::prev(theRun);
+                if (thePrev->first + thePrev->second > aFrom) return aFrom;
+            }
+            if (theRun != theGroup.runsByStart.end()) return theRun->first;
+        }
+        return kNoBlock;
+    }
+
+    size_t BlockManager::lastUsedBlock(size_t aBelow) const {
+        std::shared_lock<std::shared_mutex> theBlocks(growLock);
+        size_t theBlock = std::min(aBelow, blockTotal);
+        while (theBlock--) {
+            //runs are maximal within a group: one free run to hop over, then either a used block or the group start
+            const AllocationGroup &theGroup = groups[groupIndex(theBlock)];
+            std::lock_guard<std::mutex> theLock(theGroup.lock);
+            auto theRun = theGroup.runsByStart.upper_bound(theBlock);
+            if (theRun == theGroup.runsByStart.begin()) return theBlock;
+            --theRun;
+            if (theRun->first + theRun->second <= theBlock) return theBlock;
+            theBlock = theRun->first;
+        }
+        return kNoBlock;
+    }
+
+    size_t BlockManager::claimBlocks(size_t aStart, size_t aCount) {
+        std::shared_lock<std::shared_mutex> theBlocks(growLock);
+        if (aStart >= blockTotal) return 0;
+        size_t theIndex = groupIndex(aStart);
+        AllocationGroup &theGroup = groups[theIndex];
+        std::lock_guard<std::mutex> theLock(theGroup.lock);
+        size_t theCount = 0;
+        size_t theEnd = std::min(aStart + aCount, groupEnd(theIndex));
+        while (aStart + theCount < theEnd && isFreeBit(aStart + theCount)) theCount++;
+        setGroupRange(theGroup, aStart, theCount, true);
+        return theCount;
+    }
+
+    bool BlockManager::truncateBlocks(size_t aCount) {
+        std::unique_lock<std::shared_mutex> theBlocks(growLock);
+        aCount = std::max(aCount, kSuperBlockIndex + 1);
+        if (aCount >= blockTotal) return aCount == blockTotal;
+        for (size_t i = aCount; i < blockTotal; i++) {
+            if (!isFreeBit(i)) return false;
+        }
+        blockTotal = aCount;
+        usedBits.resize((blockTotal + 63) / 64);
+        if (blockTotal % 64) usedBits.back() |= ~uint64_t(0) << (blockTotal % 64); //padding stays "used"
+        while (groups.size() * groupBlocks >= blockTotal + groupBlocks) groups.pop_back();
+        rebuildFreeRuns(groups.size() - 1);
+        return true;
+    }
+
+    size_t BlockManager::countFreeBlocks() const {
+        std::shared_lock<std::shared_mutex> theBlocks(growLock);
+        size_t theFree = 0;
+        for (const auto &theGroup : groups) {
+            std::lock_guard<std::mutex> theLock(theGroup.lock);
+            theFree += theGroup.freeCount;
+        }
+        return theFree;
+    }
+
+    bool BlockManager::isFree(size_t anIndex) const {
+        std::shared_lock<std::shared_mutex> theBlocks(growLock);
+        if (anIndex >= blockTotal) return false;
+        std::lock_guard<std::mutex> theLock(groups[groupIndex(anIndex)].lock);
+        return isFreeBit(anIndex);
+    }
+
+    size_t BlockManager::getBitmap(std::vector<uint64_t> &aBits) const {
+        std::shared_lock<std::shared_mutex> theBlocks(growLock);
+        aBits.assign(usedBits.size(), 0);
+        size_t theWordsPerGroup = groupBlocks / 64;
+        for (size_t i = 0; i < groups.size(); i++) {
+            std::lock_guard<std::mutex> theLock(groups[i].lock);
+            size_t theFirst = i * theWordsPerGroup;
+            size_t theLast = std::min(aBits.size(), theFirst + theWordsPerGroup);
+            std::copy(usedBits.begin() + theFirst, usedBits.begin() + theLast, aBits.begin() + theFirst);
+        }
+        return blockTotal;
+    }
+
+    bool BlockManager::restoreBitmap(const std::vector<uint64_t> &aBits) {
+        std::unique_lock<std::shared_mutex> theBlocks(growLock);
+        if (aBits.size() != usedBits.size()) return false;
+        for (size_t i = 0; i < aBits.size(); i++) usedBits[i] |= aBits[i];
+        for (size_t i = 0; i < groups.size(); i++) rebuildFreeRuns(i);
+        return true;
+    }
+
+    ArchiveStatus<bool> BlockManager::markBlocksAsUsed(const std::vector<Extent>& extents) {
+        std::shared_lock<std::shared_mutex> theBlocks(growLock);
+        for (const auto &theExtent : extents) {
+            if (theExtent.end() > blockTotal) {
+                return ArchiveStatus<bool>(ArchiveErrors::badBlockIndex);
+            }
+            markRange(theExtent.start, theExtent.length, true);
+        }
+        return ArchiveStatus<bool>(true);
+    }
+
+    ArchiveStatus<bool> BlockManager::markBlocksAsFree(const std::vector<Extent>& extents) {
+        std::shared_lock<std::shared_mutex> theBlocks(growLock);
+        for (const auto &theExtent : extents) {
+            if (theExtent.end() > blockTotal) {
+                return ArchiveStatus<bool>(ArchiveErrors::badBlockIndex);
+            }
+            markRange(theExtent.start, theExtent.length, false);
+        }
+        return ArchiveStatus<bool>(true);
+    }
+
+    ArchiveStatus<bool> BlockManager::addFileEntry(const std::string& filename, const FileEntry& anEntry) {
+        std::lock_guard<std::mutex> theEntries(entryLock);
+        auto file = fileEntries.find(filename);
+        if (file != fileEntries.end()) {
+            return ArchiveStatus<bool>(ArchiveErrors::fileExists);
+        }
+
+        std::shared_lock<std::shared_mutex> theBlocks(growLock);
+        for (const auto &theExtent : anEntry.extents) {
+            if (theExtent.end() > blockTotal) {
+                return ArchiveStatus<bool>(ArchiveErrors::badBlockIndex);
+            }
+        }
+
+        if (anEntry.tail.length && anEntry.tail.block >= blockTotal) {
+            return ArchiveStatus<bool>(ArchiveErrors::badBlockIndex);
+        }
+
+        fileEntries[filename] = anEntry;
+        lastSequence = std::max(lastSequence, anEntry.sequence);
+
+        //update block status
+        for (const auto &theExtent : anEntry.extents) {
+            markRange(theExtent.start, theExtent.length, true);
+        }
+        if (const Tail &theTail = anEntry.tail; theTail.length) {
+            markRange(theTail.block, 1, true);
+            TailUsage &theUsage = tailBlocks[theTail.block];
+            theUsage.end = std::max(theUsage.end, theTail.offset + theTail.length);
+            theUsage.live += theTail.length;
+            if (!openTail) openTail = theTail.block;
+        }
+
+        return ArchiveStatus<bool>(true);
+    }
+
+    ArchiveStatus<bool> BlockManager::removeFileEntry(const std::string& filename, std::vector<Extent> *aFreed) {
+        std::lock_guard<std::mutex> theEntries(entryLock);
+        auto file = fileEntries.find(filename);
+        if (file == fileEntries.end()) {
+            return ArchiveStatus<bool>(ArchiveErrors::fileNotFound);
+        }
+
+        //update block status (or hand the blocks to the caller, still marked used)
+        std::shared_lock<std::shared_mutex> theBlocks(growLock);
+        auto releaseRange = [&](size_t aStart, size_t aCount) {
+            if (aFreed) aFreed->push_back({aStart, aCount});
+            else markRange(aStart, aCount, false);
+        };
+        for (const auto &theExtent : file->second.extents) {
+            releaseRange(theExtent.start, theExtent.length);
+        }
+        if (const Tail &theTail = file->second.tail; theTail.length) {
+            auto theUsage = tailBlocks.find(theTail.block);
+            if (theUsage != tailBlocks.end() && (theUsage->second.live -= theTail.length) == 0 &&
+                !theUsage->second.placing) {
+                tailBlocks.erase(theUsage);
+                releaseRange(theTail.block, 1);
+                if (openTail == theTail.block) openTail = 0;
+            }
+        }
+
+        fileEntries.erase(file);
+        return ArchiveStatus<bool>(true);
+    }
+
+    ArchiveStatus<bool> BlockManager::replaceExtents(const std::string& filename, const std::vector<Extent>& anExtents) {
+        std::lock_guard<std::mutex> theEntries(entryLock);
+        auto file = fileEntries.find(filename);
+        if (file == fileEntries.end()) {
+            return ArchiveStatus<bool>(ArchiveErrors::fileNotFound);
+        }
+        file->second.extents = anExtents;
+        return ArchiveStatus<bool>(true);
+    }
+
+    std::vector<std::string> BlockManager::moveTailBlock(size_t aFrom, size_t aTo) {
+        std::lock_guard<std::mutex> theEntries(entryLock);
+        std::vector<std::string> theNames;
+        auto theUsage = tailBlocks.find(aFrom);
+        if (theUsage == tailBlocks.end()) return theNames;
+        tailBlocks[aTo] = theUsage->second;
+        tailBlocks.erase(aFrom);
+        if (openTail == aFrom) openTail = aTo;
+        for (auto &theFile : fileEntries) {
+            if (theFile.second.tail.length && theFile.second.tail.block == aFrom) {
+                theFile.second.tail.block = aTo;
+                theNames.push_back(theFile.first);
+            }
+        }
+        return theNames;
+    }
+
+    Tail BlockManager::placeTail(size_t aLength, size_t aCapacity) {
+        std::lock_guard<std::mutex> theEntries(entryLock);
+        //fragments are appended, so the open block only has room past its end (holes wait for compact)
+        auto theOpen = tailBlocks.find(openTail);
+        if (theOpen == tailBlocks.end() || theOpen->second.end + aLength > aCapacity) {
+            openTail = takeBlocks(1).front().start;
+            theOpen = tailBlocks.insert_or_assign(openTail, TailUsage()).first;
+        }
+        Tail theTail{openTail, theOpen->second.end, aLength};
+        theOpen->second.end += aLength; //addFileEntry counts it as live
+        theOpen->second.placing++;
+        return theTail;
+    }
+
+    bool BlockManager::settleTail(const Tail &aTail) {
+        std::lock_guard<std::mutex> theEntries(entryLock);
+        auto theUsage = tailBlocks.find(aTail.block);
+        if (theUsage == tailBlocks.end() || --theUsage->second.placing || theUsage->second.live) return false;
+        //every other fragment went while this one was being written, and this one never got stored
+        tailBlocks.erase(theUsage);
+        if (openTail == aTail.block) openTail = 0;
+        return true;
+    }
+
+    void BlockManager::noteRead(const std::string& filename) {
+        std::lock_guard<std::mutex> theEntries(entryLock);
+        auto file = fileEntries.find(filename);
+        if (file != fileEntries.end()) file->second.reads++;
+    }
+
+    uint64_t BlockManager::nextSequence() {
+        std::lock_guard<std::mutex> theEntries(entryLock);
+        return ++lastSequence;
+    }
+
+    bool BlockManager::isTailBlock(size_t anIndex) const {
+        std::lock_guard<std::mutex> theEntries(entryLock);
+        return tailBlocks.count(anIndex) > 0;
+    }
+
+    size_t BlockManager::tailBytes(size_t anIndex) const {
+        std::lock_guard<std::mutex> theEntries(entryLock);
+        auto theTail = tailBlocks.find(anIndex);
+        return theTail == tailBlocks.end() ? 0 : theTail->second.end;
+    }
+
+    ArchiveStatus<const FileEntry*> BlockManager::findFileEntry(const std::string& filename) const {
+        std::lock_guard<std::mutex> theEntries(entryLock);
+        auto file = fileEntries.find(filename);
+        if (file != fileEntries.end()) {
+            return ArchiveStatus<const FileEntry*>(&file->second);
+        }
+        return ArchiveStatus<const FileEntry*>(ArchiveErrors::fileNotFound);
+    }
+        
+    ArchiveStatus<FileEntry> BlockManager::copyFileEntry(const std::string& filename) const {
+        std::lock_guard<std::mutex> theEntries(entryLock);
+        auto file = fileEntries.find(filename);
+        if (file != fileEntries.end()) {
+            return ArchiveStatus<FileEntry>(file->second);
+        }
+        return ArchiveStatus<FileEntry>(ArchiveErrors::fileNotFound);
+    }
+
+    const std::map<std::string, FileEntry>& BlockManager::getAllFileEntries() const {
+        return fileEntries;
+    }
+
+    //--------------------------------------------------------------------------------
+    //BLOCK REFS FUNCTIONS
+    //--------------------------------------------------------------------------------
+    void BlockRefs::split(size_t aBlock) {
+        auto theRun = runs.upper_bound(aBlock);
+        if (theRun == runs.begin()) return;
+        --theRun;
+        size_t theEnd = theRun->first + theRun->second.length;
+        if (theRun->first == aBlock || theEnd <= aBlock) return;
+        Run theRest = theRun->second;
+        theRest.length = theEnd - aBlock;
+        theRun->second.length = aBlock - theRun->first;
+        runs.emplace(aBlock, theRest);
+    }
+
+    void BlockRefs::merge(size_t aFrom, size_t aTo) {
+        auto theRun = runs.upper_bound(aFrom);
+        if (theRun != runs.begin()) --theRun;
+        while (theRun != runs.end() && theRun->first <= aTo) {
+            auto theNext = std::next(theRun);
+            if (theNext != runs.end() && theRun->first + theRun->second.length == theNext->first &&
+                theRun->second.count == theNext->second.count && theRun->second.isHeld == theNext->second.isHeld) {
+                theRun->second.length += theNext->second.length;
+                runs.erase(theNext);
+            }
+            else {
+                theRun = theNext;
+            }
+        }
+    }
+
+    void BlockRefs::addRefs(const std::vector<Extent> &anExtents) {
+        for (const auto &theExtent : anExtents) {
+            if (!theExtent.length) continue;
+            split(theExtent.start);
+            split(theExtent.end());
+            //runs inside the extent get one more ref, gaps between them become new runs
+            size_t thePos = theExtent.start;
+            auto theRun = runs.lower_bound(thePos);
+            while (thePos < theExtent.end()) {
+                if (theRun != runs.end() && theRun->first == thePos) {
+                    theRun->second.count++;
+                    thePos += theRun->second.length;
+                    ++theRun;
+                    continue;
+                }
+                size_t theEnd = theRun != runs.end() ? std::min(theRun->first, theExtent.end()) : theExtent.end();
+                runs.emplace_hint(theRun, thePos, Run{theEnd - thePos, 1, false});
+                thePos = theEnd;
+            }
+            merge(theExtent.start, theExtent.end());
+        }
+    }
+
+    std::vector<Extent> BlockRefs::dropRefs(const std::vector<Extent> &anExtents) {
+        std::vector<Extent> theFree;
+        for (const auto &theExtent : anExtents) {
+            if (!theExtent.length) continue;
+            split(theExtent.start);
+            split(theExtent.end());
+            auto theRun = runs.lower_bound(theExtent.start);
+            while (theRun != runs.end() && theRun->first < theExtent.end()) {
+                if (--theRun->second.count) {
+                    ++theRun;
+                    continue;
+                }
+                if (theRun->second.isHeld) appendExtent(theFree, theRun->first, theRun->second.length);
+                theRun = runs.erase(theRun);
+            }
+            merge(theExtent.start, theExtent.end());
+        }
+        return theFree;
+    }
+
+    std::vector<Extent> BlockRefs::release(const std::vector<Extent> &anExtents) {
+        std::vector<Extent> theFree;
+        for (const auto &theExtent : anExtents) {
+            if (!theExtent.length) continue;
+            split(theExtent.start);
+            split(theExtent.end());
+            size_t thePos = theExtent.start;
+            auto theRun = runs.lower_bound(thePos);
+            while (thePos < theExtent.end()) {
+                if (theRun != runs.end() && theRun->first == thePos) {
+                    theRun->second.isHeld = true;
+                    thePos += theRun->second.length;
+                    ++theRun;
+                    continue;
+                }
+                size_t theEnd = theRun != runs.end() ? std::min(theRun->first, theExtent.end()) : theExtent.end();
+                appendExtent(theFree, thePos, theEnd - thePos);
+                thePos = theEnd;
+            }
+            merge(theExtent.start, theExtent.end());
+        }
+        return theFree;
+    }
+
+    void BlockRefs::holdAllBut(const std::vector<Extent> &aLive) {
+        for (auto &theRun : runs) theRun.second.isHeld = true;
+        for (const auto &theExtent : aLive) {
+            if (!theExtent.length) continue;
+            split(theExtent.start);
+            split(theExtent.end());
+            for (auto theRun = runs.lower_bound(theExtent.start);
+                 theRun != runs.end() && theRun->first < theExtent.end(); ++theRun) {
+                theRun->second.isHeld = false;
+            }
+        }
+        merge(0, kNoBlock);
+    }
+
+    bool BlockRefs::isShared(size_t aBlock) const {
+        auto theRun = runs.upper_bound(aBlock);
+        if (theRun == runs.begin()) return false;
+        --theRun;
+        return aBlock < theRun->first + theRun->second.length;
+    }
+
+    std::vector<Extent> BlockRefs::extents() const {
+        std::vector<Extent> theExtents;
+        for (const auto &theRun : runs) appendExtent(theExtents, theRun.first, theRun.second.length);
+        return theExtents;
+    }
+
+    //--------------------------------------------------------------------------------
+    //JOURNAL FUNCTIONS (POSIX files: needs fsync, elsewhere open fails and archives save directly)
+    //--------------------------------------------------------------------------------
+    bool Journal::open(const std::string &aPath) {
+        close(false);
+#if defined(__unix__) || defined(__APPLE__)
+        file = ::open(aPath.c_str(), O_RDWR | O_CREAT | O_APPEND, 0644);
+        if (file < 0) return false;
+        path = aPath;
+        std::lock_guard<std::mutex> theLock(lock);
+        pending.clear();
+        appended = durable = 0;
+        isWriting = isBroken = false;
+        bytes = static_cast<size_t>(::lseek(file, 0, SEEK_END));
+        return true;
+#else
+        (void)aPath;
+        return false;
+#endif
+    }
+
+    void Journal::close(bool isRemoving) {
+#if defined(__unix__) || defined(__APPLE__)
+        if (file < 0) return;
+        ::close(file);
+        file = -1;
+        if (isRemoving) ::unlink(path.c_str());
+#else
+        (void)isRemoving;
+#endif
+    }
+
+    bool Journal::readRecords(std::vector<std::vector<uint8_t>> &aRecords) const {
+        aRecords.clear();
+#if defined(__unix__) || defined(__APPLE__)
+        std::ifstream theStream(path, std::ios::binary);
+        std::error_code theError;
+        size_t theFileSize = fs::file_size(path, theError);
+        if (theError) theFileSize = 0;
+        uint32_t theFrame[2]; //length, checksum
+        while (theStream.read(reinterpret_cast<char*>(theFrame), sizeof(theFrame))) {
+            //a torn length can claim up to 4 GiB: more than the file has left is torn, like a bad checksum
+            size_t thePos = static_cast<size_t>(theStream.tellg());
+            if (thePos > theFileSize || theFrame[0] > theFileSize - thePos) break;
+            std::vector<uint8_t> thePayload(theFrame[0]);
+            if (!theStream.read(reinterpret_cast<char*>(thePayload.data()), thePayload.size()) ||
+                checksum(thePayload.data(), thePayload.size()) != theFrame[1]) {
+                break; //torn by a crash mid-write: nothing after it was acknowledged
+            }
+            aRecords.push_back(std::move(thePayload));
+        }
+        return true;
+#else
+        return false;
+#endif
+    }
+
+    uint64_t Journal::append(const std::vector<uint8_t> &aPayload) {
+        std::lock_guard<std::mutex> theLock(lock);
+        uint32_t theFrame[2] = {static_cast<uint32_t>(aPayload.size()), checksum(aPayload.data(), aPayload.size())};
+        const uint8_t *theBytes = reinterpret_cast<const uint8_t*>(theFrame);
+        pending.insert(pending.end(), theBytes, theBytes + sizeof(theFrame));
+        pending.insert(pending.end(), aPayload.begin(), aPayload.end());
+        bytes += sizeof(theFrame) + aPayload.size();
+        return ++appended;
+    }
+
+    bool Journal::commit(uint64_t aSequence, const SyncData &aSyncData, bool isSyncing) {
+        std::unique_lock<std::mutex> theLock(lock);
+        while (!isBroken && durable < aSequence && isWriting) {
+            batchDone.wait(theLock); //someone's batch may already cover us
+        }
+        if (isBroken) return false;
+        if (durable >= aSequence) return true;
+
+        //we're the leader: take everything queued so far (ours + whoever arrived meanwhile)
+        isWriting = true;
+        std::vector<uint8_t> theBatch;
+        theBatch.swap(pending);
+        uint64_t theLast = appended;
+        theLock.unlock();
+
+        bool theResult = !isSyncing || aSyncData(); //data first: a durable record must never point at lost blocks
+#if defined(__unix__) || defined(__APPLE__)
+        for (size_t theDone = 0; theResult && theDone < theBatch.size();) {
+            ssize_t theCount = ::write(file, theBatch.data() + theDone, theBatch.size() - theDone);
+            theResult = theCount > 0;
+            if (theResult) theDone += static_cast<size_t>(theCount);
+        }
+        theResult = theResult && (!isSyncing || sync());
+#endif
+
+        theLock.lock();
+        isWriting = false;
+        if (theResult) durable = std::max(durable, theLast);
+        else isBroken = true;
+        batchDone.notify_all();
+        return theResult;
+    }
+
+    bool Journal::sync() {
+#if defined(__linux__)
+        return !::fdatasync(file);
+#elif defined(__unix__) || defined(__APPLE__)
+        return !::fsync(file);
+#else
+        return true;
+#endif
+    }
+
+    bool Journal::reset(bool isSyncing) {
+        std::unique_lock<std::mutex> theLock(lock);
+        batchDone.wait(theLock, [this]() { return !isWriting; });
+        bool theResult = true;
+#if defined(__unix__) || defined(__APPLE__)
+        theResult = !::ftruncate(file, 0) && (!isSyncing || !::fsync(file));
+#else
+        (void)isSyncing;
+#endif
+        pending.clear();
+        durable = appended; //queued records are covered by the checkpoint
+        bytes = 0;
+        batchDone.notify_all();
+        return theResult;
+    }
+
+    size_t Journal::size() const {
+        std::lock_guard<std::mutex> theLock(lock);
+        return bytes;
+    }
+
+    size_t Journal::pendingBytes() const {
+        std::lock_guard<std::mutex> theLock(lock);
+        return pending.size();
+    }
+
+    uint64_t Journal::lastSequence() const {
+        std::lock_guard<std::mutex> theLock(lock);
+        return appended;
     }
 
-    // Add an observer to the archive
-    Archive& Archive::addObserver(std::shared_ptr<ArchiveObserver> anObserver) {
-        observers.push_back(anObserver);
-        return *this;
+    bool Journal::syncPath(const std::string &aPath) {
+#if defined(__unix__) || defined(__APPLE__)
+        int theFile = ::open(aPath.c_str(), O_RDONLY);
+        if (theFile < 0) return false;
+#if defined(__linux__)
+        bool theResult = !::fdatasync(theFile);
+#else
+        bool theResult = !::fsync(theFile);
+#endif
+        ::close(theFile);
+        return theResult;
+#else
+        (void)aPath;
+        return true;
+#endif
     }
 
-    //GET FULL PATH of Archive
-    ArchiveStatus<std::string> Archive::getFullPath() const {
-        return ArchiveStatus<std::string>(aPath);
+    //--------------------------------------------------------------------------------
+    //BLOCK DEVICE FUNCTIONS (pread/pwrite; an fstream under a mutex where there's no POSIX I/O)
+    //--------------------------------------------------------------------------------
+    bool BlockDevice::open(const std::string &aPath, bool isNew) {
+        close();
+        path = aPath;
+#if defined(__unix__) || defined(__APPLE__)
+        file = ::open(aPath.c_str(), O_RDWR | (isNew ? O_CREAT | O_TRUNC : 0), 0644);
+        return file >= 0;
+#else
+        if (isNew && !std::ofstream(aPath, std::ios::binary | std::ios::trunc)) return false;
+        stream.open(aPath, std::ios::binary | std::ios::in | std::ios::out);
+        return stream.is_open();
+#endif
     }
 
-    //EXTRACT filename from a full path
-    std::string Archive::extractFilename(const std::string &aFullPath) const {
-        fs::path thePath(aFullPath);
-        return thePath.filename().string();
+    void BlockDevice::close() {
+#if defined(__unix__) || defined(__APPLE__)
+        if (file >= 0) ::close(file);
+        file = -1;
+#else
+        if (stream.is_open()) stream.close();
+#endif
     }
 
-    // Calculate number of blocks needed for a file
-    size_t Archive::calculateRequiredBlocks(size_t fileSize) const {
-        return (fileSize + kPayloadSize - 1) / kPayloadSize; // Ceiling division
+    bool BlockDevice::isOpen() const {
+#if defined(__unix__) || defined(__APPLE__)
+        return file >= 0;
+#else
+        return stream.is_open();
+#endif
     }
 
-    // Notify all observers about an action
-    void Archive::notifyObservers(ActionType anAction, const std::string &aName, bool status) {
-        for (auto& observer : observers) {
-            (*observer)(anAction, aName, status);
+    bool BlockDevice::readAt(uint8_t *aBuffer, size_t anOffset, size_t aLength) const {
+#if defined(__unix__) || defined(__APPLE__)
+        while (aLength) {
+            ssize_t theCount = ::pread(file, aBuffer, aLength, static_cast<off_t>(anOffset));
+            if (theCount <= 0) return false; //(0 = past the end)
+            aBuffer += theCount;
+            anOffset += static_cast<size_t>(theCount);
+            aLength -= static_cast<size_t>(theCount);
+        }
+        return true;
+#else
+        std::lock_guard<std::mutex> theLock(lock);
+        stream.clear(); //a prior short read leaves eof/fail set
+        stream.seekg(anOffset);
+        stream.read(reinterpret_cast<char*>(aBuffer), aLength);
+        return stream.good();
+#endif
+    }
+
+    bool BlockDevice::writeAt(const uint8_t *aBuffer, size_t anOffset, size_t aLength) {
+#if defined(__unix__) || defined(__APPLE__)
+        while (aLength) {
+            ssize_t theCount = ::pwrite(file, aBuffer, aLength, static_cast<off_t>(anOffset));
+            if (theCount <= 0) return false;
+            aBuffer += theCount;
+            anOffset += static_cast<size_t>(theCount);
+            aLength -= static_cast<size_t>(theCount);
         }
+        return true;
+#else
+        std::lock_guard<std::mutex> theLock(lock);
+        stream.clear();
+        stream.seekp(anOffset);
+        stream.write(reinterpret_cast<const char*>(aBuffer), aLength);
+        return stream.flush().good(); //nothing may sit in the buffer (resize goes by path)
+#endif
     }
 
-//--------------------------------------------------------------------------------
-//BLOCK METHODS
-//--------------------------------------------------------------------------------
-    // Block constructor
-    Block::Block() : mode(BlockMode::free), type(BlockType::data), blockNumber(0), blockCount(0), fileSize(0), 
-                    timeStamp(0) {
-        //to null all bytes for filename/data, must use memset
-        memset(filename, 0, sizeof(filename));
-        memset(data, 0, sizeof(data));
-    }
-
-    // Block copy constructor
-    Block::Block(const Block &aBlock) : mode(aBlock.mode), type(aBlock.type),
-                                    blockNumber(aBlock.blockNumber), blockCount(aBlock.blockCount),
-                                    fileSize(aBlock.fileSize), timeStamp(aBlock.timeStamp) {
-        strncpy(filename, aBlock.filename, sizeof(filename));
-        memcpy(data, aBlock.data, sizeof(data));
-    }
-
-    // Block assignment operator
-    //NOTE: can't use initializer list bc objects already initialized!
-            //so must overwrite, hence doing it within operator def
-    Block& Block::operator=(const Block &aBlock) {
-        if (this != &aBlock) {
-            mode = aBlock.mode;
-            type = aBlock.type;
-            blockNumber = aBlock.blockNumber;
-            blockCount = aBlock.blockCount;
-            fileSize = aBlock.fileSize;
-            timeStamp = aBlock.timeStamp;
-            strncpy(filename, aBlock.filename, sizeof(filename));
-            memcpy(data, aBlock.data, sizeof(data));
+    bool BlockDevice::readPieces(std::vector<IOPiece> aPieces, size_t anOffset) const {
+#if defined(__unix__) || defined(__APPLE__)
+        std::vector<iovec> theVectors;
+        for (const auto &thePiece : aPieces) {
+            if (thePiece.length) theVectors.push_back({thePiece.data, thePiece.length});
         }
-        return *this;
+        //a call moves at most IOV_MAX pieces and may stop short: go on from where it stopped
+        for (size_t theFirst = 0; theFirst < theVectors.size();) {
+            int theCount = static_cast<int>(std::min<size_t>(theVectors.size() - theFirst, IOV_MAX));
+            ssize_t theRead = ::preadv(file, theVectors.data() + theFirst, theCount, static_cast<off_t>(anOffset));
+            if (theRead <= 0) return false;
+            anOffset += static_cast<size_t>(theRead);
+            for (size_t theLeft = static_cast<size_t>(theRead); theLeft;) {
+                iovec &theVector = theVectors[theFirst];
+                size_t theTaken = std::min(theLeft, theVector.iov_len);
+                theVector.iov_base = static_cast<uint8_t*>(theVector.iov_base) + theTaken;
+                theVector.iov_len -= theTaken;
+                theLeft -= theTaken;
+                if (!theVector.iov_len) theFirst++;
+            }
+        }
+        return true;
+#else
+        for (const auto &thePiece : aPieces) {
+            if (!readAt(thePiece.data, anOffset, thePiece.length)) return false;
+            anOffset += thePiece.length;
+        }
+        return true;
+#endif
     }
 
-    // Block destructor
-    Block::~Block() {
-        // Nothing to clean up (all members are on stack)}
+    size_t BlockDevice::size() const {
+#if defined(__unix__) || defined(__APPLE__)
+        struct stat theStat{};
+        return ::fstat(file, &theStat) ? 0 : static_cast<size_t>(theStat.st_size);
+#else
+        std::lock_guard<std::mutex> theLock(lock);
+        stream.clear();
+        stream.seekg(0, std::ios::end);
+        return static_cast<size_t>(stream.tellg());
+#endif
     }
 
-    //READ BLOCK from the archive (puts data from stream into aBlock)
-    bool Archive::readBlock(Block &aBlock, size_t anIndex) {
-        stream.seekg(anIndex * kBlockSize);
-        if (!stream) return false;
-        
-        stream.read(reinterpret_cast<char*>(&aBlock), sizeof(Block));
-        return stream.good();
+    bool BlockDevice::resize(size_t aSize) {
+#if defined(__unix__) || defined(__APPLE__)
+        return !::ftruncate(file, static_cast<off_t>(aSize));
+#else
+        std::lock_guard<std::mutex> theLock(lock);
+        std::error_code theError;
+        stream.flush();
+        fs::resize_file(path, aSize, theError);
+        return !theError;
+#endif
     }
 
-    //WRITE BLOCK to the archive (puts data from aBlock into stream)
-    bool Archive::writeBlock(Block &aBlock, size_t anIndex) {
-        stream.seekp(anIndex * kBlockSize);
-        if (!stream) return false;
-        
-        stream.write(reinterpret_cast<const char*>(&aBlock), sizeof(Block));
-        return stream.good();
+    bool BlockDevice::sync() {
+#if defined(__linux__)
+        return !::fdatasync(file);
+#elif defined(__unix__) || defined(__APPLE__)
+        return !::fsync(file);
+#else
+        return true;
+#endif
+    }
+
+    bool BlockDevice::punch(size_t anOffset, size_t aLength) {
+#if defined(__linux__) && defined(FALLOC_FL_PUNCH_HOLE)
+        return !fallocate(file, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                          static_cast<off_t>(anOffset), static_cast<off_t>(aLength));
+#else
+        (void)anOffset;
+        (void)aLength;
+        return false;
+#endif
+    }
+
+    bool BlockDevice::reserve(size_t anOffset, size_t aLength) {
+#if defined(__linux__)
+        return !fallocate(file, FALLOC_FL_KEEP_SIZE, static_cast<off_t>(anOffset), static_cast<off_t>(aLength));
+#elif defined(__unix__) && !defined(__APPLE__)
+        return !posix_fallocate(file, static_cast<off_t>(anOffset), static_cast<off_t>(aLength));
+#else
+        (void)anOffset;
+        (void)aLength;
+        return false;
+#endif
     }
 
     //--------------------------------------------------------------------------------
-    //ADD FILE TO ARCHIVE
+    //COMPACT ARCHIVE: full rewrite, every live file as one run in the order asked for
+    //- the whole new image (every live block and tail) is buffered in memory before anything is written,
+    //  so memory use is the size of the live data: compactInPlace does it in bounded memory, but can't reorder
     //--------------------------------------------------------------------------------
-    ArchiveStatus<bool> Archive::add(const std::string &aFilename) {
-        // Extract just the filename part from the full path
-        std::string theName = extractFilename(aFilename);
-        
-        //check if file already exists in the archive
-        if (blockManager.findFileEntry(theName).isOK()) {
-            notifyObservers(ActionType::added, theName, false);
-            return ArchiveStatus<bool>(ArchiveErrors::fileExists);
+    template<size_t BlockSize, size_t MetaSize>
+    ArchiveStatus<size_t> BasicArchive<BlockSize, MetaSize>::compact(CompactOrder anOrder,
+                                                                     const CompactGroupKey &aGroupKey) {
+        //every block may move: no compactor pass or extract in between
+        CompactorPause thePause(*this);
+        std::unique_lock<std::shared_mutex> theReaders(relocationLock);
+        {
+            std::shared_lock<std::shared_mutex> theSnapshots(snapshotLock);
+            if (!snapshots.empty()) { //the rewrite only keeps live files
+                notifyObservers(ActionType::compacted, "", false);
+                return ArchiveStatus<size_t>(ArchiveErrors::badAction);
+            }
         }
-        
-        //open the source file
-        std::fstream sourceFile(aFilename, std::ios::in | std::ios::binary);
-        if (!sourceFile) {
-            notifyObservers(ActionType::added, theName, false);
-            return ArchiveStatus<bool>(ArchiveErrors::fileOpenError);
+        //fold the journal in first: its records point at blocks that are about to move
+        if (!checkpoint().isOK()) {
+            return ArchiveStatus<size_t>(ArchiveErrors::fileWriteError);
         }
-        
-        //get file size and calculate blocks needed
-        sourceFile.seekg(0, std::ios::end);
-        size_t fileSize = sourceFile.tellg();
-        sourceFile.seekg(0, std::ios::beg);
-        size_t blocksNeeded = calculateRequiredBlocks(fileSize);
-        
-        //Find free blocks
-        std::vector<size_t> freeBlocks = blockManager.findFreeBlocks(blocksNeeded);
-        
-        //if not enough free blocks, make more space
-        while (freeBlocks.size() < blocksNeeded) {
-            freeBlocks.push_back(blockManager.getTotalBlocks());
-            blockManager.markBlocksAsUsed({freeBlocks.back()});
+        //layout order (the directory map itself is by name); pre-v8 files have sequence 0, so add time decides
+        using FileRef = std::map<std::string, FileEntry>::const_iterator;
+        const auto &theDirectory = blockManager.getAllFileEntries();
+        std::vector<FileRef> fileEntries;
+        for (auto theFile = theDirectory.begin(); theFile != theDirectory.end(); ++theFile) {
+            fileEntries.push_back(theFile);
+        }
+        auto isAddedBefore = [](FileRef a, FileRef b) {
+            return std::tie(a->second.sequence, a->second.timeStamp, a->first) <
+                   std::tie(b->second.sequence, b->second.timeStamp, b->first);
+        };
+        if (anOrder == CompactOrder::insertion) {
+            std::sort(fileEntries.begin(), fileEntries.end(), isAddedBefore);
+        }
+        else if (anOrder == CompactOrder::heat) {
+            std::sort(fileEntries.begin(), fileEntries.end(), [&](FileRef a, FileRef b) {
+                if (a->second.reads != b->second.reads) return a->second.reads > b->second.reads;
+                return isAddedBefore(a, b);
+            });
+        }
+        else if (anOrder == CompactOrder::group && aGroupKey) {
+            std::map<std::string, std::string> theKeys; //one call per file
+            for (FileRef theFile : fileEntries) theKeys[theFile->first] = aGroupKey(theFile->first);
+            std::sort(fileEntries.begin(), fileEntries.end(), [&](FileRef a, FileRef b) {
+                const std::string &theA = theKeys[a->first], &theB = theKeys[b->first];
+                return theA != theB ? theA < theB : isAddedBefore(a, b);
+            });
+        }
+        std::vector<uint8_t> newBlocks; //raw block bytes, moved verbatim
+        std::vector<uint8_t> newTails; //tail fragments repacked densely, appended after the full blocks
+        std::map<std::string, FileEntry> newFileEntries;
+    
+        size_t newBlockIndex = kSuperBlockIndex + 1; //block 0 stays the superblock
+        size_t theTailStart = newBlockIndex;
+        for (FileRef file : fileEntries) theTailStart += file->second.blockCount();
+        size_t theTailFill = payloadSize(); //no open tail block yet
+    
+        for (FileRef file : fileEntries) {
+            //each file becomes a single extent in the new layout
+            FileEntry newEntry = file->second;
+            newEntry.extents.clear();
+            if (size_t theCount = file->second.blockCount()) {
+                newEntry.extents.push_back({newBlockIndex, theCount});
+                newBlockIndex += theCount;
+            }
+            bool isRead = eachRun(file->second.extents, [&](size_t aStart, size_t aCount, size_t) {
+                size_t theFirst = newBlocks.size();
+                newBlocks.resize(theFirst + aCount * blockSize());
+                return readRaw(newBlocks.data() + theFirst, aStart, aCount);
+            });
+            if (const Tail &theTail = file->second.tail; theTail.length) {
+                if (theTailFill + theTail.length > payloadSize()) {
+                    newTails.resize(newTails.size() + blockSize());
+                    if (metaSize()) {
+                        geometry.encodeHeader(tailHeader(), newTails.data() + newTails.size() - blockSize());
+                    }
+                    theTailFill = 0;
+                }
+                size_t theTailBlock = newTails.size() / blockSize() - 1;
+                newEntry.tail = {theTailStart + theTailBlock, theTailFill, theTail.length};
+                isRead = isRead && readBytes(newTails.data() + theTailBlock * blockSize() + payloadOffset() + theTailFill,
+                                             tailOffset(theTail), theTail.length);
+                theTailFill += theTail.length;
+            }
+            if (!isRead) { //nothing written yet, so the archive is as it was
+                notifyObservers(ActionType::compacted, "", false);
+                return ArchiveStatus<size_t>(ArchiveErrors::fileReadError);
+            }
+            newFileEntries[file->first] = newEntry;
         }
+        newBlocks.insert(newBlocks.end(), newTails.begin(), newTails.end());
+        newBlockIndex += newTails.size() / blockSize();
 
-        //mark blocks as used
-        blockManager.markBlocksAsUsed(freeBlocks);
-        
-        //prepare and write blocks
-        size_t remainingSize = fileSize;
-        time_t currentTime = time(nullptr);
-        
-        for (size_t i = 0; i < blocksNeeded; i++) {
-            Block newBlock;
-            newBlock.initializeBlock(theName, i, blocksNeeded, fileSize, currentTime);
-            
-            //read data from source file
-            size_t bytesToRead = std::min(remainingSize, kPayloadSize);
-            sourceFile.read(reinterpret_cast<char*>(newBlock.data), bytesToRead);
-            remainingSize -= bytesToRead;
-            
-            //write blocks to stream
-            writeBlock(newBlock, freeBlocks[i]);
+        size_t newBlockCount = newBlocks.size() / blockSize();
+
+        //rewrite in two steps, so a crash always leaves the superblock pointing at one whole layout:
+        //1. write the new image past the end (and the directory) and point the directory at it
+        //2. copy it down to block 1, point the directory there, then trim the staged copy off
+        //- the live directory stays marked used, so the next one can't land on it before the superblock moves
+        //- costs a second write of the image, and its size in disk space until step 2 is done
+        size_t theStage = std::max({blockManager.getTotalBlocks(), newBlockIndex, savedDirectory.end()});
+        auto writeImage = [&](size_t aBase) {
+            return eachRun({{aBase, newBlockCount}}, [&](size_t aStart, size_t aCount, size_t aPos) {
+                return writeRaw(newBlocks.data() + aPos * blockSize(), aStart, aCount);
+            }) && (!isSyncOn() || syncVolumes());
+        };
+        auto saveImageAt = [&](size_t aBase) {
+            size_t theShift = aBase - (kSuperBlockIndex + 1);
+            blockManager.reset(std::max(theStage + newBlockCount, directoryBlocks.end()));
+            if (directoryBlocks.length) blockManager.markBlocksAsUsed({directoryBlocks});
+            for (const auto &file : newFileEntries) {
+                FileEntry theEntry = file.second;
+                for (auto &theExtent : theEntry.extents) theExtent.start += theShift;
+                if (theEntry.tail.length) theEntry.tail.block += theShift;
+                blockManager.addFileEntry(file.first, theEntry);
+            }
+            return saveDirectory().isOK() && (!isSyncOn() || syncVolumes());
+        };
+        bool theResult = writeImage(theStage) && saveImageAt(theStage) &&
+                         writeImage(kSuperBlockIndex + 1) && saveImageAt(kSuperBlockIndex + 1) &&
+                         saveDirectory(newBlockIndex).isOK();
+
+        notifyObservers(ActionType::compacted, "", theResult);
+        if (!theResult) {
+            return ArchiveStatus<size_t>(ArchiveErrors::fileWriteError);
         }
-        
-        //store the file entry
-        blockManager.addFileEntry(theName, freeBlocks);
-        notifyObservers(ActionType::added, theName, true);
-        return ArchiveStatus<bool>(true);
+        return ArchiveStatus<size_t>(newBlockCount);
     }
 
     //--------------------------------------------------------------------------------
-    //EXTRACT FILE FROM ARCHIVE
+    //COMPACT IN PLACE: fill holes from the top of the archive down, one bounded move at a time
+    //- each move copies blocks into a claimed hole, repoints the file under relocationLock, makes that
+    //  durable (journal record or directory save), and only then frees the old blocks, so the archive
+    //  is consistent after every step and readers/writers keep going in between
+    //- memory: aMemoryBudget of block data + an index of extent starts (one per extent, not per block)
     //--------------------------------------------------------------------------------
-    ArchiveStatus<bool> Archive::extract(const std::string &aFilename, const std::string &aFullPath) {
-        // find file in archive
-        auto fileBlocks = blockManager.findFileEntry(aFilename);
-        if (!fileBlocks.isOK()) {
-            notifyObservers(ActionType::extracted, aFilename, false);
-            return ArchiveStatus<bool>(ArchiveErrors::fileNotFound);
-        }
-        
-        //get file blocks (check if empty)
-        std::vector<size_t> blocks = fileBlocks.getValue();
-        if (blocks.empty()) {
-            notifyObservers(ActionType::extracted, aFilename, false);
-            return ArchiveStatus<bool>(ArchiveErrors::badBlock);
-        }
+    template<size_t BlockSize, size_t MetaSize>
+    ArchiveStatus<size_t> BasicArchive<BlockSize, MetaSize>::compactInPlace(size_t aMemoryBudget,
+                                                                            const CompactCallback &aCallback) {
+        size_t theBudget = std::max<size_t>(1, aMemoryBudget / blockSize());
+        std::vector<uint8_t> theBuffer;
 
-        //open output file
-        std::fstream outputFile(aFullPath, std::ios::out | std::ios::binary | std::ios::trunc);
-        if (!outputFile) {
-            notifyObservers(ActionType::extracted, aFilename, false);
-            return ArchiveStatus<bool>(ArchiveErrors::fileOpenError);
+        //who owns which block: extents by start, plus the shared tail blocks
+        std::map<size_t, std::string> theOwners;
+        std::set<size_t> theTails;
+        {
+            std::lock_guard<std::mutex> theJournal(journalLock);
+            blockManager.eachFileEntry([&](const std::string &aName, const FileEntry &anEntry) {
+                for (const auto &theExtent : anEntry.extents) theOwners[theExtent.start] = aName;
+                if (anEntry.tail.length) theTails.insert(anEntry.tail.block);
+            });
         }
 
-        Block theBlock;
-        size_t remainingSize = 0;
+        CompactProgress theProgress;
+        size_t theTop = blockManager.getTotalBlocks();
+        bool isPaused = false;
+        while (!isPaused) {
+            size_t theHole = blockManager.nextFreeBlock(kSuperBlockIndex + 1);
+            size_t theLast = blockManager.lastUsedBlock(theTop);
+            if (theHole == kNoBlock || theLast == kNoBlock || theLast <= theHole) break;
+
+            ArchiveStatus<size_t> theMove(size_t(0));
+            if (isSnapshotBlock(theLast)) {
+                //shared with a snapshot: moving it would only leave a copy behind
+            }
+            else if (theTails.count(theLast)) {
+                if (blockManager.claimBlocks(theHole, 1)) theMove = relocateTail(theLast, theHole);
+                if (theMove.isOK() && theMove.getValue()) {
+                    theTails.erase(theLast);
+                    theTails.insert(theHole);
+                }
+            }
+            else if (auto theOwner = theOwners.upper_bound(theLast); theOwner != theOwners.begin()) {
+                std::string theName = std::prev(theOwner)->second; //its index entry may go in the move
+                theMove = relocateExtent(theName, theLast, theHole, theBudget, theBuffer, theOwners);
+            }
+            if (!theMove.isOK()) {
+                notifyObservers(ActionType::compacted, "", false);
+                return theMove;
+            }
+            if (!theMove.getValue()) { //directory, a half-done add, or it changed: leave it where it is
+                theTop = theLast;
+                continue;
+            }
 
-        //read blocks and write to output file
-        for (size_t blockIndex : blocks) {
-            if (!readBlock(theBlock, blockIndex)) {
-                notifyObservers(ActionType::extracted, aFilename, false);
-                return ArchiveStatus<bool>(ArchiveErrors::badBlock);
+            theProgress.movedBlocks += theMove.getValue();
+            if (aCallback) {
+                theProgress.freeBlocks = blockManager.countFreeBlocks();
+                theProgress.blockCount = blockManager.getTotalBlocks();
+                isPaused = !aCallback(theProgress);
             }
+        }
 
-            size_t bytesToWrite = std::min(theBlock.fileSize - remainingSize, kPayloadSize);
-            outputFile.write(reinterpret_cast<char*>(theBlock.data), bytesToWrite);
-            remainingSize += bytesToWrite;
+        if (!trimFreeEnd().isOK()) {
+            notifyObservers(ActionType::compacted, "", false);
+            return ArchiveStatus<size_t>(ArchiveErrors::fileWriteError);
         }
-        outputFile.close();
-        notifyObservers(ActionType::extracted, aFilename, true);
-        return ArchiveStatus<bool>(true);
+        notifyObservers(ActionType::compacted, "", true);
+        return ArchiveStatus<size_t>(blockManager.getTotalBlocks());
     }
 
-    //--------------------------------------------------------------------------------
-    //REMOVE FILE FROM ARCHIVE
-    //--------------------------------------------------------------------------------
-    ArchiveStatus<bool> Archive::remove(const std::string &aFilename) {
-        //find all blocks for this file
-        auto fileBlocks = blockManager.findFileEntry(aFilename);
-        if (!fileBlocks.isOK()) {
-            notifyObservers(ActionType::removed, aFilename, false);
-            return ArchiveStatus<bool>(ArchiveErrors::fileNotFound);
+    template<size_t BlockSize, size_t MetaSize>
+    ArchiveStatus<bool> BasicArchive<BlockSize, MetaSize>::trimFreeEnd() {
+        //twice: the first save may have to stop short of the old directory
+        for (int i = 0; i < 2; i++) {
+            size_t theLast = blockManager.lastUsedBlock(blockManager.getTotalBlocks());
+            {
+                std::lock_guard<std::shared_mutex> theIO(ioLock);
+                if (directoryBlocks.length && theLast != kNoBlock && theLast >= directoryBlocks.start &&
+                    theLast < directoryBlocks.end()) {
+                    theLast = blockManager.lastUsedBlock(directoryBlocks.start); //it's rewritten at the new end
+                }
+            }
+            size_t theEnd = theLast == kNoBlock ? kSuperBlockIndex + 1 : theLast + 1;
+            if (!checkpoint(0, theEnd).isOK()) return ArchiveStatus<bool>(ArchiveErrors::fileWriteError);
         }
-        //mark blocks free and remove file entry
-        blockManager.markBlocksAsFree(fileBlocks.getValue());
-        blockManager.removeFileEntry(aFilename);
-
-        notifyObservers(ActionType::removed, aFilename, true);
         return ArchiveStatus<bool>(true);
     }
 
-    //--------------------------------------------------------------------------------
-    //LIST ALL FILES IN ARCHIVE
-    //--------------------------------------------------------------------------------
-    ArchiveStatus<size_t> Archive::list(std::ostream &aStream) {
-        auto fileEntries = blockManager.getAllFileEntries();    
-        
-        //output header with NAME/SIZE/TIMESTAMP
-        aStream << "###  name         size       date added\n";
-        aStream << "------------------------------------------------\n";
-        
-        // Output file information
-        size_t fileNumber = 1;
-        for (const auto &file : fileEntries) {
-            Block theBlock;
+    //move the (up to) aBudget blocks of aName that end at aLast down into the free run at aHole
+    template<size_t BlockSize, size_t MetaSize>
+    ArchiveStatus<size_t> BasicArchive<BlockSize, MetaSize>::relocateExtent(const std::string &aName, size_t aLast,
+            size_t aHole, size_t aBudget, std::vector<uint8_t> &aBuffer, std::map<size_t, std::string> &anOwners) {
+        std::vector<Extent> theExtents;
+        uint64_t theAdded = 0;
+        {
+            std::lock_guard<std::mutex> theJournal(journalLock); //entries only change under it
+            auto theFile = blockManager.findFileEntry(aName);
+            if (!theFile.isOK()) return ArchiveStatus<size_t>(size_t(0));
+            theExtents = theFile.getValue()->extents;
+            theAdded = theFile.getValue()->sequence;
+        }
+        auto theExtent = std::find_if(theExtents.begin(), theExtents.end(), [&](const Extent &anExtent) {
+            return anExtent.start <= aLast && aLast < anExtent.end();
+        });
+        if (theExtent == theExtents.end()) return ArchiveStatus<size_t>(size_t(0));
 
-            //read first block to get file info
-            if (!readBlock(theBlock, file.second[0])) {
+        //copy stays strictly below the source, so a move never overwrites what it reads
+        size_t theCount = std::min({aLast + 1 - theExtent->start, aBudget, (aLast + 1 - aHole) / 2});
+        theCount = blockManager.claimBlocks(aHole, theCount);
+        if (!theCount) return ArchiveStatus<size_t>(size_t(0));
+        Extent theOld{aLast + 1 - theCount, theCount};
+
+        //blocks move verbatim (headers hold no block numbers); done outside the lock, nothing points here yet
+        aBuffer.resize(theCount * blockSize());
+        if (!readRaw(aBuffer.data(), theOld.start, theCount) || !writeRaw(aBuffer.data(), aHole, theCount)) {
+            blockManager.markBlocksAsFree({{aHole, theCount}});
+            return ArchiveStatus<size_t>(ArchiveErrors::fileWriteError);
+        }
+
+        //same run, new place: [start, old) [hole] [old end, end)
+        std::vector<Extent> theMoved;
+        for (auto theRun = theExtents.begin(); theRun != theExtents.end(); ++theRun) {
+            if (theRun != theExtent) {
+                appendExtent(theMoved, theRun->start, theRun->length);
                 continue;
             }
+            if (theOld.start > theRun->start) appendExtent(theMoved, theRun->start, theOld.start - theRun->start);
+            appendExtent(theMoved, aHole, theCount);
+            if (theRun->end() > theOld.end()) appendExtent(theMoved, theOld.end(), theRun->end() - theOld.end());
+        }
 
-            char timeBuffer[32];
-            struct tm *timeinfo = localtime(&theBlock.timeStamp);
-            strftime(timeBuffer, sizeof(timeBuffer), "%Y-%m-%d %H:%M:%S", timeinfo);
-            
-            aStream << fileNumber << ".   "
-                    << file.first << "    "
-                    << theBlock.fileSize << "    "
-                    << timeBuffer << "\n";
-            
-            fileNumber++;
+        uint64_t theSequence = 0;
+        {
+            std::unique_lock<std::shared_mutex> theMove(relocationLock); //no reader mid-file while it changes
+            std::lock_guard<std::mutex> theJournal(journalLock);
+            auto theFile = blockManager.findFileEntry(aName);
+            //removed or re-added meanwhile: our copy is stale
+            if (!theFile.isOK() || !isUnchanged(*theFile.getValue(), theExtents, theAdded)) {
+                blockManager.markBlocksAsFree({{aHole, theCount}});
+                return ArchiveStatus<size_t>(size_t(0));
+            }
+            FileEntry theEntry = *theFile.getValue();
+            theEntry.extents = theMoved;
+            blockManager.replaceExtents(aName, theMoved);
+            if (journal.isOpen()) theSequence = logChange(JournalRecord::added, aName, &theEntry);
         }
-        
-        notifyObservers(ActionType::listed, "", true);
-        return ArchiveStatus<size_t>(fileEntries.size());
+
+        if (theOld.start == theExtent->start) anOwners.erase(theExtent->start);
+        anOwners[aHole] = aName;
+        if (theExtent->end() > theOld.end()) anOwners[theOld.end()] = aName;
+
+        auto theSettle = settleRelocation(theSequence, {theOld});
+        if (!theSettle.isOK()) return ArchiveStatus<size_t>(theSettle.getError());
+        return ArchiveStatus<size_t>(theCount);
     }
 
-    //--------------------------------------------------------------------------------
-    //DUMP Block organization for DEBUGGING
-    //--------------------------------------------------------------------------------
-    ArchiveStatus<size_t> Archive::debugDump(std::ostream &aStream) {
-        auto fileEntries = blockManager.getAllFileEntries();
-        size_t blockCount = blockManager.getTotalBlocks();
-        
-        // Output header
-        aStream << "###  Block #   Status   Filename\n";
-        aStream << "----------------------------------\n";
-        
-        // Examine all blocks
-        for (size_t i = 0; i < blockCount; i++) {
-            std::string fileName = "empty";
-            for (const auto &file : fileEntries) {
-                if (std::find(file.second.begin(), file.second.end(), i) != file.second.end()) {
-                    fileName = file.first;
-                    break;
+    //tail blocks are shared, so the copy and the swap both happen under the exclusive lock
+    template<size_t BlockSize, size_t MetaSize>
+    ArchiveStatus<size_t> BasicArchive<BlockSize, MetaSize>::relocateTail(size_t aLast, size_t aHole) {
+        uint64_t theSequence = 0;
+        {
+            std::unique_lock<std::shared_mutex> theMove(relocationLock); //adds hold it while filling a tail
+            std::lock_guard<std::mutex> theJournal(journalLock);
+            size_t theUsed = blockManager.isTailBlock(aLast) ? payloadOffset() + blockManager.tailBytes(aLast) : 0;
+            if (!theUsed) { //its last fragment went meanwhile
+                blockManager.markBlocksAsFree({{aHole, 1}});
+                return ArchiveStatus<size_t>(size_t(0));
+            }
+            //only the written part: the open tail block may be the archive's last, and not a whole block yet
+            std::vector<uint8_t> theBlock(theUsed);
+            if (!readBytes(theBlock.data(), aLast * blockSize(), theUsed) ||
+                !writeBytes(theBlock.data(), aHole * blockSize(), theUsed)) {
+                blockManager.markBlocksAsFree({{aHole, 1}});
+                return ArchiveStatus<size_t>(ArchiveErrors::fileWriteError);
+            }
+            for (const auto &theName : blockManager.moveTailBlock(aLast, aHole)) {
+                auto theFile = blockManager.findFileEntry(theName);
+                if (journal.isOpen() && theFile.isOK()) {
+                    theSequence = logChange(JournalRecord::added, theName, theFile.getValue());
                 }
             }
-            aStream << i << ".   "
-                    << (blockManager.findFileEntry(fileName).isOK() ? "in use" : "free") << "   "
-                    << fileName << "\n";
         }
-        
-        notifyObservers(ActionType::dumped, "", true);
-        return ArchiveStatus<size_t>(blockCount);
+        auto theSettle = settleRelocation(theSequence, {{aLast, 1}});
+        if (!theSettle.isOK()) return ArchiveStatus<size_t>(theSettle.getError());
+        return ArchiveStatus<size_t>(size_t(1));
+    }
+
+    template<size_t BlockSize, size_t MetaSize>
+    ArchiveStatus<bool> BasicArchive<BlockSize, MetaSize>::settleRelocation(uint64_t aSequence,
+                                                                            const std::vector<Extent> &anOld) {
+        //the old blocks are only reusable once a crash can't bring back an entry pointing at them
+        auto theResult = aSequence ? commitChange(aSequence, isSyncOn()) : saveDirectory();
+        if (!theResult.isOK()) return theResult;
+        if (!aSequence && !settleChange(0).isOK()) return ArchiveStatus<bool>(ArchiveErrors::fileWriteError);
+        releaseBlocks(anOld);
+        return checkpoint(kJournalCheckpointBytes);
     }
 
     //--------------------------------------------------------------------------------
-    //BLOCK MANAGER FUNCTIONS
+    //DEFRAGMENT ONE FILE: copy its blocks into one run and repoint it, like a compactInPlace move
+    //(copied a run at a time, so memory stays bounded; the tail, if any, stays where it is)
     //--------------------------------------------------------------------------------
+    template<size_t BlockSize, size_t MetaSize>
+    ArchiveStatus<FragmentReport> BasicArchive<BlockSize, MetaSize>::fragmentation(const std::string &aFilename) {
+        std::lock_guard<std::mutex> theJournal(journalLock);
+        auto theFile = blockManager.findFileEntry(aFilename);
+        if (!theFile.isOK()) {
+            return ArchiveStatus<FragmentReport>(ArchiveErrors::fileNotFound);
+        }
+        FragmentReport theReport;
+        const auto &theExtents = theFile.getValue()->extents;
+        for (size_t i = 0; i < theExtents.size(); i++) {
+            theReport.blocks += theExtents[i].length;
+            if (i) {
+                size_t theFrom = theExtents[i - 1].end(), theTo = theExtents[i].start;
+                theReport.gapBlocks += theTo > theFrom ? theTo - theFrom : theFrom - theTo;
+            }
+        }
+        theReport.extents = theExtents.size();
+        return ArchiveStatus<FragmentReport>(theReport);
+    }
 
-    std::vector<size_t> BlockManager::findFreeBlocks(size_t blockCount) {
-        //Find free blocks
-        std::vector<size_t> freeBlocks;
-        for (size_t i=0;i<<blockStatus.size(); i++) {
-            if (blockStatus[i] == BlockMode::free) {
-                freeBlocks.push_back(i);
-                if (freeBlocks.size() == blockCount) {
-                    break;
-                }
+    template<size_t BlockSize, size_t MetaSize>
+    size_t BasicArchive<BlockSize, MetaSize>::claimRun(size_t aCount) {
+        //a free run can span groups, so claim it group by group (someone may take part of it first)
+        size_t theStart = blockManager.findFreeRun(aCount);
+        if (theStart != kNoBlock) {
+            size_t theClaimed = 0;
+            while (theClaimed < aCount) {
+                size_t theCount = blockManager.claimBlocks(theStart + theClaimed, aCount - theClaimed);
+                if (!theCount) break;
+                theClaimed += theCount;
             }
+            if (theClaimed == aCount) return theStart;
+            if (theClaimed) blockManager.markBlocksAsFree({{theStart, theClaimed}});
         }
-        return freeBlocks;
+        theStart = blockManager.appendUsedBlocks(aCount);
+        reserveSpace((theStart + aCount) * blockSize());
+        return theStart;
     }
 
-    ArchiveStatus<bool> BlockManager::markBlocksAsUsed(const std::vector<size_t>& blocks) {
-        for (size_t block : blocks) {
-            if (block >= blockStatus.size()) {
-                return ArchiveStatus<bool>(ArchiveErrors::badBlockIndex);
+    template<size_t BlockSize, size_t MetaSize>
+    ArchiveStatus<bool> BasicArchive<BlockSize, MetaSize>::defragment(const std::string &aFilename) {
+        FileEntry theEntry;
+        {
+            std::lock_guard<std::mutex> theJournal(journalLock);
+            auto theFile = blockManager.findFileEntry(aFilename);
+            if (!theFile.isOK()) {
+                notifyObservers(ActionType::compacted, aFilename, false);
+                return ArchiveStatus<bool>(ArchiveErrors::fileNotFound);
             }
-            blockStatus[block] = BlockMode::inUse;
+            theEntry = *theFile.getValue();
+        }
+        if (theEntry.extents.size() <= 1) { //already one run
+            notifyObservers(ActionType::compacted, aFilename, true);
+            return ArchiveStatus<bool>(true);
+        }
+
+        auto theMove = moveFile(aFilename, theEntry);
+        if (!theMove.isOK() || !theMove.getValue()) { //failed, or removed/re-added/moved meanwhile
+            notifyObservers(ActionType::compacted, aFilename, false);
+            return ArchiveStatus<bool>(theMove.isOK() ? ArchiveErrors::fileNotFound : theMove.getError());
         }
+        notifyObservers(ActionType::compacted, aFilename, true);
         return ArchiveStatus<bool>(true);
     }
 
-    ArchiveStatus<bool> BlockManager::markBlocksAsFree(const std::vector<size_t>& blocks) {
-        for (size_t block : blocks) {
-            if (block >= blockStatus.size()) {
-                return ArchiveStatus<bool>(ArchiveErrors::badBlockIndex);
+    template<size_t BlockSize, size_t MetaSize>
+    ArchiveStatus<size_t> BasicArchive<BlockSize, MetaSize>::moveFile(const std::string &aFilename,
+                                                                      const FileEntry &anEntry) {
+        size_t theCount = 0;
+        for (const auto &theExtent : anEntry.extents) theCount += theExtent.length;
+        std::vector<Extent> theTarget;
+        if (blockManager.getPolicy() == AllocationPolicy::logStructured) {
+            theTarget = blockManager.takeBlocks(theCount);
+            if (!theTarget.empty()) reserveSpace(theTarget.back().end() * blockSize());
+        }
+        else {
+            theTarget = {{claimRun(theCount), theCount}};
+        }
+
+        //copy a source run at a time, spread over the target runs in order
+        std::vector<uint8_t> theBuffer;
+        size_t theRun = 0, theOffset = 0; //target run being filled, blocks already in it
+        bool isCopied = eachRun(anEntry.extents, [&](size_t aStart, size_t aCount, size_t) {
+            theBuffer.resize(aCount * blockSize());
+            if (!readRaw(theBuffer.data(), aStart, aCount)) return false;
+            for (size_t theDone = 0; theDone < aCount;) {
+                size_t thePart = std::min(aCount - theDone, theTarget[theRun].length - theOffset);
+                if (!writeRaw(theBuffer.data() + theDone * blockSize(), theTarget[theRun].start + theOffset, thePart)) {
+                    return false;
+                }
+                theDone += thePart;
+                theOffset += thePart;
+                if (theOffset == theTarget[theRun].length) {
+                    theRun++;
+                    theOffset = 0;
+                }
             }
-            blockStatus[block] = BlockMode::free;
+            return true;
+        });
+        if (!isCopied) {
+            blockManager.markBlocksAsFree(theTarget);
+            return ArchiveStatus<size_t>(ArchiveErrors::fileWriteError);
         }
-        return ArchiveStatus<bool>(true);
+
+        uint64_t theSequence = 0;
+        {
+            std::unique_lock<std::shared_mutex> theMove(relocationLock);
+            std::lock_guard<std::mutex> theJournal(journalLock);
+            auto theFile = blockManager.findFileEntry(aFilename);
+            if (!theFile.isOK() || !isUnchanged(*theFile.getValue(), anEntry.extents, anEntry.sequence)) {
+                blockManager.markBlocksAsFree(theTarget);
+                return ArchiveStatus<size_t>(size_t(0));
+            }
+            FileEntry theEntry = *theFile.getValue();
+            theEntry.extents = theTarget;
+            blockManager.replaceExtents(aFilename, theEntry.extents);
+            if (journal.isOpen()) theSequence = logChange(JournalRecord::added, aFilename, &theEntry);
+        }
+
+        auto theSettle = settleRelocation(theSequence, anEntry.extents);
+        if (!theSettle.isOK()) return ArchiveStatus<size_t>(theSettle.getError());
+        return ArchiveStatus<size_t>(theCount);
     }
 
-    ArchiveStatus<bool> BlockManager::addFileEntry(const std::string& filename, const std::vector<size_t>& blocks) {
-        auto file = fileEntries.find(filename);
-        if (file != fileEntries.end()) {
-            return ArchiveStatus<bool>(ArchiveErrors::fileExists);
+    //--------------------------------------------------------------------------------
+    //SEGMENT CLEANING (log structured archives): the log never writes into holes, so space only comes
+    //back when a whole segment empties; the cleaner empties the emptiest ones by moving what's still in
+    //them to the log head (each move is a moveFile/relocateTail, so it's atomic and durable)
+    //--------------------------------------------------------------------------------
+    template<size_t BlockSize, size_t MetaSize>
+    ArchiveStatus<size_t> BasicArchive<BlockSize, MetaSize>::cleanSegments(double aMinFree,
+                                                                           const CompactCallback &aCallback) {
+        if (blockManager.getPolicy() != AllocationPolicy::logStructured) {
+            return ArchiveStatus<size_t>(ArchiveErrors::badMode);
         }
+        size_t theSegment = blockManager.getGroupBlocks();
+        size_t theTotal = blockManager.getTotalBlocks();
+        size_t theHead = blockManager.logSegment();
+        std::vector<size_t> theFree = blockManager.groupFreeCounts();
+
+        //(free blocks, segment): partly used ones past the threshold, except the one being written
+        std::vector<std::pair<size_t, size_t>> theVictims;
+        for (size_t i = 0; i < theFree.size(); i++) {
+            size_t theSize = std::min(theTotal, (i + 1) * theSegment) - i * theSegment;
+            if (i != theHead && theFree[i] < theSize && theFree[i] && theFree[i] >= aMinFree * theSize) {
+                theVictims.push_back({theFree[i], i});
+            }
+        }
+        std::sort(theVictims.begin(), theVictims.end(), std::greater<>());
+
+        CompactProgress theProgress;
+        size_t theCleaned = 0;
+        for (const auto &theVictim : theVictims) {
+            size_t theStart = theVictim.second * theSegment, theEnd = theStart + theSegment;
+            auto isInside = [&](size_t aBlock) { return aBlock >= theStart && aBlock < theEnd; };
+
+            //what's still here: files with a run in it (moved whole, they're mostly in one segment anyway)
+            std::vector<std::pair<std::string, FileEntry>> theFiles;
+            std::set<size_t> theTails;
+            {
+                std::lock_guard<std::mutex> theJournal(journalLock);
+                blockManager.eachFileEntry([&](const std::string &aName, const FileEntry &anEntry) {
+                    for (const auto &theExtent : anEntry.extents) {
+                        if (theExtent.start < theEnd && theExtent.end() > theStart) {
+                            theFiles.push_back({aName, anEntry});
+                            break;
+                        }
+                    }
+                    if (anEntry.tail.length && isInside(anEntry.tail.block)) theTails.insert(anEntry.tail.block);
+                });
+            }
+
+            size_t theMoved = 0;
+            for (const auto &theFile : theFiles) {
+                if (isSnapshotBlock(theFile.second.extents.front().start)) continue; //a snapshot keeps it here anyway
+                auto theMove = moveFile(theFile.first, theFile.second);
+                if (!theMove.isOK()) {
+                    notifyObservers(ActionType::compacted, "", false);
+                    return theMove;
+                }
+                theMoved += theMove.getValue();
+            }
+            for (size_t theTail : theTails) {
+                if (isSnapshotBlock(theTail)) continue;
+                std::vector<Extent> theHole = blockManager.takeBlocks(1);
+                reserveSpace(theHole.front().end() * blockSize());
+                auto theMove = relocateTail(theTail, theHole.front().start);
+                if (!theMove.isOK()) {
+                    notifyObservers(ActionType::compacted, "", false);
+                    return theMove;
+                }
+                theMoved += theMove.getValue();
+            }
+
+            auto theNow = blockManager.groupFreeCounts(); //(a concurrent trim may have cut it off)
+            if (theVictim.second < theNow.size() && theNow[theVictim.second] == std::min(theTotal, theEnd) - theStart) {
+                theCleaned++;
+            }
 
-        fileEntries[filename] = blocks;
+            theProgress.movedBlocks += theMoved;
+            if (aCallback) {
+                theProgress.freeBlocks = blockManager.countFreeBlocks();
+                theProgress.blockCount = blockManager.getTotalBlocks();
+                if (!aCallback(theProgress)) break;
+            }
+        }
 
-        //update blockStatus
-        for (size_t block : blocks) {
-            blockStatus[block] = BlockMode::inUse;
+        bool theResult = trimFreeEnd().isOK();
+        notifyObservers(ActionType::compacted, "", theResult);
+        if (!theResult) {
+            return ArchiveStatus<size_t>(ArchiveErrors::fileWriteError);
         }
+        return ArchiveStatus<size_t>(theCleaned);
+    }
 
-        return ArchiveStatus<bool>(true);
+    //--------------------------------------------------------------------------------
+    //SNAPSHOTS: a snapshot is a copy of the directory; its blocks are shared with the live archive
+    //and counted in snapshotRefs, so removing or moving a live file just leaves them in place
+    //(files are never rewritten in place, so nothing ever has to be copied for a snapshot)
+    //--------------------------------------------------------------------------------
+    template<size_t BlockSize, size_t MetaSize>
+    bool BasicArchive<BlockSize, MetaSize>::isSnapshotBlock(size_t aBlock) const {
+        std::shared_lock<std::shared_mutex> theSnapshots(snapshotLock);
+        return snapshotRefs.isShared(aBlock);
     }
 
-    ArchiveStatus<bool> BlockManager::removeFileEntry(const std::string& filename) {
-        auto file = fileEntries.find(filename);
-        if (file == fileEntries.end()) {
-            return ArchiveStatus<bool>(ArchiveErrors::fileNotFound);
+    template<size_t BlockSize, size_t MetaSize>
+    void BasicArchive<BlockSize, MetaSize>::rebuildSnapshotRefs() {
+        std::unique_lock<std::shared_mutex> theSnapshots(snapshotLock);
+        snapshotRefs.clear();
+        if (snapshots.empty()) return;
+        for (const auto &theSnapshot : snapshots) {
+            for (const auto &theFile : theSnapshot.second) snapshotRefs.addRefs(entryBlocks(theFile.second));
         }
+        std::vector<Extent> theLive;
+        blockManager.eachFileEntry([&](const std::string &, const FileEntry &anEntry) {
+            for (const auto &theExtent : entryBlocks(anEntry)) theLive.push_back(theExtent);
+        });
+        snapshotRefs.holdAllBut(theLive);
+        blockManager.markBlocksAsUsed(snapshotRefs.extents()); //held blocks aren't the live files', but aren't free
+    }
 
-        //update blockStatus
-        for (size_t block : file->second) {
-            blockStatus[block] = BlockMode::free;
+    template<size_t BlockSize, size_t MetaSize>
+    ArchiveStatus<bool> BasicArchive<BlockSize, MetaSize>::snapshot(const std::string &aName) {
+        if (formatVersion < kSnapshotVersion) {
+            return ArchiveStatus<bool>(ArchiveErrors::badMode); //older directories have nowhere to keep it
+        }
+        if (aName.empty()) {
+            return ArchiveStatus<bool>(ArchiveErrors::badFilename);
         }
+        {
+            std::lock_guard<std::mutex> theJournal(journalLock); //directory can't change while it's copied
+            std::unique_lock<std::shared_mutex> theSnapshots(snapshotLock);
+            if (snapshots.count(aName)) {
+                return ArchiveStatus<bool>(ArchiveErrors::fileExists);
+            }
+            auto &theFrozen = snapshots[aName];
+            blockManager.eachFileEntry([&](const std::string &aFile, const FileEntry &anEntry) {
+                theFrozen[aFile] = anEntry;
+                snapshotRefs.addRefs(entryBlocks(anEntry));
+            });
+        }
+        return checkpoint(); //saved with the directory
+    }
 
-        fileEntries.erase(filename);
+    template<size_t BlockSize, size_t MetaSize>
+    ArchiveStatus<bool> BasicArchive<BlockSize, MetaSize>::dropSnapshot(const std::string &aName) {
+        std::vector<Extent> theFree;
+        {
+            std::unique_lock<std::shared_mutex> theReaders(relocationLock); //no extractSnapshot mid-read
+            std::unique_lock<std::shared_mutex> theSnapshots(snapshotLock);
+            auto theSnapshot = snapshots.find(aName);
+            if (theSnapshot == snapshots.end()) {
+                return ArchiveStatus<bool>(ArchiveErrors::fileNotFound);
+            }
+            for (const auto &theFile : theSnapshot->second) {
+                for (const auto &theExtent : snapshotRefs.dropRefs(entryBlocks(theFile.second))) {
+                    theFree.push_back(theExtent);
+                }
+            }
+            snapshots.erase(theSnapshot);
+        }
+        //its blocks are reusable once a crash can't bring it back
+        auto theSave = checkpoint();
+        if (!theSave.isOK()) return theSave;
+        releaseBlocks(theFree);
         return ArchiveStatus<bool>(true);
     }
 
-    ArchiveStatus<std::vector<size_t>> BlockManager::findFileEntry(const std::string& filename) {
-        auto file = fileEntries.find(filename);
-        if (file != fileEntries.end()) {
-            return ArchiveStatus<std::vector<size_t>>(file->second);
+    template<size_t BlockSize, size_t MetaSize>
+    ArchiveStatus<size_t> BasicArchive<BlockSize, MetaSize>::listSnapshots(std::ostream &aStream) {
+        std::shared_lock<std::shared_mutex> theSnapshots(snapshotLock);
+        aStream << "###  snapshot         files\n";
+        aStream << "------------------------------------------------\n";
+        size_t theNumber = 1;
+        for (const auto &theSnapshot : snapshots) {
+            aStream << theNumber++ << ".   " << theSnapshot.first << "    " << theSnapshot.second.size() << "\n";
         }
-        return ArchiveStatus<std::vector<size_t>>(ArchiveErrors::fileNotFound);
+        notifyObservers(ActionType::listed, "", true);
+        return ArchiveStatus<size_t>(snapshots.size());
     }
-        
-    std::map<std::string, std::vector<size_t>> BlockManager::getAllFileEntries() const {
-        return fileEntries;
+
+    template<size_t BlockSize, size_t MetaSize>
+    ArchiveStatus<size_t> BasicArchive<BlockSize, MetaSize>::listSnapshot(const std::string &aName, std::ostream &aStream) {
+        std::map<std::string, FileEntry> theFiles;
+        {
+            std::shared_lock<std::shared_mutex> theSnapshots(snapshotLock);
+            auto theSnapshot = snapshots.find(aName);
+            if (theSnapshot == snapshots.end()) {
+                notifyObservers(ActionType::listed, aName, false);
+                return ArchiveStatus<size_t>(ArchiveErrors::fileNotFound);
+            }
+            theFiles = theSnapshot->second;
+        }
+        size_t theCount = writeListing(theFiles, aStream);
+        notifyObservers(ActionType::listed, aName, true);
+        return ArchiveStatus<size_t>(theCount);
     }
 
-    //--------------------------------------------------------------------------------
-    //COMPACT ARCHIVE: TODO (FINAL???)
-    //--------------------------------------------------------------------------------
-    ArchiveStatus<size_t> Archive::compact() {
-        auto fileEntries = blockManager.getAllFileEntries();
-        std::vector<Block> newBlocks;
-        std::map<std::string, std::vector<size_t>> newFileEntries;
-    
-        size_t newBlockIndex = 0;
-    
-        for (const auto& file : fileEntries) {
-            std::vector<size_t> oldBlocks = file.second;
-            std::vector<size_t> newBlockList;
-            for (size_t oldBlock : oldBlocks) {
-                Block tempBlock;
-                if (readBlock(tempBlock, oldBlock)) {
-                    newBlocks.push_back(tempBlock);
-                    newBlockList.push_back(newBlockIndex++);
-                }
+    template<size_t BlockSize, size_t MetaSize>
+    ArchiveStatus<bool> BasicArchive<BlockSize, MetaSize>::extractSnapshot(const std::string &aName,
+            const std::string &aFilename, const std::string &aFullPath) {
+        std::shared_lock<std::shared_mutex> theRead(relocationLock); //the snapshot can't be dropped meanwhile
+        FileEntry theEntry;
+        bool isFound = false;
+        {
+            std::shared_lock<std::shared_mutex> theSnapshots(snapshotLock);
+            auto theSnapshot = snapshots.find(aName);
+            if (theSnapshot != snapshots.end()) {
+                auto theFile = theSnapshot->second.find(aFilename);
+                isFound = theFile != theSnapshot->second.end();
+                if (isFound) theEntry = theFile->second;
             }
-            newFileEntries[file.first] = newBlockList;
+        }
+        if (!isFound) {
+            notifyObservers(ActionType::extracted, aFilename, false);
+            return ArchiveStatus<bool>(ArchiveErrors::fileNotFound);
         }
 
-        //rewrite archive
-        stream.close();
-        stream.open(aPath, std::ios::binary | std::ios::out | std::ios::trunc);
-        for (size_t i=0;i<newBlocks.size();i++) {
-            writeBlock(newBlocks[i], i);
+        std::fstream outputFile(aFullPath, std::ios::out | std::ios::binary | std::ios::trunc);
+        if (!outputFile) {
+            notifyObservers(ActionType::extracted, aFilename, false);
+            return ArchiveStatus<bool>(ArchiveErrors::fileOpenError);
         }
+        if (!readFileBlocks(theEntry, outputFile)) {
+            notifyObservers(ActionType::extracted, aFilename, false);
+            return ArchiveStatus<bool>(ArchiveErrors::badBlock);
+        }
+        outputFile.close();
+        notifyObservers(ActionType::extracted, aFilename, true);
+        return ArchiveStatus<bool>(true);
+    }
+
+    //--------------------------------------------------------------------------------
+    //BACKGROUND COMPACTOR: compactInPlace passes, a move at a time, throttled and yielding to
+    //foreground calls (see CompactorPolicy)
+    //--------------------------------------------------------------------------------
+    template<size_t BlockSize, size_t MetaSize>
+    void BasicArchive<BlockSize, MetaSize>::setCompactor(const CompactorPolicy &aPolicy) {
+        stopCompactor();
+        compaction = aPolicy;
+        if (compaction.enabled) startCompactor();
+    }
+
+    template<size_t BlockSize, size_t MetaSize>
+    bool BasicArchive<BlockSize, MetaSize>::needsCompaction() const {
+        size_t theTotal = blockManager.getTotalBlocks();
+        return theTotal > kSuperBlockIndex + 1 &&
+               blockManager.countFreeBlocks() >= compaction.freeRatio * theTotal;
+    }
 
-        //update blockManager
-        blockManager = BlockManager(); //reset
+    template<size_t BlockSize, size_t MetaSize>
+    void BasicArchive<BlockSize, MetaSize>::startCompactor() {
+        isCompactorStopping = false;
+        compactor = std::thread([this]() {
+            isCompactorThread = true;
+            TokenBucket theBucket(compaction.bytesPerSecond, compaction.burstBytes);
+            size_t theStuckAt = kNoBlock; //free count a pass couldn't improve on (no point retrying until it changes)
+            std::unique_lock<std::mutex> theLock(compactLock);
+            while (!isCompactorStopping) {
+                compactWake.wait_for(theLock, std::chrono::milliseconds(compaction.checkMillis));
+                if (isCompactorStopping || !needsCompaction() || blockManager.countFreeBlocks() == theStuckAt) {
+                    continue;
+                }
+                theLock.unlock();
+                size_t theMoved = 0;
+                auto theThrottle = [&](const CompactProgress &aProgress) {
+                    size_t theBytes = (aProgress.movedBlocks - theMoved) * blockSize() * 2; //read + write
+                    theMoved = aProgress.movedBlocks;
+                    return pauseCompactor(theBucket.take(theBytes));
+                };
+                if (pauseCompactor(std::chrono::microseconds(0))) {
+                    if (blockManager.getPolicy() == AllocationPolicy::logStructured) {
+                        cleanSegments(compaction.freeRatio, theThrottle);
+                    }
+                    else {
+                        compactInPlace(std::min(compaction.burstBytes, kCompactBudget), theThrottle);
+                    }
+                }
+                theStuckAt = theMoved ? kNoBlock : blockManager.countFreeBlocks();
+                theLock.lock();
+            }
+        });
+    }
 
-        //add file entries
-        for (const auto& file : newFileEntries) {
-            blockManager.addFileEntry(file.first, file.second);
+    template<size_t BlockSize, size_t MetaSize>
+    void BasicArchive<BlockSize, MetaSize>::stopCompactor() {
+        if (!compactor.joinable()) return;
+        {
+            std::lock_guard<std::mutex> theLock(compactLock);
+            isCompactorStopping = true;
         }
+        compactWake.notify_all();
+        compactor.join(); //a pass in progress stops after its current move
+    }
 
-        notifyObservers(ActionType::compacted, "", true);
-        return ArchiveStatus<size_t>(newBlocks.size());
+    template<size_t BlockSize, size_t MetaSize>
+    bool BasicArchive<BlockSize, MetaSize>::pauseCompactor(std::chrono::microseconds aWait) {
+        std::unique_lock<std::mutex> theLock(compactLock);
+        if (compactWake.wait_for(theLock, aWait, [this]() { return isCompactorStopping; })) return false;
+        //foreground calls go first (polled: they don't pay for a notify), but not forever
+        auto theGiveUp = std::chrono::steady_clock::now() + std::chrono::milliseconds(compaction.maxYieldMillis);
+        while (foregroundCalls && std::chrono::steady_clock::now() < theGiveUp) {
+            if (compactWake.wait_for(theLock, std::chrono::milliseconds(1), [this]() { return isCompactorStopping; })) {
+                return false;
+            }
+        }
+        return !isCompactorStopping;
     }
 
-} // namespace ECE141
\ No newline at end of file
+    //--------------------------------------------------------------------------------
+    //INSTANTIATIONS: geometries available to users (see extern templates in Archive.hpp)
+    //--------------------------------------------------------------------------------
+    template class BasicArchive<kDynamicSize, kDynamicSize>;
+    template class BasicArchive<kBlockSize, kMetaSize>;
+    template class BasicArchive<4096, 64>;
+    template class BasicArchive<4096, 0>;
+
+} // namespace ECE141
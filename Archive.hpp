@@ -18,8 +18,22 @@
 #include <stdexcept>
 #include <functional>
 #include <map>
+#include <set>
+#include <deque>
+#include <mutex>
+#include <shared_mutex>
+#include <condition_variable>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
 #include <cstring>
 #include <ctime>
+#include <cstddef>
+#include <cstdint>
+#include <array>
+#include <limits>
+#include <type_traits>
 
 namespace ECE141 {
     //NOTE: enum is global scope, enum class is local scope (avoids name conflicts)
@@ -27,9 +41,14 @@ namespace ECE141 {
 
     //GLOBAL ENUMS
     enum class ActionType {added, extracted, removed, listed, dumped, compacted}; //actions that can be performed on archive
-    enum class AccessMode {AsNew, AsExisting}; //mode to open archive
+    enum class AccessMode {AsNew, AsExisting, AsRecovered}; //mode to open archive
     enum class BlockMode : uint8_t {free = 0, inUse = 1}; //block status
-    enum class BlockType : uint8_t {data = 0, metaData = 1}; //block type (not really used yet)
+    enum class BlockType : uint8_t {data = 0, metaData = 1, tail = 2}; //tail = shared by several files' last fragments
+    enum class BlockLayout : uint8_t {headered, headerless}; //headerless = data blocks are pure payload
+    //how add picks blocks: lowest free blocks / smallest run that fits / lowest run that fits
+    //(best/contiguous fall back to the fewest, largest runs when no single run fits)
+    //logStructured = append at a log head, never into holes (cleanSegments gets the space back)
+    enum class AllocationPolicy : uint8_t {firstFit = 0, bestFit = 1, contiguousFirst = 2, logStructured = 3};
 
     /*
     NOTE: If the user called the "list", "compact", or "dump" commands on your archive, there is no specific document. In that case, 
@@ -116,23 +135,319 @@ namespace ECE141 {
     constexpr size_t kBlockSize = 1024;
     constexpr size_t kMetaSize = 100;
     constexpr size_t kPayloadSize = kBlockSize - kMetaSize;
+    constexpr size_t kDynamicSize = std::numeric_limits<size_t>::max(); //template arg: geometry comes from the superblock
+
+    // Archive format constants
+    constexpr char     kArchiveMagic[8] = {'E','C','E','1','4','1','A','R'};
+    constexpr uint32_t kFormatVersion = 10; //v1: block lists, v2: extents, v3: 64-bit block headers, v4: block layout, v5: tails, v6: inline files, v7: free bitmap, v8: add order + read counts, v9: snapshots, v10: volumes
+    constexpr uint32_t kLegacyHeaderVersion = 2; //archives up to this version use 8-bit block numbers
+    constexpr uint32_t kExtendedSuperVersion = 4; //archives from this version on use the SuperBlock extension
+    constexpr uint32_t kTailVersion = 5; //directory records carry a Tail from this version on
+    constexpr uint32_t kInlineVersion = 6; //directory records carry inline file bytes from this version on
+    constexpr size_t   kInlineLimit = 64; //files up to this size can live in their directory record
+    constexpr uint32_t kBitmapVersion = 7; //directory ends with the free-space bitmap from this version on
+    constexpr uint32_t kLocalityVersion = 8; //directory records carry add sequence + read count from this version on
+    constexpr uint32_t kSnapshotVersion = 9; //directory ends with the snapshots' directories from this version on
+    constexpr uint32_t kVolumeVersion = 10; //SuperBlock extension carries volumeCount + stripeBlocks from this version on
+    constexpr size_t   kStripeBlocks = 1024; //default blocks per stripe of a multi-volume archive
+    constexpr size_t   kSuperBlockIndex = 0; //block 0 is reserved for the superblock
+    constexpr size_t   kSuperHeaderSize = 128; //bytes of block 0 used by SuperBlock (rest holds inline directory)
+
+    //--------------------------------------------------------------------------------
+    //SUPER BLOCK: archive header stored at the start of block 0
+    //- versioned so openArchive can reject (or upgrade) archives it doesn't understand
+    //- points at the serialized directory (name -> blocks, size, timestamp)
+    //- small directories live inline in block 0, larger ones in a region after the last block
+    //--------------------------------------------------------------------------------
+    struct SuperBlock {
+        char     magic[8]; //kArchiveMagic
+        uint32_t version; //kFormatVersion
+        uint32_t blockSize; //size of every block in bytes
+        uint64_t blockCount; //blocks in archive (including block 0)
+        uint64_t entryCount; //number of files in directory
+        uint64_t directoryOffset; //byte offset of serialized directory
+        uint64_t directoryLength; //serialized directory size in bytes
+        uint32_t directoryChecksum; //checksum of serialized directory
+        uint32_t headerChecksum; //checksum of the other fields (extension included from v4)
+
+        //extension (v4+, zero in older archives)
+        uint32_t metaSize; //header bytes per data block (0 = header-less, metadata only in directory)
+        uint32_t flags; //feature bits (kTailPackingFlag, kInlineFilesFlag) + AllocationPolicy
+
+        //v10+ (checksummed from v10 on)
+        uint32_t volumeCount; //files the blocks are striped over (0/1 = just this one; others listed in .volumes)
+        uint32_t stripeBlocks; //blocks per stripe when volumeCount > 1
+    };
+
+    //SuperBlock::flags
+    constexpr uint32_t kTailPackingFlag = 1u << 0; //small last fragments are packed into shared tail blocks
+    constexpr uint32_t kInlineFilesFlag = 1u << 1; //files up to kInlineLimit bytes are kept in the directory
+    constexpr uint32_t kHolePunchFlag = 1u << 2; //remove punches freed runs out of the file (sparse, same layout)
+    constexpr uint32_t kJournalFlag = 1u << 3; //add/remove go through the write-ahead journal (see Journal)
+    constexpr uint32_t kAllocationShift = 8; //AllocationPolicy lives in flags bits 8..9
+    constexpr uint32_t kAllocationMask = 3u << kAllocationShift;
+    static_assert(sizeof(SuperBlock) <= kSuperHeaderSize, "SuperBlock must fit in its reserved header");
+
+    //--------------------------------------------------------------------------------
+    //EXTENT: run of contiguous blocks [start, start+length)
+    //--------------------------------------------------------------------------------
+    struct Extent {
+        size_t start{0};
+        size_t length{0};
+
+        size_t end() const { return start + length; }
+    };
+
+    constexpr size_t kNoBlock = std::numeric_limits<size_t>::max(); //"not found" block index
+
+    //append aLength blocks starting at aStart, merging with the last extent when contiguous
+    void appendExtent(std::vector<Extent> &anExtents, size_t aStart, size_t aLength = 1);
+
+    //--------------------------------------------------------------------------------
+    //GROWTH POLICY: how far ahead of the data the archive reserves disk space
+    //- each time writes pass the reservation, it grows by factor * current reservation,
+    //  clamped to [minChunk, maxChunk] bytes (so big ingests get big, contiguous extents)
+    //- reserving doesn't change the file size or the block count, only what the filesystem holds for us
+    //--------------------------------------------------------------------------------
+    struct GrowthPolicy {
+        size_t minChunk{1024 * 1024}; //bytes
+        size_t maxChunk{256 * 1024 * 1024}; //bytes
+        double factor{0.5}; //0 = reserve just what each add needs
+
+        //new reservation end once data must reach aNeeded (with aReserved bytes already reserved)
+        size_t reserveEnd(size_t aReserved, size_t aNeeded) const {
+            if (aNeeded <= aReserved) return aReserved;
+            if (factor <= 0) return aNeeded;
+            size_t theChunk = static_cast<size_t>(aReserved * factor);
+            theChunk = std::min(std::max(theChunk, minChunk), std::max(minChunk, maxChunk));
+            return std::max(aNeeded, aReserved + theChunk);
+        }
+    };
+
+    //--------------------------------------------------------------------------------
+    //DURABILITY: when changes are forced to disk (a runtime choice, not saved with the archive)
+    //- none: never fsync (a crashed bulk load is redone; the OS still gets every write)
+    //- everyChange: add/remove return once the change is on disk (concurrent ones share fsyncs)
+    //- periodic: a background thread flushes every flushMillis, or sooner once flushBytes are queued;
+    //  a crash loses at most that window (removes still wait, so their blocks can't be reused early)
+    //--------------------------------------------------------------------------------
+    enum class Durability : uint8_t {none, everyChange, periodic};
+
+    struct DurabilityPolicy {
+        Durability mode{Durability::everyChange};
+        size_t flushMillis{50}; //periodic: longest a change waits
+        size_t flushBytes{1024 * 1024}; //periodic: queued journal bytes that trigger an early flush
+    };
+
+    //--------------------------------------------------------------------------------
+    //IN-PLACE COMPACTION: progress reported after each move (callback returns false to pause)
+    //- every move is durable on its own, so a paused or crashed run just resumes on the next call
+    //--------------------------------------------------------------------------------
+    constexpr size_t kCompactBudget = 1024 * 1024; //bytes of block data held at once
+
+    struct CompactProgress {
+        size_t movedBlocks{0}; //moved so far in this call
+        size_t freeBlocks{0}; //holes still left in the archive
+        size_t blockCount{0}; //current archive size in blocks
+    };
+    using CompactCallback = std::function<bool(const CompactProgress &aProgress)>;
+
+    //--------------------------------------------------------------------------------
+    //COMPACT ORDER: how compact() lays files out, so files read together end up side by side
+    //- name: alphabetical (the old layout)
+    //- insertion: in the order they were added
+    //- heat: most extracted first (read counts are kept in the directory)
+    //- group: by a caller's key (e.g. directory or project), insertion order within a group
+    //--------------------------------------------------------------------------------
+    enum class CompactOrder : uint8_t {name, insertion, heat, group};
+    using CompactGroupKey = std::function<std::string(const std::string &aName)>;
+
+    //FRAGMENTATION of one file: how many runs its full blocks are split into, and how far apart they lie
+    struct FragmentReport {
+        size_t blocks{0};
+        size_t extents{0};
+        size_t gapBlocks{0}; //blocks skipped (either direction) going from one run to the next, ~ seek distance
+
+        bool isContiguous() const { return extents <= 1; }
+    };
+
+    //--------------------------------------------------------------------------------
+    //BACKGROUND COMPACTION: a thread that runs compactInPlace once enough of the archive is free
+    //(cleanSegments instead for log structured archives, with freeRatio as the per-segment threshold)
+    //- a pass starts when free blocks reach freeRatio of the archive (checked every checkMillis, and on remove)
+    //- bytes it reads + writes are capped by a token bucket (bytesPerSecond, bursts up to burstBytes)
+    //- between moves it backs off while add/extract calls run, for at most maxYieldMillis at a time
+    //- its passes don't notify observers (they only ever hear from the thread that made the call)
+    //--------------------------------------------------------------------------------
+    struct CompactorPolicy {
+        bool enabled{false};
+        double freeRatio{0.25};
+        size_t bytesPerSecond{8 * 1024 * 1024};
+        size_t burstBytes{1024 * 1024}; //also the most one move holds in memory
+        size_t checkMillis{1000};
+        size_t maxYieldMillis{100};
+    };
+
+    //TOKEN BUCKET: refills at rate bytes/s up to burst; spending may go into debt, which the caller waits off
+    struct TokenBucket {
+        using Clock = std::chrono::steady_clock;
+
+        double rate{0}; //0 = unlimited
+        double burst{0};
+        double tokens{0};
+        Clock::time_point last{Clock::now()};
+
+        TokenBucket(size_t aRate = 0, size_t aBurst = 0) : rate(aRate), burst(aBurst), tokens(aBurst) {}
+
+        //spend aBytes, returns how long to wait before the next spend
+        std::chrono::microseconds take(size_t aBytes, Clock::time_point aNow = Clock::now()) {
+            if (rate <= 0) return std::chrono::microseconds(0);
+            tokens = std::min(burst, tokens + std::chrono::duration<double>(aNow - last).count() * rate);
+            last = aNow;
+            tokens -= aBytes;
+            if (tokens >= 0) return std::chrono::microseconds(0);
+            return std::chrono::microseconds(static_cast<int64_t>(-tokens / rate * 1e6));
+        }
+    };
+
+    //--------------------------------------------------------------------------------
+    //ARCHIVE OPTIONS: choices made once, at createArchive time (format choices are stored in the
+    //superblock; the policies marked "not saved" only last for this session)
+    //--------------------------------------------------------------------------------
+    struct ArchiveOptions {
+        BlockLayout layout{BlockLayout::headered}; //headerless = no per-block header, ~10% more payload
+        size_t blockSize{kBlockSize}; //power of two, kSmallestBlockSize..kLargestBlockSize (bigger = fewer I/Os per file)
+        bool tailPacking{false}; //fragments up to half a payload share blocks (see Tail)
+        bool inlineFiles{true}; //files up to kInlineLimit bytes live in the directory, no data blocks at all
+                                //(so recoverArchive can't bring them back)
+        AllocationPolicy allocation{AllocationPolicy::contiguousFirst}; //can be changed later (setAllocationPolicy)
+        size_t segmentBlocks{0}; //allocation group = log segment size, multiple of 64 (0 = kGroupBlocks; not saved)
+        bool punchHoles{false}; //remove gives freed blocks' disk space back right away (Linux fallocate;
+                                //elsewhere blocks are just marked free until compact)
+        size_t initialCapacity{0}; //bytes of disk reserved up front by createArchive
+        bool journal{true}; //log adds/removes (one fsync per batch) instead of rewriting the directory each time
+        DurabilityPolicy durability; //not saved with the archive (see setDurability)
+        GrowthPolicy growth; //not saved with the archive (see setGrowthPolicy)
+        CompactorPolicy compactor; //not saved with the archive (see setCompactor)
+        //MULTI-VOLUME: blocks are striped over this .arc and one more file per directory listed here
+        //(e.g. one per drive), stripeBlocks at a time; I/O on different volumes runs in parallel
+        std::vector<std::string> volumes;
+        size_t stripeBlocks{kStripeBlocks}; //multiple of 64
+        bool memoryMapped{false}; //extract copies straight from mmapped volume files (not saved; see setMemoryMapped)
+    };
+
+    //--------------------------------------------------------------------------------
+    //TAIL: a file's last fragment, packed into a block shared with other files' tails
+    //- a tail block's payload is just the fragments back to back (header, if any, has type tail)
+    //- NOTE: fragments have no per-file header, so recoverArchive can't rebuild tail-packed files
+    //--------------------------------------------------------------------------------
+    struct Tail {
+        size_t block{0}; //tail block index
+        size_t offset{0}; //byte offset inside the block's payload
+        size_t length{0}; //fragment size (0 = file has no tail)
+    };
+
+    //--------------------------------------------------------------------------------
+    //FILE ENTRY: what the directory knows about one archived file
+    //--------------------------------------------------------------------------------
+    struct FileEntry {
+        std::vector<Extent> extents; //block runs, in file order (full payloads only when there's a tail)
+        Tail tail; //last fragment, if packed
+        std::vector<uint8_t> inlineData; //whole file when it's stored in the directory (no extents/tail)
+        size_t fileSize{0}; //size of original file in bytes
+        time_t timeStamp{0}; //time file was added to archive
+        uint64_t sequence{0}; //add order within the archive (0 = added before v8)
+        uint64_t reads{0}; //times extracted (saved with the directory, so a crash can lose the latest)
+
+        size_t blockCount() const {
+            size_t theCount = 0;
+            for (const auto &theExtent : extents) theCount += theExtent.length;
+            return theCount;
+        }
+    };
+
+    //--------------------------------------------------------------------------------
+    //BLOCK HEADER: per-block metadata (decoded form; see BlockGeometry for the on-disk layout)
+    //--------------------------------------------------------------------------------
+    struct BlockHeader {
+        BlockMode mode{BlockMode::free}; //current Block mode (free or in use)
+        BlockType type{BlockType::data}; //0 = data, 1 = meta
+        uint64_t blockNumber{0}; //position in a sequence for multi-block file
+        uint64_t blockCount{0}; //how many blocks the current file uses
+        uint64_t fileSize{0}; //total size of original file in bytes
+        int64_t timeStamp{0}; //stores time file was added to archive
+        std::string filename; //truncated to fit the header, the directory keeps the full name
+    };
+
+    //--------------------------------------------------------------------------------
+    //BLOCK GEOMETRY: how one archive lays out its blocks on disk (recorded in the superblock)
+    //- header (metaSize bytes): [mode][type][6 reserved][u64 blockNumber][u64 blockCount]
+    //                           [u64 fileSize][i64 timeStamp][filename, rest of header]
+    //- payload: the remaining blockSize - metaSize bytes
+    //- v1/v2 archives use the old 96-byte header (8-bit block numbers), see legacyHeaders
+    //--------------------------------------------------------------------------------
+    constexpr size_t kHeaderFixedSize = 40; //header bytes before the filename
+    constexpr size_t kMinMetaSize = 48; //smallest header that still holds a useful filename
+    constexpr size_t kSmallestBlockSize = 1024;
+    constexpr size_t kLargestBlockSize = 1024 * 1024;
+
+    struct BlockGeometry {
+        size_t blockSize{kBlockSize}; //bytes per block
+        size_t metaSize{kMetaSize}; //header bytes per block (0 = header-less)
+        bool legacyHeaders{false}; //v1/v2 header layout
+
+        size_t payloadSize() const { return blockSize - metaSize; }
+        size_t payloadOffset() const; //where the payload starts inside a block
+
+        //(de)serialize a header at the start of a raw block
+        void encodeHeader(const BlockHeader &aHeader, uint8_t *aBlock) const;
+        bool decodeHeader(const uint8_t *aBlock, BlockHeader &aHeader) const;
+
+        //block size is a power of two in [kSmallestBlockSize, kLargestBlockSize], header is 0 or fits its fields
+        bool isValid() const;
+    };
+
+    //compile-time version of BlockGeometry::isValid (fixed-geometry templates)
+    constexpr bool isValidGeometry(size_t aBlockSize, size_t aMetaSize) {
+        return aBlockSize && !(aBlockSize & (aBlockSize - 1)) &&
+               aBlockSize >= kSmallestBlockSize && aBlockSize <= kLargestBlockSize &&
+               (!aMetaSize || (aMetaSize >= kMinMetaSize && aMetaSize < aBlockSize));
+    }
+
+    //both sizes fixed, or both kDynamicSize
+    template<size_t BlockSize, size_t MetaSize>
+    constexpr bool isFixedGeometry() {
+        static_assert((BlockSize == kDynamicSize) == (MetaSize == kDynamicSize),
+                      "block and meta size must both be fixed or both be kDynamicSize");
+        static_assert(BlockSize == kDynamicSize || isValidGeometry(BlockSize, MetaSize),
+                      "fixed geometry needs a power-of-two block size and a 0 or kMinMetaSize.. header");
+        return BlockSize != kDynamicSize;
+    }
 
     //--------------------------------------------------------------------------------
     //You'll need to define your own classes for Blocks, and other useful types...
     //--------------------------------------------------------------------------------
-    struct Block {
+    template<size_t BlockSize = kDynamicSize, size_t MetaSize = kDynamicSize>
+    struct BasicBlock : BlockHeader {
         /*
-        Each block size = 1024 bytes exactly
-        Block header <= 100 bytes
-        Block payload >= 924 bytes 
+        Block size is chosen per archive (kBlockSize by default), or fixed by the template args
+        Block header = metaSize bytes (kMetaSize, or 0 for header-less archives)
+        Block payload = blockSize - metaSize
         Block statuses = In Use, Free (stored in header as meta data)
         NOTE: Must fill unused blocks first before appending new blocks
         */
+        static constexpr bool kFixedGeometry = isFixedGeometry<BlockSize, MetaSize>();
 
-        Block();
-        Block(const Block &aBlock); //copy constructor
-        Block& operator=(const Block &aBlock); //copy assignment
-        ~Block();
+        //fixed geometry = payload lives inline, no allocation per block
+        using Payload = std::conditional_t<kFixedGeometry,
+                                           std::array<uint8_t, kFixedGeometry ? BlockSize - MetaSize : 1>,
+                                           std::vector<uint8_t>>;
+
+        //aPayloadSize is only used by the dynamic-geometry block
+        explicit BasicBlock(size_t aPayloadSize = kPayloadSize) : data() {
+            if constexpr (kFixedGeometry) data.fill(0);
+            else data.assign(aPayloadSize, 0);
+        }
 
         //to create new block
         void initializeBlock(const std::string &filename, 
@@ -142,80 +457,338 @@ namespace ECE141 {
                 blockCount = totalBlocks;
                 this->fileSize = fileSize;
                 timeStamp = timestamp;
-                strncpy(this->filename, filename.c_str(), sizeof(this->filename) - 1);
-                this->filename[sizeof(this->filename) - 1] = '\0'; //nullterm
+                this->filename = filename;
             }
 
-
-        //block header (metadata, should be less than 100 bytes)
-        BlockMode mode; //current Block mode (free or in use)
-        BlockType type; //0 = data, 1 = meta
-        uint8_t blockNumber; //position in a sequence for multi-block file
-        uint8_t blockCount; //how many blocks the current file uses
-
-        //file info (part of header) //Q: Why is name 80? how can we fit file info into header along with above data?
-        char filename[80]; //null-terminated string
-        uint32_t fileSize; //total size of original file in bytes
-        time_t timeStamp; //stores time file was added to archive
-
-        //block data payload (924 bytes)
-        uint8_t data[kPayloadSize]; 
+        //block data payload
+        Payload data;
     };
 
+    using Block = BasicBlock<>;
+
     //--------------------------------------------------------------------------------
     //BLOCK MANAGER: Block status class (to keep track of free/occupied blocks)
+    //- block space is split into allocation groups, each with its own free runs and lock,
+    //  so concurrent writers allocate side by side (each thread starts in its own group)
+    //- growing the archive is the only step that excludes everyone
+    //- fileEntries/tails have their own lock; entry pointers stay valid until that file is removed
+    //- log structured: groups double as log segments; writes go to the log head, which only moves on
+    //  to a clean (all free) segment or the end of the archive
     //--------------------------------------------------------------------------------
+    constexpr size_t kGroupBlocks = 16384; //blocks per allocation group (multiple of 64)
+
     class BlockManager {
     public:
-        BlockManager() = default;
+        explicit BlockManager(size_t aGroupBlocks = kGroupBlocks)
+            : groupBlocks(std::max<size_t>(64, aGroupBlocks / 64 * 64)) {}
+
+        // Reset to an archive of aBlockCount blocks (block 0 reserved for the superblock)
+        //- aGroupBlocks: change the allocation group (log segment) size too, 0 = keep it
+        void reset(size_t aBlockCount, size_t aGroupBlocks = 0);
+
+        // Append aCount free blocks to the end of the archive, returns index of first new block
+        size_t growBlocks(size_t aCount);
+        // Same, but the new blocks are already marked used (nobody else can take them)
+        size_t appendUsedBlocks(size_t aCount);
         
-        // Find free blocks for file storage
-        std::vector<size_t> findFreeBlocks(size_t blockCount);
+        // Find free blocks for file storage (as runs of contiguous blocks), placed per the allocation policy
+        //- may return fewer than blockCount blocks: caller grows the archive for the rest
+        std::vector<Extent> findFreeBlocks(size_t blockCount);
+        // Find and mark aCount blocks in one step (safe with other writers), growing the archive if needed
+        std::vector<Extent> takeBlocks(size_t aCount);
+        void setPolicy(AllocationPolicy aPolicy) { policy = aPolicy; }
+        AllocationPolicy getPolicy() const { return policy; }
+        // First run of aCount contiguous free blocks, or kNoBlock
+        size_t findFreeRun(size_t aCount) const;
+        // First free block at or after aFrom / last used block before aBelow (kNoBlock if none)
+        size_t nextFreeBlock(size_t aFrom) const;
+        size_t lastUsedBlock(size_t aBelow) const;
+        // Mark up to aCount free blocks from aStart used (stops at a used block or group end), returns how many
+        size_t claimBlocks(size_t aStart, size_t aCount);
+        // Drop blocks [aCount, end) if they're all free
+        bool truncateBlocks(size_t aCount);
+        // Number of free blocks
+        size_t countFreeBlocks() const;
+        bool isFree(size_t anIndex) const;
+        // The whole free run around anIndex (length 0 if anIndex is in use)
+        Extent freeRunAround(size_t anIndex) const;
+        size_t getGroupCount() const;
+        size_t getGroupBlocks() const { return groupBlocks; }
+        // Free blocks per group (= per log segment)
+        std::vector<size_t> groupFreeCounts() const;
+        // Group the log head is in (kNoBlock = head is at the end of the archive)
+        size_t logSegment() const;
         
         // Mark blocks as used or free
-        ArchiveStatus<bool> markBlocksAsUsed(const std::vector<size_t>& blocks);
-        ArchiveStatus<bool> markBlocksAsFree(const std::vector<size_t>& blocks);
+        ArchiveStatus<bool> markBlocksAsUsed(const std::vector<Extent>& extents);
+        ArchiveStatus<bool> markBlocksAsFree(const std::vector<Extent>& extents);
         
         // Track file locations
-        ArchiveStatus<bool> addFileEntry(const std::string& filename, const std::vector<size_t>& blocks);
-        ArchiveStatus<bool> removeFileEntry(const std::string& filename);
-        ArchiveStatus<std::vector<size_t>> findFileEntry(const std::string& filename);
+        ArchiveStatus<bool> addFileEntry(const std::string& filename, const FileEntry& anEntry);
+        // aFreed: leave the file's blocks marked used and list them there (caller frees them later)
+        ArchiveStatus<bool> removeFileEntry(const std::string& filename, std::vector<Extent> *aFreed = nullptr);
+        // Point a file at moved copies of its blocks (caller claimed the new ones and frees the old)
+        ArchiveStatus<bool> replaceExtents(const std::string& filename, const std::vector<Extent>& anExtents);
+        // Same for a tail block: every file with a fragment in aFrom now points at aTo, returns their names
+        std::vector<std::string> moveTailBlock(size_t aFrom, size_t aTo);
+        ArchiveStatus<const FileEntry*> findFileEntry(const std::string& filename) const; //no copy of extents
+        ArchiveStatus<FileEntry> copyFileEntry(const std::string& filename) const; //stays valid if it's removed
+        // Count an extract of filename (for CompactOrder::heat)
+        void noteRead(const std::string& filename);
+        // Add order for the next new file (continues after the highest one loaded)
+        uint64_t nextSequence();
         
-        // Get all file entries for listing
-        std::map<std::string, std::vector<size_t>> getAllFileEntries() const;
-        // return total block count
-        size_t getTotalBlocks() const {
-            return blockStatus.size();
+        // Pick room for a aLength byte tail (in the open tail block, or a new one marked in use)
+        // (the block stays taken until settleTail, even if every stored fragment in it goes meanwhile)
+        Tail placeTail(size_t aLength, size_t aCapacity);
+        // The add that placed aTail is done (stored or given up): true = nothing else is in the block,
+        // so the caller frees it (it's still marked used)
+        bool settleTail(const Tail &aTail);
+        // true while some file still has a fragment in anIndex
+        bool isTailBlock(size_t anIndex) const;
+        // Bytes of anIndex's payload handed out to fragments so far
+        size_t tailBytes(size_t anIndex) const;
+
+        // Get all file entries for listing (not while other threads add/remove, see eachFileEntry)
+        const std::map<std::string, FileEntry>& getAllFileEntries() const;
+        // Visit every entry under the entry lock
+        template<typename Visitor>
+        void eachFileEntry(Visitor aVisitor) const {
+            std::lock_guard<std::mutex> theLock(entryLock);
+            for (const auto &theEntry : fileEntries) aVisitor(theEntry.first, theEntry.second);
         }
+        // return total block count
+        size_t getTotalBlocks() const;
+
+        // Bitmap persisted with the directory (restore ORs it in, so entries/bitmap can't disagree)
+        //- copies the bitmap into aBits and returns the block count it covers (one consistent snapshot)
+        size_t getBitmap(std::vector<uint64_t> &aBits) const;
+        bool restoreBitmap(const std::vector<uint64_t> &aBits);
         
     private:
-        //true = used, false = free
-        std::vector<BlockMode> blockStatus; // Track free/used blocks
-        std::map<std::string, std::vector<size_t>> fileEntries; // filename -> (startBlock, blockCount)
+        //ALLOCATION GROUP: blocks [index * groupBlocks, +groupBlocks) and their free runs
+        //- groups own whole bitmap words, so groups never write the same word
+        struct AllocationGroup {
+            mutable std::mutex lock;
+            std::map<size_t, size_t> runsByStart; //free run start -> length
+            std::set<std::pair<size_t, size_t>> runsBySize; //(length, start), for best fit
+            size_t freeCount{0};
+        };
+
+        //caller holds growLock (shared or exclusive)
+        size_t groupIndex(size_t aBlock) const { return aBlock / groupBlocks; }
+        size_t groupEnd(size_t anIndex) const { return std::min(blockTotal, (anIndex + 1) * groupBlocks); }
+        size_t homeGroup() const; //this thread's first choice
+        void markRange(size_t aStart, size_t aCount, bool isUsed, bool isExclusive = false);
+        std::vector<Extent> searchBlocks(size_t aCount, bool isTaking);
+        //one free span of at least aCount blocks, which may cross group edges (kNoBlock = none):
+        //smallest for bestFit, lowest for contiguousFirst (groups are locked one at a time)
+        size_t findSpan(size_t aCount) const;
+        //take [aStart, aStart + aCount) if it's still all free (locks its groups in order)
+        bool takeSpan(size_t aStart, size_t aCount);
+        size_t growLocked(size_t aCount);
+        //caller holds logLock too
+        std::vector<Extent> logBlocks(size_t aCount, bool isTaking);
+        size_t nextCleanGroup(size_t anIndex) const;
+
+        //caller holds the group's lock (or growLock exclusively)
+        void setGroupRange(AllocationGroup &aGroup, size_t aStart, size_t aCount, bool isUsed);
+        void addFreeRun(AllocationGroup &aGroup, size_t aStart, size_t aLength);
+        void removeFreeRun(AllocationGroup &aGroup, std::map<size_t, size_t>::iterator aRun);
+        void rebuildFreeRuns(size_t anIndex);
+        //placement strategies behind findFreeBlocks, within one group
+        void firstFit(size_t anIndex, size_t aCount, std::vector<Extent> &aResult) const;
+        void largestRuns(const AllocationGroup &aGroup, size_t aCount, std::vector<Extent> &aResult) const;
+        //first word in [aWord, anEnd) with a free bit (skips full words, 64 blocks per compare)
+        size_t skipUsedWords(size_t aWord, size_t anEnd) const;
+        bool isFreeBit(size_t anIndex) const { return !(usedBits[anIndex / 64] >> (anIndex % 64) & 1); }
+
+        //packed bitmap: bit set = block in use; bits past blockTotal stay set so scans never return them
+        std::vector<uint64_t> usedBits;
+        size_t blockTotal{0};
+        size_t groupBlocks;
+        std::deque<AllocationGroup> groups;
+        mutable std::shared_mutex growLock; //exclusive: grow/reset/restore; shared: everything else on blocks
+        AllocationPolicy policy{AllocationPolicy::firstFit};
+        mutable std::mutex logLock; //log head (taken before growLock)
+        size_t logHead{kNoBlock}; //next block the log writes (kNoBlock = the end of the archive)
+
+        mutable std::mutex entryLock; //fileEntries + tail state (taken before growLock, never after)
+        std::map<std::string, FileEntry> fileEntries; // filename -> (extents, size, timestamp)
+
+        //per tail block: bytes handed out (fragments are appended) and bytes still referenced
+        struct TailUsage {
+            size_t end{0};
+            size_t live{0};
+            size_t placing{0}; //fragments handed out whose file isn't stored yet
+        };
+        std::map<size_t, TailUsage> tailBlocks;
+        size_t openTail{0}; //tail block new fragments go to (0 = none yet)
+        uint64_t lastSequence{0}; //highest FileEntry::sequence handed out or loaded
+    };
+
+    //--------------------------------------------------------------------------------
+    //BLOCK REFS: how many snapshots use each block, run-length encoded (one run per shared extent, not per block)
+    //- the live archive's own use is the BlockManager bitmap; a block is only free when neither holds it
+    //- held: the live archive let go of the block, so it's free as soon as the last snapshot does too
+    //- not thread safe (the archive's snapshotLock guards it)
+    //--------------------------------------------------------------------------------
+    class BlockRefs {
+    public:
+        void clear() { runs.clear(); }
+        // One more snapshot uses anExtents
+        void addRefs(const std::vector<Extent> &anExtents);
+        // One snapshot fewer: returns the held blocks no snapshot uses any more (free them)
+        std::vector<Extent> dropRefs(const std::vector<Extent> &anExtents);
+        // The live archive lets go of anExtents: returns the part no snapshot uses (free it), holds the rest
+        std::vector<Extent> release(const std::vector<Extent> &anExtents);
+        // After a load: everything is held except what the live archive still uses (aLive)
+        void holdAllBut(const std::vector<Extent> &aLive);
+        bool isShared(size_t aBlock) const;
+        std::vector<Extent> extents() const; //every block some snapshot uses
+        size_t runCount() const { return runs.size(); }
+
+    protected:
+        struct Run {
+            size_t length{0};
+            uint32_t count{0};
+            bool isHeld{false};
+        };
+        std::map<size_t, Run> runs; //start -> run; runs don't overlap, count is never 0
+
+        void split(size_t aBlock); //make aBlock a run boundary
+        void merge(size_t aFrom, size_t aTo); //re-join equal neighbours around [aFrom, aTo)
+    };
+
+
+    //--------------------------------------------------------------------------------
+    //JOURNAL: write-ahead log of directory changes, next to the archive (<name>.arc.journal)
+    //- add/remove append one record each instead of rewriting the whole directory
+    //- group commit: the first committer syncs the archive data, then every pending record,
+    //  while later committers wait for that batch (one pair of fsyncs per batch, not per file)
+    //- a checkpoint (full directory save) empties it; openArchive replays whatever is left
+    //- records are [u32 length][u32 checksum][payload]; replay stops at the first torn one
+    //--------------------------------------------------------------------------------
+    constexpr size_t kJournalCheckpointBytes = 4 * 1024 * 1024; //checkpoint once the journal gets this big
+    enum class JournalRecord : uint8_t {added = 1, removed = 2};
+
+    class Journal {
+    public:
+        using SyncData = std::function<bool()>; //makes the blocks records point at durable first
+
+        Journal() = default;
+        Journal(const Journal&) = delete;
+        Journal& operator=(const Journal&) = delete;
+        ~Journal() { close(false); }
+
+        bool open(const std::string &aPath); //creates it if missing (false where there's no fsync)
+        void close(bool isRemoving); //isRemoving = delete the file (clean shutdown)
+        bool isOpen() const { return file >= 0; }
+
+        // Records on disk, oldest first (only the intact prefix)
+        bool readRecords(std::vector<std::vector<uint8_t>> &aRecords) const;
+        // Queue a record, returns its sequence number (caller orders appends)
+        uint64_t append(const std::vector<uint8_t> &aPayload);
+        // Wait until record aSequence is written (and synced, with isSyncing), writing a batch if nobody else is
+        bool commit(uint64_t aSequence, const SyncData &aSyncData, bool isSyncing = true);
+        // fsync what's been written so far
+        bool sync();
+        // Drop every record (they're all in a checkpointed directory now)
+        bool reset(bool isSyncing = true);
+        // Bytes logged since the last reset / queued but not written yet
+        size_t size() const;
+        size_t pendingBytes() const;
+        uint64_t lastSequence() const;
+
+        // fsync the file at aPath (used for the archive itself)
+        static bool syncPath(const std::string &aPath);
+
+    private:
+        int file{-1};
+        std::string path;
+        mutable std::mutex lock;
+        std::condition_variable batchDone;
+        std::vector<uint8_t> pending; //framed records not written yet
+        uint64_t appended{0}; //last sequence handed out
+        uint64_t durable{0}; //last sequence written (synced too, unless committed without isSyncing)
+        bool isWriting{false}; //a committer is writing a batch
+        bool isBroken{false}; //a batch failed: later commits fail too
+        size_t bytes{0};
     };
 
+    //--------------------------------------------------------------------------------
+    //BLOCK DEVICE: one archive file, read and written at absolute offsets (pread/pwrite)
+    //- no seek position is shared, so threads reading/writing different ranges never wait on each other
+    //- readPieces scatters one range over several buffers with a single call (preadv)
+    //- without POSIX I/O it falls back to an fstream whose cursor is guarded by a mutex
+    //--------------------------------------------------------------------------------
+    struct IOPiece {
+        uint8_t *data{nullptr};
+        size_t length{0};
+    };
+
+    class BlockDevice {
+    public:
+        BlockDevice() = default;
+        BlockDevice(const BlockDevice&) = delete;
+        BlockDevice& operator=(const BlockDevice&) = delete;
+        ~BlockDevice() { close(); }
+
+        bool open(const std::string &aPath, bool isNew = false); //isNew: create it, or empty an old one
+        void close();
+        bool isOpen() const;
+
+        // Exactly aLength bytes at anOffset (a short read/write fails)
+        bool readAt(uint8_t *aBuffer, size_t anOffset, size_t aLength) const;
+        bool writeAt(const uint8_t *aBuffer, size_t anOffset, size_t aLength);
+        // aPieces filled back to back from anOffset
+        bool readPieces(std::vector<IOPiece> aPieces, size_t anOffset) const;
+
+        size_t size() const;
+        bool resize(size_t aSize);
+        bool sync(); //data to disk (fdatasync)
+        // Give back / reserve disk space for [anOffset, anOffset + aLength) without changing the size
+        // (Linux fallocate; reserve also uses posix_fallocate elsewhere, which can grow the file)
+        bool punch(size_t anOffset, size_t aLength);
+        bool reserve(size_t anOffset, size_t aLength);
+
+    private:
+        int file{-1};
+        std::string path;
+        mutable std::mutex lock; //fallback only: guards stream's cursor
+        mutable std::fstream stream; //fallback only
+    };
 
     //BLOCK VISITOR: function to visit each block
-    using BlockVisitor = std::function<bool(Block &aBlock, size_t aPos)>;
+    template<size_t BlockSize = kDynamicSize, size_t MetaSize = kDynamicSize>
+    using BasicBlockVisitor = std::function<bool(BasicBlock<BlockSize, MetaSize> &aBlock, size_t aPos)>;
+    using BlockVisitor = BasicBlockVisitor<>;
     
     //--------------------------------------------------------------------------------
     //CHUNKER: class to chunk file into blocks
     //--------------------------------------------------------------------------------
-    class Chunker {
+    template<size_t BlockSize = kDynamicSize, size_t MetaSize = kDynamicSize>
+    class BasicChunker {
 
     protected:
     //& so we can take ptr to existing stream, not copy
         std::fstream &stream;
         size_t streamSize;
+        size_t payloadSize;
 
     public:
-        Chunker(std::fstream &aStream) : stream(aStream) {
+        using Block = BasicBlock<BlockSize, MetaSize>;
+
+        //aPayloadSize is ignored when the geometry is fixed
+        BasicChunker(std::fstream &aStream, size_t aPayloadSize = kPayloadSize)
+            : stream(aStream), payloadSize(aPayloadSize) {
+            if constexpr (Block::kFixedGeometry) payloadSize = BlockSize - MetaSize;
             stream.seekg(0, std::ios::end);
             streamSize = stream.tellg();
             stream.seekg(0, std::ios::beg);
         }
         
-        bool each(BlockVisitor aVisitor) {
+        bool each(BasicBlockVisitor<BlockSize, MetaSize> aVisitor) {
             // Process file in block-sized chunks
             size_t theLen = streamSize;
             size_t theDelta = 0;
@@ -223,10 +796,10 @@ namespace ECE141 {
             bool theResult = true;
             
             while (theLen && theResult) {
-                Block theBlock;
-                //process file data in at most 924 byte chunks
-                theLen -= theDelta = std::min(size_t(924), theLen);
-                stream.read(reinterpret_cast<char*>(theBlock.data), theDelta);
+                Block theBlock(payloadSize);
+                //process file data in at most payloadSize byte chunks
+                theLen -= theDelta = std::min(payloadSize, theLen);
+                stream.read(reinterpret_cast<char*>(theBlock.data.data()), theDelta);
 
                 //callback the visitor! to do whatever to each block, i.e. extract
                 theResult = aVisitor(theBlock, thePos++);
@@ -236,33 +809,253 @@ namespace ECE141 {
             //if we stopped early, returns false
             return theResult;
         }
-
-        ~Chunker(); //not needed!
     };
 
+    using Chunker = BasicChunker<>;
+
     //What other classes/types do we need?
     //example code professor gave for Chunk class
     using VisitChunk = std::function<bool(Block &aBlock, size_t aPos)>;
 
 
-    class Archive {
+    //--------------------------------------------------------------------------------
+    //BASIC ARCHIVE: archive over one block geometry
+    //- BasicArchive<4096, 64> etc. bake the sizes in (payload copies/offsets are constants),
+    //  and only open archives created with that geometry
+    //- Archive = BasicArchive<kDynamicSize, kDynamicSize> reads the geometry from the superblock
+    //- instantiations live in Archive.cpp (see the extern templates below)
+    //--------------------------------------------------------------------------------
+    template<size_t BlockSize = kDynamicSize, size_t MetaSize = kDynamicSize>
+    class BasicArchive {
+    public:
+        using Block = BasicBlock<BlockSize, MetaSize>;
+        static constexpr bool kFixedGeometry = isFixedGeometry<BlockSize, MetaSize>();
+
     protected:
+        //device I/O is positional, so block reads/writes only take ioLock shared and run side by side;
+        //directory saves, punching and reserving take it exclusive (nothing may write meanwhile)
+        std::shared_mutex ioLock;
+
+        //VOLUMES: stripe s of the block space (stripeBlocks blocks) lives in volume s % count, packed in
+        //stripe order; volume 0 is the .arc itself (device + ioLock, holds block 0), the rest are below
+        //- block I/O takes the volume it touches shared
+        //- whole-archive steps (directory save, sync, punch, compact) lock every volume, ioLock first
+        struct Volume {
+            std::string path;
+            BlockDevice device;
+            std::shared_mutex lock;
+        };
+        std::deque<Volume> volumes; //volumes 1.. (empty = single-file archive)
+        size_t stripeBlocks{kStripeBlocks};
+
+        size_t volumeCount() const { return volumes.size() + 1; }
+        BlockDevice &volumeDevice(size_t aVolume) { return aVolume ? volumes[aVolume - 1].device : device; }
+        std::shared_mutex &volumeLock(size_t aVolume) { return aVolume ? volumes[aVolume - 1].lock : ioLock; }
+        const std::string &volumePath(size_t aVolume) const { return aVolume ? volumes[aVolume - 1].path : aPath; }
+        //calls aStep(volume, volume offset, length, position in range) for each stripe piece of a byte range
+        template<typename Step>
+        bool eachStripe(size_t anOffset, size_t aLength, Step aStep) const;
+        //bytes of the archive's first anEnd bytes that live in aVolume (= that volume's file size)
+        size_t volumeBytes(size_t aVolume, size_t anEnd) const;
+        //read or write aLength bytes at an archive byte offset (isLocked: caller holds every volume lock)
+        bool readAt(uint8_t *aBuffer, size_t anOffset, size_t aLength, bool isLocked = false);
+        bool writeAt(const uint8_t *aBuffer, size_t anOffset, size_t aLength, bool isLocked = false);
+        //payloads of blocks [aStart, aStart + aCount) back to back into aBuffer, headers skipped
+        //(one scattered read per volume piece)
+        bool readPayloads(uint8_t *aBuffer, size_t aStart, size_t aCount);
+        std::vector<std::unique_lock<std::shared_mutex>> lockVolumes();
+        bool openVolumes(const std::vector<std::string> &aPaths, bool isNew);
+        bool syncVolumes(); //fdatasync every volume file
+        size_t storedBytes() const; //sum of the volume files' sizes
+
+        //MAPPED READS: extract writes payloads straight from read-only mappings of the volume files
+        //- mapLock is held shared while mapped pages are used; remapping (the archive grew past the
+        //  mapping) and unmapping (a volume is about to shrink: pages past its end would fault) take it
+        //  exclusive, after any volume locks
+        struct Mapping {
+            const uint8_t *data{nullptr};
+            size_t length{0};
+        };
+        std::vector<Mapping> mappings; //one per volume (empty = nothing mapped)
+        std::shared_mutex mapLock;
+        std::atomic<bool> isMemoryMapped{false};
+        //shared lock on mappings covering archive bytes [0, anEnd), remapped if needed (not owned: use readAt)
+        std::shared_lock<std::shared_mutex> lockMapping(size_t anEnd);
+        const uint8_t *mappedAt(size_t aVolume, size_t anOffset) const { return mappings[aVolume].data + anOffset; }
+        void remapLocked();
+        void unmapLocked(); //(caller holds mapLock exclusive)
+
         //read and write to block
         bool readBlock(Block& aBlock, size_t anIndex);
         bool writeBlock(Block& aBlock, size_t anIndex);
+        //read and write a run of aCount contiguous raw blocks with one I/O (headers encoded by caller)
+        bool readRaw(uint8_t* aBuffer, size_t aStart, size_t aCount);
+        bool writeRaw(const uint8_t* aBuffer, size_t aStart, size_t aCount);
+        //read and write aLength bytes at a byte offset (tail fragments)
+        bool readBytes(uint8_t* aBuffer, size_t anOffset, size_t aLength);
+        bool writeBytes(const uint8_t* aBuffer, size_t anOffset, size_t aLength);
+        size_t tailOffset(const Tail &aTail) const { return aTail.block * blockSize() + payloadOffset() + aTail.offset; }
+        bool writeTail(std::istream &aSource, const Tail &aTail);
+
+        //copy a whole file between a stream and its extents (handles both block layouts)
+        bool writeFileBlocks(std::istream &aSource, const std::string &aName,
+                             const std::vector<Extent> &anExtents, size_t aFileSize, time_t aTime);
+        bool readFileBlocks(const FileEntry &anEntry, std::ostream &anOutput);
+
+        //persist/restore superblock + directory (see SuperBlock)
+        //aTrimTo: also drop the free blocks past that point (as far as the live directory allows)
+        ArchiveStatus<bool> saveDirectory(size_t aTrimTo = 0);
+        ArchiveStatus<bool> loadDirectory();
+        //upgrade a baseline archive (no superblock, headers from block 0) in place; badArchive if it isn't one
+        ArchiveStatus<bool> adoptBaseline();
+
+        //RECOVERY: rebuild blockManager from block headers (directory missing/corrupt)
+        //- splits blocks [1, aBlockCount) into ranges scanned in parallel (positional reads of one device)
+        //- returns number of files recovered (single-volume archives only: badMode otherwise)
+        ArchiveStatus<size_t> rebuildDirectory(size_t aBlockCount, size_t aThreadCount);
+        bool markBlockFree(size_t anIndex); //clears mode in the on-disk header
+        //JOURNAL (kJournalFlag): log a change, make it durable, fold everything into the directory
+        //- callers append under journalLock, together with the change itself, so records replay in order
+        bool openJournal(bool isFresh);
+        uint64_t logChange(JournalRecord aType, const std::string &aName, const FileEntry *anEntry);
+        ArchiveStatus<bool> commitChange(uint64_t aSequence, bool isSyncing);
+        //after a change is in the directory: make it as durable as the policy asks (aSequence 0 = not journaled)
+        ArchiveStatus<bool> settleChange(uint64_t aSequence);
+        bool isSyncOn() const { return durability.mode != Durability::none; }
+        //periodic durability: background flusher thread
+        void startFlusher();
+        void stopFlusher();
+        //background compaction thread (CompactorPolicy)
+        void startCompactor();
+        void stopCompactor();
+        bool needsCompaction() const;
+        bool pauseCompactor(std::chrono::microseconds aWait); //throttle + yield; false once stopping
+
+        //counts add/extract calls in flight while in scope (the compactor backs off meanwhile)
+        struct ForegroundCall {
+            explicit ForegroundCall(std::atomic<size_t> &aCount) : count(aCount) { count++; }
+            ~ForegroundCall() { count--; }
+            std::atomic<size_t> &count;
+        };
+        //parks the background compactor for a whole-archive rewrite (restarted on the way out if it ran)
+        struct CompactorPause {
+            explicit CompactorPause(BasicArchive &anArchive) : archive(anArchive), wasRunning(anArchive.compactor.joinable()) {
+                archive.stopCompactor();
+            }
+            ~CompactorPause() { if (wasRunning) archive.startCompactor(); }
+            BasicArchive &archive;
+            bool wasRunning;
+        };
+        ArchiveStatus<bool> checkpoint(size_t aMinBytes = 0, size_t aTrimTo = 0); //only if the journal holds aMinBytes+
+        //add anEntry to the directory and make it durable (journaled, or a directory save)
+        ArchiveStatus<bool> storeEntry(const std::string &aName, const FileEntry &anEntry);
+        bool replayJournal(); //re-applies leftover records after a crash
+
+        //IN-PLACE COMPACTION: move the top blocks of one file (or one tail block) down into aHole
+        //- returns blocks moved; 0 = skip this block (not a file's, or it changed under us)
+        ArchiveStatus<size_t> relocateExtent(const std::string &aName, size_t aLast, size_t aHole, size_t aBudget,
+                                             std::vector<uint8_t> &aBuffer, std::map<size_t, std::string> &anOwners);
+        ArchiveStatus<size_t> relocateTail(size_t aLast, size_t aHole); //caller claimed aHole (freed if not used)
+        //SNAPSHOTS: blocks some snapshot still uses stay allocated (see BlockRefs; guarded by snapshotLock)
+        bool isSnapshotBlock(size_t aBlock) const;
+        void rebuildSnapshotRefs(); //after (re)loading the directory or replaying the journal
+        size_t writeListing(const std::map<std::string, FileEntry> &anEntries, std::ostream &aStream);
+
+        //make a relocation durable: log (or save) the moved files, then free the blocks they left
+        ArchiveStatus<bool> settleRelocation(uint64_t aSequence, const std::vector<Extent> &anOld);
+        //aCount contiguous blocks for a defragmented file: a free run if there is one, else new ones at the end
+        size_t claimRun(size_t aCount);
+        //copy a whole file (as it was in anEntry) to new blocks and repoint it, returns blocks moved
+        //(0 = it changed meanwhile); new blocks come from claimRun, or the log head when log structured
+        ArchiveStatus<size_t> moveFile(const std::string &aFilename, const FileEntry &anEntry);
+        //cut free blocks off the end of the archive (compactInPlace, cleanSegments)
+        ArchiveStatus<bool> trimFreeEnd();
+        //after blocks moved off anExtents: clear their headers (or punch them) and free them
+        void releaseBlocks(std::vector<Extent> anExtents);
+
+        //give the disk space of free runs back to the filesystem (kHolePunchFlag)
+        //- punches the whole free run around each extent, so neighbours freed earlier go too
+        //- block indices don't move: a punched block reads back as zeros (= free header) until reused
+        bool punchHoles(const std::vector<Extent> &anExtents);
+        //make sure disk space is reserved through byte anEnd (and further ahead per growth, if isAhead)
+        //- best effort: if the filesystem can't, writes just allocate as they go
+        void reserveSpace(size_t anEnd, bool isAhead = true);
 
         //notify archive observers
         void notifyObservers(ActionType anAction, const std::string &aName, bool status);
 
         //UTILITY
+        static std::string makeArchivePath(const std::string &anArchiveName); //adds .arc extension if missing
         std::string extractFilename(const std::string &aFullPath) const; //extracts filename from path
         size_t calculateRequiredBlocks(size_t fileSize) const; //finds num blocks needed for file
 
+        //GEOMETRY: constants for fixed instantiations, superblock values otherwise
+        size_t blockSize() const {
+            if constexpr (kFixedGeometry) return BlockSize;
+            else return geometry.blockSize;
+        }
+        size_t metaSize() const {
+            if constexpr (kFixedGeometry) return MetaSize;
+            else return geometry.metaSize;
+        }
+        size_t payloadSize() const { return blockSize() - metaSize(); } //file bytes per block
+        size_t payloadOffset() const {
+            if constexpr (kFixedGeometry) return MetaSize;
+            else return geometry.payloadOffset();
+        }
+        static BlockGeometry defaultGeometry() {
+            BlockGeometry theGeometry;
+            if constexpr (kFixedGeometry) {
+                theGeometry.blockSize = BlockSize;
+                theGeometry.metaSize = MetaSize;
+            }
+            return theGeometry;
+        }
+        //geometry loaded from a superblock is valid and (for fixed instantiations) the one we were built for
+        bool hasUsableGeometry() const {
+            if constexpr (kFixedGeometry) {
+                if (geometry.blockSize != BlockSize || geometry.metaSize != MetaSize || geometry.legacyHeaders) {
+                    return false;
+                }
+            }
+            return geometry.isValid();
+        }
+
+        //one raw block: on the stack when the size is known at compile time
+        using RawBlock = std::conditional_t<kFixedGeometry,
+                                            std::array<uint8_t, kFixedGeometry ? BlockSize : 1>,
+                                            std::vector<uint8_t>>;
+
         //data members
-        std::fstream stream; //file stream
+        BlockDevice device; //the .arc file (volume 0)
         std::string aPath; //file path
         AccessMode mode; //mode to tell whether it's existing or new archive
+        uint32_t formatVersion{kFormatVersion}; //on-disk format (older archives keep their block headers)
+        uint32_t flags{0}; //SuperBlock::flags
+        BlockGeometry geometry{defaultGeometry()}; //block size + header layout
         BlockManager blockManager; //block manager to keep track of free/occupied blocks
+        GrowthPolicy growth; //preallocation ahead of the data (guarded by ioLock)
+        size_t reservedEnd{0}; //bytes of the file known to be reserved (guarded by ioLock)
+        Journal journal; //write-ahead log (open only with kJournalFlag)
+        std::mutex journalLock; //orders directory changes with their journal records
+        Extent directoryBlocks; //blocks holding a trailing directory while journaling (kept from new data)
+        Extent savedDirectory; //blocks the directory on disk covers (empty when it's inline; guarded by ioLock)
+        std::shared_mutex relocationLock; //exclusive: compaction repointing files; shared: readers of block lists
+        std::map<std::string, std::map<std::string, FileEntry>> snapshots; //name -> frozen directory
+        BlockRefs snapshotRefs;
+        mutable std::shared_mutex snapshotLock; //snapshots + snapshotRefs (taken after every other lock)
+        DurabilityPolicy durability;
+        std::thread flusher; //runs only with Durability::periodic
+        std::mutex flushLock;
+        std::condition_variable flushWake;
+        bool isStopping{false}; //guarded by flushLock
+        std::atomic<bool> hasChanges{false}; //something for the flusher to do
+        CompactorPolicy compaction;
+        std::thread compactor; //runs only with compaction.enabled
+        std::mutex compactLock;
+        std::condition_variable compactWake;
+        bool isCompactorStopping{false}; //guarded by compactLock
+        std::atomic<size_t> foregroundCalls{0};
 
         //to integrate later (during final?)
         std::vector<std::shared_ptr<IDataProcessor>> processors;
@@ -270,15 +1063,34 @@ namespace ECE141 {
 
     public:
     
-        Archive(const std::string &aFullPath, AccessMode aMode);
-        ~Archive();  
+        BasicArchive(const std::string &aFullPath, AccessMode aMode);
+        ~BasicArchive();  
         
         //static factory methods to create/open archive
-        static    ArchiveStatus<std::shared_ptr<Archive>> createArchive(const std::string &anArchiveName);
-        static    ArchiveStatus<std::shared_ptr<Archive>> openArchive(const std::string &anArchiveName);
+        static    ArchiveStatus<std::shared_ptr<BasicArchive>> createArchive(const std::string &anArchiveName,
+                                                                               const ArchiveOptions &anOptions = ArchiveOptions());
+        //(a damaged directory fails with badData and the file is left as it was: see recoverArchive;
+        // a baseline archive from before the superblock is upgraded to v2 in place)
+        static    ArchiveStatus<std::shared_ptr<BasicArchive>> openArchive(const std::string &anArchiveName);
+        //rebuilds the directory by scanning block headers (aThreadCount 0 = hardware concurrency)
+        static    ArchiveStatus<std::shared_ptr<BasicArchive>> recoverArchive(const std::string &anArchiveName,
+                                                                                size_t aThreadCount = 0);
+
+        //change how later adds place their blocks (persisted with the archive)
+        ArchiveStatus<bool> setAllocationPolicy(AllocationPolicy aPolicy);
+        //change how far ahead disk space is reserved (this session only)
+        void setGrowthPolicy(const GrowthPolicy &aPolicy);
+        //change when changes are forced to disk (this session only; not while other threads use the archive)
+        void setDurability(const DurabilityPolicy &aPolicy);
+        //start/stop/retune the background compactor (this session only; not while other threads use the archive)
+        void setCompactor(const CompactorPolicy &aPolicy);
+        //serve extracts from memory-mapped volume files instead of block reads (this session only)
+        void setMemoryMapped(bool isOn);
+        //force every change so far to disk, whatever the durability policy
+        ArchiveStatus<bool> flush();
 
         //adds an observer to vector list (returns Archive& for chaining to same arc)
-        Archive&  addObserver(std::shared_ptr<ArchiveObserver> anObserver);
+        BasicArchive&  addObserver(std::shared_ptr<ArchiveObserver> anObserver);
 
         /*CORE METHODS For Interface*/
         ArchiveStatus<bool>      add(const std::string &aFilename); //Add a file
@@ -287,11 +1099,46 @@ namespace ECE141 {
         ArchiveStatus<size_t>    list(std::ostream &aStream); //List files
         ArchiveStatus<size_t>    debugDump(std::ostream &aStream); //dumps architecture of block storage for debugging
 
-        //returns new # blocks in compacted archive
-        ArchiveStatus<size_t>    compact(); //compacts archive
+        //returns new # blocks in compacted archive (files laid out in anOrder; aGroupKey for CompactOrder::group)
+        //- the background compactor is paused and extracts wait for the whole rewrite (not while other threads add/remove)
+        //- buffers every live block in memory first (compactInPlace below keeps memory bounded)
+        ArchiveStatus<size_t>    compact(CompactOrder anOrder = CompactOrder::name,
+                                         const CompactGroupKey &aGroupKey = nullptr); //compacts archive
+        //compacts while the archive stays usable: moves top blocks into holes, aMemoryBudget bytes at a time,
+        //then trims the free end (returns blocks in archive; call again to resume after a pause)
+        ArchiveStatus<size_t>    compactInPlace(size_t aMemoryBudget = kCompactBudget,
+                                                const CompactCallback &aCallback = nullptr);
+
+        //how scattered one file's blocks are
+        ArchiveStatus<FragmentReport> fragmentation(const std::string &aFilename);
+        //rewrites one file into a single run of free blocks (the switch is atomic; the file stays readable)
+        ArchiveStatus<bool>      defragment(const std::string &aFilename);
+        //log structured archives: empties segments at least aMinFree free by moving their files to the log
+        //head (emptiest first, so the cheapest space comes back first), then trims the free end
+        //(returns segments emptied; badMode under the other policies, whose holes get reused anyway)
+        ArchiveStatus<size_t>    cleanSegments(double aMinFree = 0.25, const CompactCallback &aCallback = nullptr);
+
+        //SNAPSHOTS: read-only views of the archive as it was, sharing its blocks (taking one is O(directory))
+        //- while a snapshot uses a block, removing/moving the live file leaves the block where it is
+        //- saved with the directory (v9+ archives); compact() needs them dropped first, compactInPlace skips their blocks
+        //- NOTE: recoverArchive can't tell held blocks from live ones, so removed files they hold come back
+        ArchiveStatus<bool>      snapshot(const std::string &aName);
+        ArchiveStatus<bool>      dropSnapshot(const std::string &aName);
+        ArchiveStatus<size_t>    listSnapshots(std::ostream &aStream); //snapshot names
+        ArchiveStatus<size_t>    listSnapshot(const std::string &aName, std::ostream &aStream); //files, like list
+        ArchiveStatus<bool>      extractSnapshot(const std::string &aName, const std::string &aFilename,
+                                                 const std::string &aFullPath);
 
         //UTILITY (get a file path)
         ArchiveStatus<std::string> getFullPath() const; //get archive path (including .arc extension)
     };
+
+    //geometries built into Archive.cpp (add a matching "template class" line there for others)
+    extern template class BasicArchive<kDynamicSize, kDynamicSize>;
+    extern template class BasicArchive<kBlockSize, kMetaSize>;
+    extern template class BasicArchive<4096, 64>;
+    extern template class BasicArchive<4096, 0>;
+
+    using Archive = BasicArchive<>; //geometry chosen per archive at createArchive time
 }
 #endif /* Archive_hpp */
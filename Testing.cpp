@@ -1,5 +1,34 @@
 #include <gtest/gtest.h>
 #include "Archive.hpp"
+#include <thread>
+#include <atomic>
+#include <cstddef>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#if defined(__linux__)
+#include <sys/stat.h>
+#endif
+
+namespace fs = std::filesystem;
+
+// Write aSize bytes of repeating text to a scratch file, returns its path
+static std::string makeTestFile(const std::string &aName, size_t aSize) {
+    std::string thePath = (fs::temp_directory_path() / aName).string();
+    std::ofstream theFile(thePath, std::ios::binary | std::ios::trunc);
+    for (size_t i = 0; i < aSize; i++) {
+        theFile.put(static_cast<char>('a' + i % 26));
+    }
+    return thePath;
+}
+
+static std::string readFile(const std::string &aPath) {
+    std::ifstream theFile(aPath, std::ios::binary);
+    std::stringstream theBuffer;
+    theBuffer << theFile.rdbuf();
+    return theBuffer.str();
+}
 
 // Simple test case for Archive
 TEST(ArchiveTest, CanCreateArchive) {
@@ -7,6 +36,1092 @@ TEST(ArchiveTest, CanCreateArchive) {
     EXPECT_TRUE(archive.isOK());  // Check if archive creation succeeds
 }
 
+// Directory survives close/reopen without rescanning blocks
+TEST(ArchiveTest, ReopenLoadsDirectory) {
+    std::string theArcName = (fs::temp_directory_path() / "reopen").string();
+    std::string theFile = makeTestFile("reopen-data.txt", 3000);
+    {
+        auto theArchive = ECE141::Archive::createArchive(theArcName);
+        ASSERT_TRUE(theArchive.isOK());
+        EXPECT_TRUE(theArchive.getValue()->add(theFile).isOK());
+    }
+    auto theArchive = ECE141::Archive::openArchive(theArcName);
+    ASSERT_TRUE(theArchive.isOK());
+    std::stringstream theList;
+    EXPECT_EQ(1u, theArchive.getValue()->list(theList).getValue());
+
+    std::string theOut = (fs::temp_directory_path() / "reopen-out.txt").string();
+    EXPECT_TRUE(theArchive.getValue()->extract("reopen-data.txt", theOut).isOK());
+    EXPECT_EQ(readFile(theFile), readFile(theOut));
+}
+
+// Archive written before the superblock (bare 1024-byte blocks, 96-byte headers) opens and upgrades
+TEST(ArchiveTest, OpensBaselineArchive) {
+    std::string theArcName = (fs::temp_directory_path() / "baseline").string();
+    std::string theFirst = readFile(makeTestFile("baseline-a.txt", 2000)); //3 blocks
+    std::string theSecond = readFile(makeTestFile("baseline-b.txt", 500));
+    {
+        //baseline Block layout: mode, type, blockNumber, blockCount, filename[80], fileSize, timeStamp, data[924]
+        std::ofstream theStream(theArcName + ".arc", std::ios::binary | std::ios::trunc);
+        auto writeBlock = [&](const std::string &aName, const std::string &aData, uint8_t aNumber, uint8_t aCount) {
+            char theBlock[1024] = {};
+            int64_t theTime = 1000;
+            uint32_t theSize = static_cast<uint32_t>(aData.size());
+            theBlock[0] = 1; //in use
+            theBlock[2] = static_cast<char>(aNumber);
+            theBlock[3] = static_cast<char>(aCount);
+            aName.copy(theBlock + 4, 79);
+            memcpy(theBlock + 84, &theSize, sizeof(theSize));
+            memcpy(theBlock + 88, &theTime, sizeof(theTime));
+            aData.copy(theBlock + 96, 924, aNumber * 924);
+            theStream.write(theBlock, sizeof(theBlock));
+        };
+        writeBlock("baseline-a.txt", theFirst, 0, 3);
+        writeBlock("baseline-b.txt", theSecond, 0, 1);
+        writeBlock("baseline-a.txt", theFirst, 1, 3);
+        writeBlock("baseline-a.txt", theFirst, 2, 3);
+    }
+    for (int theOpen = 0; theOpen < 2; theOpen++) { //second open reads the upgraded directory
+        auto theArchive = ECE141::Archive::openArchive(theArcName);
+        ASSERT_TRUE(theArchive.isOK());
+        std::stringstream theList;
+        EXPECT_EQ(2u, theArchive.getValue()->list(theList).getValue());
+        std::string theOut = (fs::temp_directory_path() / "baseline-out.txt").string();
+        EXPECT_TRUE(theArchive.getValue()->extract("baseline-a.txt", theOut).isOK());
+        EXPECT_EQ(theFirst, readFile(theOut));
+        EXPECT_TRUE(theArchive.getValue()->extract("baseline-b.txt", theOut).isOK());
+        EXPECT_EQ(theSecond, readFile(theOut));
+    }
+
+    //anything else without a superblock is still refused
+    std::ofstream(theArcName + ".arc", std::ios::binary | std::ios::trunc) << std::string(1024, 'x');
+    EXPECT_EQ(ECE141::ArchiveErrors::badArchive, ECE141::Archive::openArchive(theArcName).getError());
+}
+
+// Damaged directory is rebuilt from block headers; removed files stay removed
+TEST(ArchiveTest, RecoversCorruptDirectory) {
+    std::string theArcName = (fs::temp_directory_path() / "recover").string();
+    std::string theKeep = makeTestFile("recover-keep.txt", 300 * 1024); //more than 255 blocks
+    std::string theGone = makeTestFile("recover-gone.txt", 2000);
+    {
+        auto theArchive = ECE141::Archive::createArchive(theArcName);
+        ASSERT_TRUE(theArchive.isOK());
+        theArchive.getValue()->add(theKeep);
+        theArchive.getValue()->add(theGone);
+        theArchive.getValue()->remove("recover-gone.txt");
+    }
+    {   //flip a byte of the directory checksum
+        std::fstream theFile(theArcName + ".arc", std::ios::binary | std::ios::in | std::ios::out);
+        theFile.seekp(offsetof(ECE141::SuperBlock, directoryChecksum));
+        theFile.put('\x5a');
+    }
+    //opening reports the damage instead of rebuilding behind the caller's back
+    auto theDamaged = ECE141::Archive::openArchive(theArcName);
+    ASSERT_FALSE(theDamaged.isOK());
+    EXPECT_EQ(ECE141::ArchiveErrors::badData, theDamaged.getError());
+    auto theArchive = ECE141::Archive::recoverArchive(theArcName, 3);
+    ASSERT_TRUE(theArchive.isOK());
+    std::stringstream theList;
+    EXPECT_EQ(1u, theArchive.getValue()->list(theList).getValue());
+
+    std::string theOut = (fs::temp_directory_path() / "recover-out.txt").string();
+    EXPECT_TRUE(theArchive.getValue()->extract("recover-keep.txt", theOut).isOK());
+    EXPECT_EQ(readFile(theKeep), readFile(theOut));
+}
+
+// File spanning several I/O runs comes back byte-for-byte
+TEST(ArchiveTest, LargeFileRoundTrip) {
+    std::string theArcName = (fs::temp_directory_path() / "large").string();
+    std::string theFile = makeTestFile("large-data.bin", 1200 * 1024);
+    auto theArchive = ECE141::Archive::createArchive(theArcName);
+    ASSERT_TRUE(theArchive.isOK());
+    ASSERT_TRUE(theArchive.getValue()->add(theFile).isOK());
+
+    std::string theOut = (fs::temp_directory_path() / "large-out.bin").string();
+    EXPECT_TRUE(theArchive.getValue()->extract("large-data.bin", theOut).isOK());
+    EXPECT_EQ(readFile(theFile), readFile(theOut));
+}
+
+// Header-less archives store pure payload: 3000 bytes fit in 3 blocks instead of 4
+TEST(ArchiveTest, HeaderlessLayout) {
+    std::string theArcName = (fs::temp_directory_path() / "headerless").string();
+    std::string theFile = makeTestFile("headerless-data.txt", 3000);
+    ECE141::ArchiveOptions theOptions;
+    theOptions.layout = ECE141::BlockLayout::headerless;
+    {
+        auto theArchive = ECE141::Archive::createArchive(theArcName, theOptions);
+        ASSERT_TRUE(theArchive.isOK());
+        ASSERT_TRUE(theArchive.getValue()->add(theFile).isOK());
+    }
+    auto theArchive = ECE141::Archive::openArchive(theArcName);
+    ASSERT_TRUE(theArchive.isOK());
+    std::stringstream theDump;
+    EXPECT_EQ(3u, theArchive.getValue()->debugDump(theDump).getValue());
+
+    std::string theOut = (fs::temp_directory_path() / "headerless-out.txt").string();
+    EXPECT_TRUE(theArchive.getValue()->extract("headerless-data.txt", theOut).isOK());
+    EXPECT_EQ(readFile(theFile), readFile(theOut));
+}
+
+TEST(ArchiveTest, LargeBlockSize) {
+    std::string theArcName = (fs::temp_directory_path() / "bigblocks").string();
+    std::string theFile = makeTestFile("bigblocks-data.txt", 60000);
+    ECE141::ArchiveOptions theOptions;
+    theOptions.blockSize = 64 * 1024;
+    {
+        auto theArchive = ECE141::Archive::createArchive(theArcName, theOptions);
+        ASSERT_TRUE(theArchive.isOK());
+        ASSERT_TRUE(theArchive.getValue()->add(theFile).isOK());
+    }
+    auto theArchive = ECE141::Archive::openArchive(theArcName);
+    ASSERT_TRUE(theArchive.isOK());
+    std::stringstream theDump;
+    EXPECT_EQ(1u, theArchive.getValue()->debugDump(theDump).getValue());
+
+    std::string theOut = (fs::temp_directory_path() / "bigblocks-out.txt").string();
+    EXPECT_TRUE(theArchive.getValue()->extract("bigblocks-data.txt", theOut).isOK());
+    EXPECT_EQ(readFile(theFile), readFile(theOut));
+
+    theOptions.blockSize = 3000; //not a power of two
+    EXPECT_FALSE(ECE141::Archive::createArchive(theArcName, theOptions).isOK());
+}
+
+TEST(ArchiveTest, FixedGeometryArchive) {
+    using FastArchive = ECE141::BasicArchive<4096, 64>;
+    std::string theArcName = (fs::temp_directory_path() / "fixed").string();
+    std::string theFile = makeTestFile("fixed-data.txt", 10000);
+    {
+        auto theArchive = FastArchive::createArchive(theArcName);
+        ASSERT_TRUE(theArchive.isOK());
+        ASSERT_TRUE(theArchive.getValue()->add(theFile).isOK());
+    }
+    //same on-disk format, so the dynamic archive reads it too
+    auto theArchive = ECE141::Archive::openArchive(theArcName);
+    ASSERT_TRUE(theArchive.isOK());
+    std::string theOut = (fs::temp_directory_path() / "fixed-out.txt").string();
+    EXPECT_TRUE(theArchive.getValue()->extract("fixed-data.txt", theOut).isOK());
+    EXPECT_EQ(readFile(theFile), readFile(theOut));
+
+    //but a fixed archive refuses other geometries
+    std::string theOtherName = (fs::temp_directory_path() / "fixed-other").string();
+    ASSERT_TRUE(ECE141::Archive::createArchive(theOtherName).isOK());
+    EXPECT_FALSE(FastArchive::openArchive(theOtherName).isOK());
+}
+
+TEST(ArchiveTest, TailPacking) {
+    std::string theArcName = (fs::temp_directory_path() / "tails").string();
+    ECE141::ArchiveOptions theOptions;
+    theOptions.tailPacking = true;
+    theOptions.inlineFiles = false; //these would be inlined otherwise
+    std::vector<std::string> theFiles;
+    {
+        auto theArchive = ECE141::Archive::createArchive(theArcName, theOptions);
+        ASSERT_TRUE(theArchive.isOK());
+        for (int i = 0; i < 10; i++) {
+            theFiles.push_back(makeTestFile("tail" + std::to_string(i) + ".txt", 40 + i));
+            ASSERT_TRUE(theArchive.getValue()->add(theFiles.back()).isOK());
+        }
+        //one full block + a 76 byte tail
+        theFiles.push_back(makeTestFile("tail-big.txt", 1000));
+        ASSERT_TRUE(theArchive.getValue()->add(theFiles.back()).isOK());
+        std::stringstream theDump;
+        EXPECT_EQ(2u, theArchive.getValue()->debugDump(theDump).getValue());
+        ASSERT_TRUE(theArchive.getValue()->remove("tail3.txt").isOK());
+        ASSERT_TRUE(theArchive.getValue()->compact().isOK());
+    }
+    auto theArchive = ECE141::Archive::openArchive(theArcName);
+    ASSERT_TRUE(theArchive.isOK());
+    std::string theOut = (fs::temp_directory_path() / "tail-out.txt").string();
+    for (const auto &theFile : theFiles) {
+        std::string theName = fs::path(theFile).filename().string();
+        if (theName == "tail3.txt") continue;
+        EXPECT_TRUE(theArchive.getValue()->extract(theName, theOut).isOK());
+        EXPECT_EQ(readFile(theFile), readFile(theOut)) << theName;
+    }
+}
+
+TEST(ArchiveTest, InlineTinyFiles) {
+    std::string theArcName = (fs::temp_directory_path() / "inline").string();
+    std::string theTiny = makeTestFile("inline-tiny.txt", 40);
+    std::string theSmall = makeTestFile("inline-small.txt", 100);
+    {
+        auto theArchive = ECE141::Archive::createArchive(theArcName);
+        ASSERT_TRUE(theArchive.isOK());
+        ASSERT_TRUE(theArchive.getValue()->add(theTiny).isOK());
+        std::stringstream theDump;
+        EXPECT_EQ(0u, theArchive.getValue()->debugDump(theDump).getValue()); //no data blocks
+        ASSERT_TRUE(theArchive.getValue()->add(theSmall).isOK());
+        EXPECT_EQ(1u, theArchive.getValue()->debugDump(theDump).getValue());
+    }
+    auto theArchive = ECE141::Archive::openArchive(theArcName);
+    ASSERT_TRUE(theArchive.isOK());
+    std::stringstream theList;
+    EXPECT_EQ(2u, theArchive.getValue()->list(theList).getValue());
+    std::string theOut = (fs::temp_directory_path() / "inline-out.txt").string();
+    EXPECT_TRUE(theArchive.getValue()->extract("inline-tiny.txt", theOut).isOK());
+    EXPECT_EQ(readFile(theTiny), readFile(theOut));
+    EXPECT_TRUE(theArchive.getValue()->remove("inline-tiny.txt").isOK());
+    EXPECT_FALSE(theArchive.getValue()->extract("inline-tiny.txt", theOut).isOK());
+}
+
+TEST(ArchiveTest, FreeBitmapScan) {
+    ECE141::BlockManager theManager;
+    theManager.reset(200); //block 0 = superblock
+    theManager.markBlocksAsUsed({{1, 60}, {62, 40}, {130, 5}});
+    EXPECT_EQ(200u - 106u, theManager.countFreeBlocks());
+
+    //free runs straddle word boundaries: 61, 102..129, 135..
+    auto theFree = theManager.findFreeBlocks(10);
+    ASSERT_EQ(2u, theFree.size());
+    EXPECT_EQ(61u, theFree[0].start);
+    EXPECT_EQ(1u, theFree[0].length);
+    EXPECT_EQ(102u, theFree[1].start);
+    EXPECT_EQ(9u, theFree[1].length);
+    EXPECT_EQ(102u, theManager.findFreeRun(28));
+    EXPECT_EQ(135u, theManager.findFreeRun(29));
+    EXPECT_EQ(ECE141::kNoBlock, theManager.findFreeRun(66));
+
+    //freed blocks are found again
+    theManager.markBlocksAsFree({{1, 60}});
+    EXPECT_EQ(1u, theManager.findFreeRun(61));
+}
+
+TEST(ArchiveTest, AllocationPolicies) {
+    ECE141::BlockManager theManager;
+    theManager.reset(100);
+    theManager.markBlocksAsUsed({{1, 99}});
+    theManager.markBlocksAsFree({{10, 3}, {20, 8}, {40, 5}});
+
+    auto thePlace = [&](ECE141::AllocationPolicy aPolicy, size_t aCount) {
+        theManager.setPolicy(aPolicy);
+        std::vector<std::pair<size_t, size_t>> theResult;
+        for (const auto &theExtent : theManager.findFreeBlocks(aCount)) {
+            theResult.push_back({theExtent.start, theExtent.length});
+        }
+        return theResult;
+    };
+    using Runs = std::vector<std::pair<size_t, size_t>>;
+    EXPECT_EQ((Runs{{10, 3}, {20, 1}}), thePlace(ECE141::AllocationPolicy::firstFit, 4));
+    EXPECT_EQ((Runs{{40, 4}}), thePlace(ECE141::AllocationPolicy::bestFit, 4));
+    EXPECT_EQ((Runs{{20, 4}}), thePlace(ECE141::AllocationPolicy::contiguousFirst, 4));
+    //nothing fits: fewest fragments, in block order
+    EXPECT_EQ((Runs{{20, 8}, {40, 2}}), thePlace(ECE141::AllocationPolicy::bestFit, 10));
+
+    //freeing next to a run merges them
+    theManager.markBlocksAsFree({{13, 7}});
+    EXPECT_EQ((Runs{{10, 18}}), thePlace(ECE141::AllocationPolicy::bestFit, 18));
+}
+
+TEST(ArchiveTest, AllocationGroupsAreDisjoint) {
+    ECE141::BlockManager theManager(64); //tiny groups so the threads spread out
+    theManager.reset(64 * 8);
+    EXPECT_EQ(8u, theManager.getGroupCount());
+
+    std::vector<std::vector<ECE141::Extent>> theTaken(8);
+    std::vector<std::thread> theThreads;
+    for (size_t t = 0; t < theTaken.size(); t++) {
+        theThreads.emplace_back([&, t]() {
+            for (int i = 0; i < 40; i++) { //more than fits, so some takes grow the archive
+                auto theBlocks = theManager.takeBlocks(3);
+                theTaken[t].insert(theTaken[t].end(), theBlocks.begin(), theBlocks.end());
+            }
+        });
+    }
+    for (auto &theThread : theThreads) theThread.join();
+
+    std::vector<bool> theSeen(theManager.getTotalBlocks(), false);
+    size_t theCount = 0;
+    for (const auto &theExtents : theTaken) {
+        for (const auto &theExtent : theExtents) {
+            for (size_t b = theExtent.start; b < theExtent.end(); b++) {
+                ASSERT_NE(0u, b);
+                ASSERT_FALSE(theSeen[b]) << "block " << b << " handed out twice";
+                theSeen[b] = true;
+                theCount++;
+            }
+        }
+    }
+    EXPECT_EQ(8u * 40u * 3u, theCount);
+    EXPECT_EQ(theManager.getTotalBlocks() - 1 - theCount, theManager.countFreeBlocks());
+}
+
+TEST(ArchiveTest, AllocationSpansGroups) {
+    ECE141::BlockManager theManager(64); //files below are several groups long
+    theManager.reset(64 * 8);
+    theManager.markBlocksAsUsed({{1, 64 * 8 - 1}});
+    theManager.markBlocksAsFree({{10, 10}, {100, 200}, {310, 160}});
+
+    auto thePlace = [&](ECE141::AllocationPolicy aPolicy, size_t aCount) {
+        theManager.setPolicy(aPolicy);
+        std::vector<std::pair<size_t, size_t>> theResult;
+        for (const auto &theExtent : theManager.findFreeBlocks(aCount)) {
+            theResult.push_back({theExtent.start, theExtent.length});
+        }
+        return theResult;
+    };
+    using Runs = std::vector<std::pair<size_t, size_t>>;
+    EXPECT_EQ((Runs{{100, 150}}), thePlace(ECE141::AllocationPolicy::contiguousFirst, 150));
+    EXPECT_EQ((Runs{{310, 150}}), thePlace(ECE141::AllocationPolicy::bestFit, 150));
+    EXPECT_EQ((Runs{{100, 180}}), thePlace(ECE141::AllocationPolicy::bestFit, 180));
+    EXPECT_EQ((Runs{{10, 5}}), thePlace(ECE141::AllocationPolicy::contiguousFirst, 5)); //lowest in the archive
+
+    //taking a span marks it used in every group it crosses
+    theManager.setPolicy(ECE141::AllocationPolicy::contiguousFirst);
+    size_t theFree = theManager.countFreeBlocks();
+    auto theTaken = theManager.takeBlocks(190);
+    ASSERT_EQ(1u, theTaken.size());
+    EXPECT_EQ(100u, theTaken[0].start);
+    EXPECT_EQ(theFree - 190, theManager.countFreeBlocks());
+    EXPECT_EQ((Runs{{310, 150}}), thePlace(ECE141::AllocationPolicy::contiguousFirst, 150));
+}
+
+TEST(ArchiveTest, ParallelAdds) {
+    std::string theArcName = (fs::temp_directory_path() / "parallel").string();
+    auto theArchive = ECE141::Archive::createArchive(theArcName);
+    ASSERT_TRUE(theArchive.isOK());
+    std::vector<std::string> theFiles;
+    for (int i = 0; i < 32; i++) {
+        theFiles.push_back(makeTestFile("parallel" + std::to_string(i) + ".txt", 500 + i * 97));
+    }
+    std::vector<std::thread> theThreads;
+    std::atomic<int> theFailures{0};
+    std::atomic<bool> isDone{false};
+    for (int t = 0; t < 4; t++) {
+        theThreads.emplace_back([&, t]() {
+            for (size_t i = t; i < theFiles.size(); i += 4) {
+                if (!theArchive.getValue()->add(theFiles[i]).isOK()) theFailures++;
+            }
+        });
+    }
+    std::thread theLister([&]() { //list while the adds run (never more files than were added)
+        while (!isDone) {
+            std::stringstream theList;
+            size_t theCount = theArchive.getValue()->list(theList).getValue();
+            if (theCount > theFiles.size()) theFailures++;
+        }
+    });
+    for (auto &theThread : theThreads) theThread.join();
+    isDone = true;
+    theLister.join();
+    EXPECT_EQ(0, theFailures.load());
+
+    auto theReopened = ECE141::Archive::openArchive(theArcName);
+    ASSERT_TRUE(theReopened.isOK());
+    std::string theOut = (fs::temp_directory_path() / "parallel-out.txt").string();
+    for (const auto &theFile : theFiles) {
+        std::string theName = fs::path(theFile).filename().string();
+        EXPECT_TRUE(theReopened.getValue()->extract(theName, theOut).isOK());
+        EXPECT_EQ(readFile(theFile), readFile(theOut)) << theName;
+    }
+}
+
+TEST(ArchiveTest, ExtractWhileRemoving) {
+    std::string theArcName = (fs::temp_directory_path() / "extract-remove").string();
+    std::string theOut = (fs::temp_directory_path() / "extract-remove-out.txt").string();
+    std::string theVictim = makeTestFile("victim.txt", 40000);
+    std::vector<std::string> theFillers;
+    for (int i = 0; i < 6; i++) {
+        theFillers.push_back(makeTestFile("filler" + std::to_string(i) + ".txt", 9000 + i * 1300));
+    }
+    auto theArchive = ECE141::Archive::createArchive(theArcName);
+    ASSERT_TRUE(theArchive.isOK());
+    std::string theExpected = readFile(theVictim);
+    std::atomic<int> theBad{0};
+    for (int theRound = 0; theRound < 10; theRound++) {
+        ASSERT_TRUE(theArchive.getValue()->add(theVictim).isOK());
+        //an extract racing the remove gets the whole file or fileNotFound, never reused blocks
+        std::thread theReader([&]() {
+            for (int i = 0; i < 20; i++) {
+                auto theResult = theArchive.getValue()->extract("victim.txt", theOut);
+                if (theResult.isOK() ? readFile(theOut) != theExpected
+                                     : theResult.getError() != ECE141::ArchiveErrors::fileNotFound) {
+                    theBad++;
+                }
+            }
+        });
+        ASSERT_TRUE(theArchive.getValue()->remove("victim.txt").isOK());
+        for (const auto &theFiller : theFillers) EXPECT_TRUE(theArchive.getValue()->add(theFiller).isOK());
+        theReader.join();
+        for (const auto &theFiller : theFillers) {
+            EXPECT_TRUE(theArchive.getValue()->remove(fs::path(theFiller).filename().string()).isOK());
+        }
+    }
+    EXPECT_EQ(0, theBad.load());
+}
+
+TEST(ArchiveTest, ReusesFreedBlocks) {
+    std::string theArcName = (fs::temp_directory_path() / "reuse").string();
+    std::string theFirst = makeTestFile("reuse-a.txt", 3000);
+    std::string theSecond = makeTestFile("reuse-b.txt", 3000);
+    auto theArchive = ECE141::Archive::createArchive(theArcName);
+    ASSERT_TRUE(theArchive.isOK());
+    ASSERT_TRUE(theArchive.getValue()->add(theFirst).isOK());
+    ASSERT_TRUE(theArchive.getValue()->remove("reuse-a.txt").isOK());
+    ASSERT_TRUE(theArchive.getValue()->add(theSecond).isOK());
+    std::stringstream theDump;
+    EXPECT_EQ(4u, theArchive.getValue()->debugDump(theDump).getValue());
+}
+
+#if defined(__linux__)
+// Bytes the filesystem actually holds for aPath (holes don't count)
+static size_t allocatedBytes(const std::string &aPath) {
+    struct stat theInfo{};
+    return ::stat(aPath.c_str(), &theInfo) ? 0 : static_cast<size_t>(theInfo.st_blocks) * 512;
+}
+#endif
+
+TEST(ArchiveTest, PunchHolesOnRemove) {
+    std::string theArcName = (fs::temp_directory_path() / "punch").string();
+    std::string theBig = makeTestFile("punch-big.txt", 512 * 1024);
+    std::string theSmall = makeTestFile("punch-small.txt", 5000);
+    ECE141::ArchiveOptions theOptions;
+    theOptions.blockSize = 4096;
+    theOptions.punchHoles = true;
+    auto theArchive = ECE141::Archive::createArchive(theArcName, theOptions);
+    ASSERT_TRUE(theArchive.isOK());
+    ASSERT_TRUE(theArchive.getValue()->add(theBig).isOK());
+    ASSERT_TRUE(theArchive.getValue()->add(theSmall).isOK());
+    std::string thePath = theArchive.getValue()->getFullPath().getValue();
+    size_t theSize = fs::file_size(thePath);
+#if defined(__linux__)
+    size_t theAllocated = allocatedBytes(thePath);
+#endif
+
+    ASSERT_TRUE(theArchive.getValue()->remove("punch-big.txt").isOK());
+    EXPECT_EQ(theSize, fs::file_size(thePath)); //blocks keep their indices
+#if defined(__linux__)
+    EXPECT_LE(allocatedBytes(thePath) + 400 * 1024, theAllocated);
+#endif
+
+    //holes read as free blocks and fill back in on reuse
+    std::string theOut = (fs::temp_directory_path() / "punch-out.txt").string();
+    ASSERT_TRUE(theArchive.getValue()->add(theBig).isOK());
+    EXPECT_EQ(theSize, fs::file_size(thePath));
+    auto theReopened = ECE141::Archive::openArchive(theArcName);
+    ASSERT_TRUE(theReopened.isOK());
+    ASSERT_TRUE(theReopened.getValue()->extract("punch-big.txt", theOut).isOK());
+    EXPECT_EQ(readFile(theBig), readFile(theOut));
+    ASSERT_TRUE(theReopened.getValue()->extract("punch-small.txt", theOut).isOK());
+    EXPECT_EQ(readFile(theSmall), readFile(theOut));
+}
+
+TEST(ArchiveTest, GrowthPolicySteps) {
+    ECE141::GrowthPolicy thePolicy{1024 * 1024, 8 * 1024 * 1024, 0.5};
+    EXPECT_EQ(1024u * 1024u, thePolicy.reserveEnd(0, 100)); //at least minChunk
+    EXPECT_EQ(6u * 1024u * 1024u, thePolicy.reserveEnd(4 * 1024 * 1024, 5 * 1024 * 1024)); //geometric
+    EXPECT_EQ(24u * 1024u * 1024u, thePolicy.reserveEnd(16 * 1024 * 1024, 17 * 1024 * 1024)); //capped
+    EXPECT_EQ(10u * 1024u * 1024u, thePolicy.reserveEnd(1024 * 1024, 10 * 1024 * 1024)); //big add wins
+    EXPECT_EQ(4096u, thePolicy.reserveEnd(4096, 4096)); //already reserved
+    thePolicy.factor = 0;
+    EXPECT_EQ(5000u, thePolicy.reserveEnd(4096, 5000));
+}
+
+TEST(ArchiveTest, PreallocatesSpace) {
+    std::string theArcName = (fs::temp_directory_path() / "prealloc").string();
+    std::string theFile = makeTestFile("prealloc.txt", 3 * 1024 * 1024);
+    ECE141::ArchiveOptions theOptions;
+    theOptions.blockSize = 4096;
+    theOptions.initialCapacity = 2 * 1024 * 1024;
+    auto theArchive = ECE141::Archive::createArchive(theArcName, theOptions);
+    ASSERT_TRUE(theArchive.isOK());
+    std::string thePath = theArchive.getValue()->getFullPath().getValue();
+    EXPECT_EQ(4096u, fs::file_size(thePath)); //reserving doesn't grow the archive itself
+#if defined(__linux__)
+    EXPECT_GE(allocatedBytes(thePath), 2u * 1024u * 1024u);
+#endif
+
+    ASSERT_TRUE(theArchive.getValue()->add(theFile).isOK());
+#if defined(__linux__)
+    EXPECT_GE(allocatedBytes(thePath), fs::file_size(thePath));
+#endif
+    std::string theOut = (fs::temp_directory_path() / "prealloc-out.txt").string();
+    auto theReopened = ECE141::Archive::openArchive(theArcName);
+    ASSERT_TRUE(theReopened.isOK());
+    ASSERT_TRUE(theReopened.getValue()->extract("prealloc.txt", theOut).isOK());
+    EXPECT_EQ(readFile(theFile), readFile(theOut));
+}
+
+TEST(ArchiveTest, JournalReplay) {
+    std::string theArcName = (fs::temp_directory_path() / "journal").string();
+    std::string theCrashName = (fs::temp_directory_path() / "journal-crash").string();
+    std::string theKeep = makeTestFile("journal-keep.txt", 5000);
+    std::string theTiny = makeTestFile("journal-tiny.txt", 20);
+    std::string theGone = makeTestFile("journal-gone.txt", 3000);
+    std::string theOut = (fs::temp_directory_path() / "journal-out.txt").string();
+    {
+        auto theArchive = ECE141::Archive::createArchive(theArcName);
+        ASSERT_TRUE(theArchive.isOK());
+        ASSERT_TRUE(theArchive.getValue()->add(theGone).isOK());
+        ASSERT_TRUE(theArchive.getValue()->add(theKeep).isOK());
+        ASSERT_TRUE(theArchive.getValue()->add(theTiny).isOK());
+        ASSERT_TRUE(theArchive.getValue()->remove("journal-gone.txt").isOK());
+
+        //"crash": take the files as they are now, before any checkpoint
+        ASSERT_TRUE(fs::exists(theArcName + ".arc.journal"));
+        fs::copy_file(theArcName + ".arc", theCrashName + ".arc", fs::copy_options::overwrite_existing);
+        fs::copy_file(theArcName + ".arc.journal", theCrashName + ".arc.journal", fs::copy_options::overwrite_existing);
+        //plus a torn frame claiming ~4 GiB: replay stops there instead of allocating it
+        std::ofstream theTorn(theCrashName + ".arc.journal", std::ios::binary | std::ios::app);
+        uint32_t theFrame[2] = {0xFFFFFFF0u, 0};
+        theTorn.write(reinterpret_cast<const char*>(theFrame), sizeof(theFrame));
+    }
+    EXPECT_FALSE(fs::exists(theArcName + ".arc.journal")); //clean close folds it into the directory
+
+    auto theRecovered = ECE141::Archive::openArchive(theCrashName);
+    ASSERT_TRUE(theRecovered.isOK());
+    EXPECT_FALSE(theRecovered.getValue()->extract("journal-gone.txt", theOut).isOK());
+    ASSERT_TRUE(theRecovered.getValue()->extract("journal-keep.txt", theOut).isOK());
+    EXPECT_EQ(readFile(theKeep), readFile(theOut));
+    ASSERT_TRUE(theRecovered.getValue()->extract("journal-tiny.txt", theOut).isOK());
+    EXPECT_EQ(readFile(theTiny), readFile(theOut));
+
+    //replayed changes are in the directory now, freed blocks are reusable
+    ASSERT_TRUE(theRecovered.getValue()->add(theGone).isOK());
+    ASSERT_TRUE(theRecovered.getValue()->extract("journal-gone.txt", theOut).isOK());
+    EXPECT_EQ(readFile(theGone), readFile(theOut));
+    std::stringstream theList;
+    EXPECT_EQ(3u, theRecovered.getValue()->list(theList).getValue());
+}
+
+TEST(ArchiveTest, DurabilityModes) {
+    std::string theFile = makeTestFile("durable.txt", 4000);
+    std::string theOut = (fs::temp_directory_path() / "durable-out.txt").string();
+    for (auto theMode : {ECE141::Durability::none, ECE141::Durability::periodic}) {
+        std::string theArcName = (fs::temp_directory_path() / "durable").string();
+        std::string theCrashName = (fs::temp_directory_path() / "durable-crash").string();
+        ECE141::ArchiveOptions theOptions;
+        theOptions.durability.mode = theMode;
+        theOptions.durability.flushMillis = 10;
+        auto theArchive = ECE141::Archive::createArchive(theArcName, theOptions);
+        ASSERT_TRUE(theArchive.isOK());
+        ASSERT_TRUE(theArchive.getValue()->add(theFile).isOK());
+        if (theMode == ECE141::Durability::periodic) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(200)); //a few flush intervals
+        }
+
+        //none still writes every record, periodic has flushed by now: a crash keeps the file
+        fs::copy_file(theArcName + ".arc", theCrashName + ".arc", fs::copy_options::overwrite_existing);
+        fs::copy_file(theArcName + ".arc.journal", theCrashName + ".arc.journal", fs::copy_options::overwrite_existing);
+        auto theRecovered = ECE141::Archive::openArchive(theCrashName);
+        ASSERT_TRUE(theRecovered.isOK());
+        ASSERT_TRUE(theRecovered.getValue()->extract("durable.txt", theOut).isOK());
+        EXPECT_EQ(readFile(theFile), readFile(theOut));
+
+        EXPECT_TRUE(theArchive.getValue()->remove("durable.txt").isOK());
+        EXPECT_TRUE(theArchive.getValue()->flush().isOK());
+    }
+}
+
+TEST(ArchiveTest, CompactInPlace) {
+    std::vector<std::string> theFiles;
+    for (int i = 0; i < 8; i++) {
+        theFiles.push_back(makeTestFile("inplace" + std::to_string(i) + ".txt", 3000 + i * 1700));
+    }
+    std::string theOut = (fs::temp_directory_path() / "inplace-out.txt").string();
+    for (bool isJournaled : {true, false}) {
+        std::string theArcName = (fs::temp_directory_path() / "inplace").string();
+        ECE141::ArchiveOptions theOptions;
+        theOptions.journal = isJournaled;
+        theOptions.tailPacking = true;
+        size_t theBefore = 0;
+        {
+            auto theArchive = ECE141::Archive::createArchive(theArcName, theOptions);
+            ASSERT_TRUE(theArchive.isOK());
+            for (const auto &theFile : theFiles) ASSERT_TRUE(theArchive.getValue()->add(theFile).isOK());
+            for (int i = 0; i < 8; i += 2) {
+                ASSERT_TRUE(theArchive.getValue()->remove("inplace" + std::to_string(i) + ".txt").isOK());
+            }
+            theBefore = fs::file_size(theArcName + ".arc");
+
+            //one block of memory at a time, pause after the first move, then finish
+            size_t theCalls = 0;
+            auto thePaused = theArchive.getValue()->compactInPlace(1, [&](const ECE141::CompactProgress &) {
+                return ++theCalls > 1;
+            });
+            ASSERT_TRUE(thePaused.isOK());
+            EXPECT_EQ(1u, theCalls);
+            for (int i = 1; i < 8; i += 2) { //usable in between
+                ASSERT_TRUE(theArchive.getValue()->extract("inplace" + std::to_string(i) + ".txt", theOut).isOK());
+                EXPECT_EQ(readFile(theFiles[i]), readFile(theOut));
+            }
+            auto theDone = theArchive.getValue()->compactInPlace();
+            ASSERT_TRUE(theDone.isOK());
+            EXPECT_LT(theDone.getValue() * ECE141::kBlockSize, theBefore);
+        }
+        EXPECT_LT(fs::file_size(theArcName + ".arc"), theBefore);
+
+        auto theReopened = ECE141::Archive::openArchive(theArcName);
+        ASSERT_TRUE(theReopened.isOK());
+        for (int i = 1; i < 8; i += 2) {
+            ASSERT_TRUE(theReopened.getValue()->extract("inplace" + std::to_string(i) + ".txt", theOut).isOK());
+            EXPECT_EQ(readFile(theFiles[i]), readFile(theOut));
+        }
+    }
+}
+
+TEST(ArchiveTest, TokenBucketThrottles) {
+    ECE141::TokenBucket theBucket(1000, 500); //1000 bytes/s, bursts of 500
+    auto theStart = theBucket.last;
+    EXPECT_EQ(0, theBucket.take(500, theStart).count()); //the burst is free
+    EXPECT_EQ(250000, theBucket.take(250, theStart).count()); //then it's paced
+    EXPECT_EQ(0, theBucket.take(0, theStart + std::chrono::milliseconds(250)).count()); //debt paid off
+    EXPECT_EQ(0, theBucket.take(500, theStart + std::chrono::seconds(10)).count()); //refill stops at burst
+    EXPECT_EQ(1000, theBucket.take(1, theStart + std::chrono::seconds(10)).count());
+    EXPECT_EQ(0, ECE141::TokenBucket().take(1 << 30).count()); //no rate = no limit
+}
+
+TEST(ArchiveTest, BackgroundCompactor) {
+    std::vector<std::string> theFiles;
+    for (int i = 0; i < 12; i++) {
+        theFiles.push_back(makeTestFile("background" + std::to_string(i) + ".txt", 4000 + i * 900));
+    }
+    std::string theArcName = (fs::temp_directory_path() / "background").string();
+    std::string theOut = (fs::temp_directory_path() / "background-out.txt").string();
+    ECE141::ArchiveOptions theOptions;
+    theOptions.compactor.enabled = true;
+    theOptions.compactor.freeRatio = 0.2;
+    theOptions.compactor.checkMillis = 10;
+    auto theArchive = ECE141::Archive::createArchive(theArcName, theOptions);
+    ASSERT_TRUE(theArchive.isOK());
+    //observers only ever hear from this thread, never from the compactor's
+    struct ThreadCheck : ECE141::ArchiveObserver {
+        std::thread::id owner{std::this_thread::get_id()};
+        std::atomic<int> strays{0};
+        void operator()(ECE141::ActionType, const std::string &, bool) override {
+            if (std::this_thread::get_id() != owner) strays++;
+        }
+    };
+    auto theCheck = std::make_shared<ThreadCheck>();
+    theArchive.getValue()->addObserver(theCheck);
+    for (const auto &theFile : theFiles) ASSERT_TRUE(theArchive.getValue()->add(theFile).isOK());
+    size_t theBefore = fs::file_size(theArcName + ".arc");
+    for (int i = 0; i < 12; i += 2) {
+        ASSERT_TRUE(theArchive.getValue()->remove("background" + std::to_string(i) + ".txt").isOK());
+    }
+
+    //the freed half gets reclaimed without anyone calling compact
+    for (int i = 0; i < 200 && fs::file_size(theArcName + ".arc") >= theBefore * 3 / 4; i++) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    EXPECT_LT(fs::file_size(theArcName + ".arc"), theBefore * 3 / 4);
+    for (int i = 1; i < 12; i += 2) {
+        ASSERT_TRUE(theArchive.getValue()->extract("background" + std::to_string(i) + ".txt", theOut).isOK());
+        EXPECT_EQ(readFile(theFiles[i]), readFile(theOut));
+    }
+    EXPECT_EQ(0, theCheck->strays.load());
+    theArchive.getValue()->setCompactor(ECE141::CompactorPolicy()); //stops it
+}
+
+// compact() with the compactor running: the rewrite waits for its move, debugDump for the rewrite
+TEST(ArchiveTest, CompactWhileCompactorRuns) {
+    std::vector<std::string> theFiles;
+    for (int i = 0; i < 16; i++) {
+        theFiles.push_back(makeTestFile("rewrite" + std::to_string(i) + ".txt", 3000 + i * 700));
+    }
+    std::string theArcName = (fs::temp_directory_path() / "rewrite").string();
+    std::string theOut = (fs::temp_directory_path() / "rewrite-out.txt").string();
+    ECE141::ArchiveOptions theOptions;
+    theOptions.compactor.enabled = true;
+    theOptions.compactor.freeRatio = 0.05;
+    theOptions.compactor.checkMillis = 1;
+    auto theArchive = ECE141::Archive::createArchive(theArcName, theOptions);
+    ASSERT_TRUE(theArchive.isOK());
+    for (const auto &theFile : theFiles) ASSERT_TRUE(theArchive.getValue()->add(theFile).isOK());
+
+    std::atomic<bool> isDone{false};
+    std::thread theDumper([&]() {
+        while (!isDone) {
+            std::stringstream theDump;
+            theArchive.getValue()->debugDump(theDump);
+        }
+    });
+    for (int theRound = 0; theRound < 5; theRound++) {
+        for (int i = theRound % 2; i < 16; i += 2) {
+            EXPECT_TRUE(theArchive.getValue()->remove("rewrite" + std::to_string(i) + ".txt").isOK());
+        }
+        EXPECT_TRUE(theArchive.getValue()->compact().isOK());
+        for (int i = 1 - theRound % 2; i < 16; i += 2) {
+            EXPECT_TRUE(theArchive.getValue()->extract("rewrite" + std::to_string(i) + ".txt", theOut).isOK());
+            EXPECT_EQ(readFile(theFiles[i]), readFile(theOut));
+        }
+        for (int i = theRound % 2; i < 16; i += 2) EXPECT_TRUE(theArchive.getValue()->add(theFiles[i]).isOK());
+    }
+    isDone = true;
+    theDumper.join();
+    theArchive.getValue()->setCompactor(ECE141::CompactorPolicy()); //stops it
+}
+
+TEST(ArchiveTest, CompactOrders) {
+    std::string theArcName = (fs::temp_directory_path() / "order").string();
+    std::string theOut = (fs::temp_directory_path() / "order-out.txt").string();
+    std::vector<std::string> theNames{"order-c.txt", "order-a.txt", "other-b.txt", "order-d.txt"}; //add order
+    {
+        auto theArchive = ECE141::Archive::createArchive(theArcName);
+        ASSERT_TRUE(theArchive.isOK());
+        for (const auto &theName : theNames) ASSERT_TRUE(theArchive.getValue()->add(makeTestFile(theName, 2000)).isOK());
+        for (int i = 0; i < 3; i++) ASSERT_TRUE(theArchive.getValue()->extract("order-d.txt", theOut).isOK());
+        ASSERT_TRUE(theArchive.getValue()->extract("other-b.txt", theOut).isOK());
+    }
+
+    //files in the order their blocks appear
+    auto theLayout = [](ECE141::Archive &anArchive) {
+        std::stringstream theDump;
+        anArchive.debugDump(theDump);
+        std::vector<std::string> theOrder;
+        for (std::string theLine; std::getline(theDump, theLine);) {
+            auto thePos = theLine.find("used     ");
+            if (thePos == std::string::npos) continue;
+            std::string theName = theLine.substr(thePos + 9);
+            if (theOrder.empty() || theOrder.back() != theName) theOrder.push_back(theName);
+        }
+        return theOrder;
+    };
+
+    auto theArchive = ECE141::Archive::openArchive(theArcName); //read counts came back with the directory
+    ASSERT_TRUE(theArchive.isOK());
+    ECE141::Archive &theArc = *theArchive.getValue();
+    ASSERT_TRUE(theArc.compact(ECE141::CompactOrder::insertion).isOK());
+    EXPECT_EQ(theNames, theLayout(theArc));
+    ASSERT_TRUE(theArc.compact(ECE141::CompactOrder::heat).isOK());
+    EXPECT_EQ((std::vector<std::string>{"order-d.txt", "other-b.txt", "order-c.txt", "order-a.txt"}), theLayout(theArc));
+    ASSERT_TRUE(theArc.compact(ECE141::CompactOrder::group, [](const std::string &aName) {
+        return aName.substr(0, aName.find('-'));
+    }).isOK());
+    EXPECT_EQ((std::vector<std::string>{"order-c.txt", "order-a.txt", "order-d.txt", "other-b.txt"}), theLayout(theArc));
+    ASSERT_TRUE(theArc.compact().isOK());
+    EXPECT_EQ((std::vector<std::string>{"order-a.txt", "order-c.txt", "order-d.txt", "other-b.txt"}), theLayout(theArc));
+    ASSERT_TRUE(theArc.extract("order-a.txt", theOut).isOK());
+    EXPECT_EQ(readFile(makeTestFile("order-a.txt", 2000)), readFile(theOut));
+}
+
+TEST(ArchiveTest, DefragmentOneFile) {
+    std::string theArcName = (fs::temp_directory_path() / "defrag").string();
+    std::string theOut = (fs::temp_directory_path() / "defrag-out.txt").string();
+    std::string theBig = makeTestFile("defrag-big.txt", 5 * ECE141::kBlockSize);
+    ECE141::ArchiveOptions theOptions;
+    theOptions.allocation = ECE141::AllocationPolicy::firstFit; //fills every hole, so the big file scatters
+    {
+        auto theArchive = ECE141::Archive::createArchive(theArcName, theOptions);
+        ASSERT_TRUE(theArchive.isOK());
+        for (int i = 0; i < 5; i++) {
+            ASSERT_TRUE(theArchive.getValue()->add(makeTestFile("defrag" + std::to_string(i) + ".txt", 1500)).isOK());
+        }
+        ASSERT_TRUE(theArchive.getValue()->remove("defrag1.txt").isOK());
+        ASSERT_TRUE(theArchive.getValue()->remove("defrag3.txt").isOK());
+        ASSERT_TRUE(theArchive.getValue()->add(theBig).isOK());
+
+        auto theBefore = theArchive.getValue()->fragmentation("defrag-big.txt");
+        ASSERT_TRUE(theBefore.isOK());
+        EXPECT_GT(theBefore.getValue().extents, 1u);
+        EXPECT_GT(theBefore.getValue().gapBlocks, 0u);
+
+        ASSERT_TRUE(theArchive.getValue()->defragment("defrag-big.txt").isOK());
+        auto theAfter = theArchive.getValue()->fragmentation("defrag-big.txt");
+        ASSERT_TRUE(theAfter.isOK());
+        EXPECT_TRUE(theAfter.getValue().isContiguous());
+        EXPECT_EQ(theBefore.getValue().blocks, theAfter.getValue().blocks);
+        EXPECT_EQ(0u, theAfter.getValue().gapBlocks);
+        EXPECT_FALSE(theArchive.getValue()->defragment("defrag1.txt").isOK());
+        EXPECT_FALSE(theArchive.getValue()->fragmentation("defrag1.txt").isOK());
+    }
+    auto theReopened = ECE141::Archive::openArchive(theArcName);
+    ASSERT_TRUE(theReopened.isOK());
+    EXPECT_TRUE(theReopened.getValue()->fragmentation("defrag-big.txt").getValue().isContiguous());
+    ASSERT_TRUE(theReopened.getValue()->extract("defrag-big.txt", theOut).isOK());
+    EXPECT_EQ(readFile(theBig), readFile(theOut));
+    ASSERT_TRUE(theReopened.getValue()->extract("defrag4.txt", theOut).isOK());
+    EXPECT_EQ(readFile(makeTestFile("defrag4.txt", 1500)), readFile(theOut));
+}
+
+TEST(ArchiveTest, LogStructuredAllocation) {
+    ECE141::BlockManager theManager(64);
+    theManager.reset(1);
+    theManager.setPolicy(ECE141::AllocationPolicy::logStructured);
+    auto theTake = [&](size_t aCount) {
+        std::vector<std::pair<size_t, size_t>> theResult;
+        for (const auto &theExtent : theManager.takeBlocks(aCount)) {
+            theResult.push_back({theExtent.start, theExtent.length});
+        }
+        return theResult;
+    };
+    using Runs = std::vector<std::pair<size_t, size_t>>;
+    EXPECT_EQ((Runs{{1, 100}}), theTake(100));
+    EXPECT_EQ((Runs{{101, 20}}), theTake(20));
+    theManager.markBlocksAsFree({{30, 10}});
+    EXPECT_EQ((Runs{{121, 5}}), theTake(5)); //appended, the hole stays a hole
+
+    //a clean segment is used before the archive grows, then the log carries on at the end
+    theManager.markBlocksAsFree({{64, 62}});
+    EXPECT_EQ((Runs{{64, 10}}), theTake(10));
+    EXPECT_EQ((Runs{{74, 60}}), theTake(60));
+    EXPECT_EQ(134u, theManager.getTotalBlocks());
+    EXPECT_EQ(10u, theManager.countFreeBlocks());
+}
+
+TEST(ArchiveTest, LogStructuredCleaning) {
+    std::string theArcName = (fs::temp_directory_path() / "logmode").string();
+    std::string theOut = (fs::temp_directory_path() / "logmode-out.txt").string();
+    ECE141::ArchiveOptions theOptions;
+    theOptions.allocation = ECE141::AllocationPolicy::logStructured;
+    theOptions.segmentBlocks = 64;
+    std::vector<std::string> theFiles;
+    for (int i = 0; i < 8; i++) { //~30 blocks each, different content
+        theFiles.push_back(makeTestFile("logmode" + std::to_string(i) + ".txt", 30000 + i));
+    }
+    {
+        auto theArchive = ECE141::Archive::createArchive(theArcName, theOptions);
+        ASSERT_TRUE(theArchive.isOK());
+        for (const auto &theFile : theFiles) ASSERT_TRUE(theArchive.getValue()->add(theFile).isOK());
+        for (int i = 0; i < 8; i += 2) {
+            ASSERT_TRUE(theArchive.getValue()->remove("logmode" + std::to_string(i) + ".txt").isOK());
+        }
+        std::stringstream theDump;
+        size_t theBlocks = theArchive.getValue()->debugDump(theDump).getValue();
+        ASSERT_TRUE(theArchive.getValue()->add(theFiles[0]).isOK()); //same size as a hole, still goes on the end
+        EXPECT_GT(theArchive.getValue()->debugDump(theDump).getValue(), theBlocks);
+
+        auto theCleaned = theArchive.getValue()->cleanSegments(0.25);
+        ASSERT_TRUE(theCleaned.isOK());
+        EXPECT_GE(theCleaned.getValue(), 1u);
+        for (size_t i = 0; i < theFiles.size(); i += (i ? 2 : 1)) {
+            std::string theName = "logmode" + std::to_string(i) + ".txt";
+            ASSERT_TRUE(theArchive.getValue()->extract(theName, theOut).isOK()) << theName;
+            EXPECT_EQ(readFile(theFiles[i]), readFile(theOut)) << theName;
+        }
+    }
+    auto theReopened = ECE141::Archive::openArchive(theArcName);
+    ASSERT_TRUE(theReopened.isOK());
+    ASSERT_TRUE(theReopened.getValue()->extract("logmode7.txt", theOut).isOK());
+    EXPECT_EQ(readFile(theFiles[7]), readFile(theOut));
+
+    //the other policies reuse holes, so there's nothing to clean
+    auto theOther = ECE141::Archive::createArchive(theArcName);
+    ASSERT_TRUE(theOther.isOK());
+    EXPECT_FALSE(theOther.getValue()->cleanSegments().isOK());
+}
+
+TEST(ArchiveTest, MultiVolumeArchive) {
+    fs::path theDir = fs::temp_directory_path() / "multivol";
+    fs::remove_all(theDir);
+    fs::create_directories(theDir / "v1");
+    fs::create_directories(theDir / "v2");
+    std::string theArcName = (theDir / "striped").string();
+    std::string theOut = (theDir / "out.txt").string();
+    ECE141::ArchiveOptions theOptions;
+    theOptions.volumes = {(theDir / "v1").string(), (theDir / "v2").string()};
+    theOptions.stripeBlocks = 64;
+    std::vector<std::string> theFiles;
+    for (int i = 0; i < 6; i++) { //up to ~4 stripes each, so files span volumes
+        theFiles.push_back(makeTestFile("multivol" + std::to_string(i) + ".txt", 20000 + 45000 * i + i));
+    }
+    {
+        auto theArchive = ECE141::Archive::createArchive(theArcName, theOptions);
+        ASSERT_TRUE(theArchive.isOK());
+        std::vector<std::thread> theThreads;
+        for (const auto &theFile : theFiles) {
+            theThreads.emplace_back([&, theFile]() { EXPECT_TRUE(theArchive.getValue()->add(theFile).isOK()); });
+        }
+        for (auto &theThread : theThreads) theThread.join();
+        ASSERT_TRUE(theArchive.getValue()->remove("multivol2.txt").isOK());
+    }
+    EXPECT_GT(fs::file_size(theDir / "v1" / "striped.arc.1"), 0u);
+    EXPECT_GT(fs::file_size(theDir / "v2" / "striped.arc.2"), 0u);
+
+    auto checkFiles = [&](ECE141::Archive &anArchive) {
+        for (size_t i = 0; i < theFiles.size(); i++) {
+            std::string theName = "multivol" + std::to_string(i) + ".txt";
+            if (i == 2) {
+                EXPECT_FALSE(anArchive.extract(theName, theOut).isOK());
+                continue;
+            }
+            ASSERT_TRUE(anArchive.extract(theName, theOut).isOK()) << theName;
+            EXPECT_EQ(readFile(theFiles[i]), readFile(theOut)) << theName;
+        }
+    };
+    {
+        auto theReopened = ECE141::Archive::openArchive(theArcName);
+        ASSERT_TRUE(theReopened.isOK());
+        checkFiles(*theReopened.getValue());
+        ASSERT_TRUE(theReopened.getValue()->compact().isOK());
+        checkFiles(*theReopened.getValue());
+    }
+    {
+        auto theReopened = ECE141::Archive::openArchive(theArcName);
+        ASSERT_TRUE(theReopened.isOK());
+        checkFiles(*theReopened.getValue());
+    }
+
+    //without its other volumes the archive can't be read
+    fs::remove(theDir / "v2" / "striped.arc.2");
+    EXPECT_FALSE(ECE141::Archive::openArchive(theArcName).isOK());
+}
+
+TEST(ArchiveTest, MemoryMappedReads) {
+    std::string theArcName = (fs::temp_directory_path() / "mapped").string();
+    std::string theOut = (fs::temp_directory_path() / "mapped_out.txt").string();
+    std::vector<std::string> theFiles;
+    for (int i = 0; i < 8; i++) {
+        theFiles.push_back(makeTestFile("mapped" + std::to_string(i) + ".txt", 700 + 23000 * i + i));
+    }
+    for (auto theLayout : {ECE141::BlockLayout::headered, ECE141::BlockLayout::headerless}) {
+        ECE141::ArchiveOptions theOptions;
+        theOptions.layout = theLayout;
+        theOptions.tailPacking = true;
+        theOptions.memoryMapped = true;
+        auto theArchive = ECE141::Archive::createArchive(theArcName, theOptions);
+        ASSERT_TRUE(theArchive.isOK());
+        auto checkFiles = [&](size_t aCount) {
+            for (size_t i = 0; i < aCount; i++) {
+                std::string theName = "mapped" + std::to_string(i) + ".txt";
+                ASSERT_TRUE(theArchive.getValue()->extract(theName, theOut).isOK()) << theName;
+                EXPECT_EQ(readFile(theFiles[i]), readFile(theOut)) << theName;
+            }
+        };
+        //extracts in between adds: each one past the mapped end remaps
+        for (size_t i = 0; i < theFiles.size(); i++) {
+            ASSERT_TRUE(theArchive.getValue()->add(theFiles[i]).isOK());
+            checkFiles(i + 1);
+        }
+        //shrinking drops the mapping before the file gets shorter
+        ASSERT_TRUE(theArchive.getValue()->remove("mapped7.txt").isOK());
+        ASSERT_TRUE(theArchive.getValue()->compactInPlace().isOK());
+        checkFiles(7);
+        ASSERT_TRUE(theArchive.getValue()->compact().isOK());
+        checkFiles(7);
+        theArchive.getValue()->setMemoryMapped(false);
+        checkFiles(7);
+    }
+}
+
+TEST(ArchiveTest, BlockDevicePositionalIO) {
+    std::string thePath = (fs::temp_directory_path() / "device.bin").string();
+    ECE141::BlockDevice theDevice;
+    ASSERT_TRUE(theDevice.open(thePath, true));
+    EXPECT_EQ(0u, theDevice.size());
+
+    //threads write and read back their own slices at once (no shared cursor to fight over)
+    const size_t theSlice = 64 * 1024;
+    std::vector<std::thread> theThreads;
+    std::atomic<int> theBad{0};
+    for (size_t t = 0; t < 8; t++) {
+        theThreads.emplace_back([&, t]() {
+            std::vector<uint8_t> theData(theSlice, static_cast<uint8_t>('a' + t)), theBack(theSlice);
+            for (int i = 0; i < 20; i++) {
+                if (!theDevice.writeAt(theData.data(), t * theSlice, theSlice) ||
+                    !theDevice.readAt(theBack.data(), t * theSlice, theSlice) || theBack != theData) {
+                    theBad++;
+                }
+            }
+        });
+    }
+    for (auto &theThread : theThreads) theThread.join();
+    EXPECT_EQ(0, theBad.load());
+    EXPECT_EQ(8 * theSlice, theDevice.size());
+
+    //scattered read across slices 0/1: even 100-byte pieces into one buffer, odd ones into another
+    std::vector<uint8_t> theEven(500), theOdd(500);
+    std::vector<ECE141::IOPiece> thePieces;
+    for (size_t i = 0; i < 10; i++) {
+        thePieces.push_back({(i % 2 ? theOdd : theEven).data() + i / 2 * 100, 100});
+    }
+    ASSERT_TRUE(theDevice.readPieces(thePieces, theSlice - 500));
+    EXPECT_EQ(std::string(300, 'a') + std::string(200, 'b'), std::string(theEven.begin(), theEven.end()));
+    EXPECT_EQ(std::string(200, 'a') + std::string(300, 'b'), std::string(theOdd.begin(), theOdd.end()));
+
+    //reads past the end fail instead of coming back short
+    std::vector<uint8_t> theTail(10);
+    ASSERT_TRUE(theDevice.resize(theSlice));
+    EXPECT_FALSE(theDevice.readAt(theTail.data(), theSlice - 5, theTail.size()));
+    EXPECT_TRUE(theDevice.readAt(theTail.data(), theSlice - 10, theTail.size()));
+    EXPECT_TRUE(theDevice.sync());
+    theDevice.close();
+    fs::remove(thePath);
+}
+
+TEST(ArchiveTest, BlockRefCounts) {
+    ECE141::BlockRefs theRefs;
+    theRefs.addRefs({{10, 5}});
+    theRefs.addRefs({{12, 5}}); //overlap counts twice
+    EXPECT_EQ(3u, theRefs.runCount());
+    EXPECT_TRUE(theRefs.isShared(16));
+    EXPECT_FALSE(theRefs.isShared(17));
+
+    auto theFree = theRefs.release({{10, 10}}); //live lets go: only the unshared part is free now
+    ASSERT_EQ(1u, theFree.size());
+    EXPECT_EQ(17u, theFree[0].start);
+    EXPECT_EQ(3u, theFree[0].length);
+
+    theFree = theRefs.dropRefs({{10, 5}});
+    ASSERT_EQ(1u, theFree.size());
+    EXPECT_EQ(10u, theFree[0].start);
+    EXPECT_EQ(2u, theFree[0].length);
+    theFree = theRefs.dropRefs({{12, 5}});
+    ASSERT_EQ(1u, theFree.size());
+    EXPECT_EQ(12u, theFree[0].start);
+    EXPECT_EQ(5u, theFree[0].length);
+    EXPECT_EQ(0u, theRefs.runCount());
+
+    theRefs.addRefs({{20, 4}});
+    EXPECT_TRUE(theRefs.dropRefs({{20, 4}}).empty()); //still live: nothing to free
+}
+
+TEST(ArchiveTest, Snapshots) {
+    std::string theArcName = (fs::temp_directory_path() / "snap").string();
+    std::string theCrashName = (fs::temp_directory_path() / "snap-crash").string();
+    std::string theOut = (fs::temp_directory_path() / "snap-out.txt").string();
+    std::string theOld = makeTestFile("snap-old.txt", 3 * ECE141::kBlockSize + 100);
+    std::string theKept = makeTestFile("snap-kept.txt", 2000);
+    std::string theNew = makeTestFile("snap-new.txt", 0);
+    std::ofstream(theNew, std::ios::binary) << std::string(5 * ECE141::kBlockSize, 'z'); //differs from the rest
+    ECE141::ArchiveOptions theOptions;
+    theOptions.tailPacking = true;
+    theOptions.allocation = ECE141::AllocationPolicy::firstFit; //would reuse freed blocks right away
+    {
+        auto theArchive = ECE141::Archive::createArchive(theArcName, theOptions);
+        ASSERT_TRUE(theArchive.isOK());
+        ECE141::Archive &theArc = *theArchive.getValue();
+        ASSERT_TRUE(theArc.add(theOld).isOK());
+        ASSERT_TRUE(theArc.add(theKept).isOK());
+        ASSERT_TRUE(theArc.snapshot("nightly").isOK());
+        EXPECT_FALSE(theArc.snapshot("nightly").isOK());
+
+        //the live side moves on; the snapshot's blocks aren't reused
+        ASSERT_TRUE(theArc.remove("snap-old.txt").isOK());
+        ASSERT_TRUE(theArc.add(theNew).isOK());
+        ASSERT_TRUE(theArc.compactInPlace().isOK());
+        EXPECT_FALSE(theArc.extract("snap-old.txt", theOut).isOK());
+        ASSERT_TRUE(theArc.extractSnapshot("nightly", "snap-old.txt", theOut).isOK());
+        EXPECT_EQ(readFile(theOld), readFile(theOut));
+        EXPECT_FALSE(theArc.extractSnapshot("nightly", "snap-new.txt", theOut).isOK());
+        std::stringstream theList;
+        EXPECT_EQ(2u, theArc.listSnapshot("nightly", theList).getValue());
+        EXPECT_EQ(1u, theArc.listSnapshots(theList).getValue());
+        EXPECT_FALSE(theArc.compact().isOK()); //would drop the snapshot's blocks
+
+        fs::copy_file(theArcName + ".arc", theCrashName + ".arc", fs::copy_options::overwrite_existing);
+        fs::copy_file(theArcName + ".arc.journal", theCrashName + ".arc.journal", fs::copy_options::overwrite_existing);
+    }
+
+    for (const auto &theName : {theArcName, theCrashName}) {
+        auto theArchive = ECE141::Archive::openArchive(theName);
+        ASSERT_TRUE(theArchive.isOK());
+        ECE141::Archive &theArc = *theArchive.getValue();
+        ASSERT_TRUE(theArc.add(theOld).isOK()); //re-added live copy mustn't land on the held blocks
+        ASSERT_TRUE(theArc.extractSnapshot("nightly", "snap-old.txt", theOut).isOK());
+        EXPECT_EQ(readFile(theOld), readFile(theOut));
+        ASSERT_TRUE(theArc.extractSnapshot("nightly", "snap-kept.txt", theOut).isOK());
+        EXPECT_EQ(readFile(theKept), readFile(theOut));
+
+        ASSERT_TRUE(theArc.dropSnapshot("nightly").isOK());
+        EXPECT_FALSE(theArc.extractSnapshot("nightly", "snap-old.txt", theOut).isOK());
+        ASSERT_TRUE(theArc.compact().isOK());
+        for (const auto &theFile : {theOld, theKept, theNew}) {
+            ASSERT_TRUE(theArc.extract(fs::path(theFile).filename().string(), theOut).isOK());
+            EXPECT_EQ(readFile(theFile), readFile(theOut));
+        }
+    }
+}
+
 // Run all tests
 int main(int argc, char **argv) {
     ::testing::InitGoogleTest(&argc, argv);